@@ -0,0 +1,91 @@
+#include "admission.h"
+#include "config.h"
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#define ADDR_SLOTS 4096 // power of two
+#define ADDR_LOCKS 64 // each guards every ADDR_LOCKS-th slot
+
+// direct mapped: an address whose slot holds another one takes it over with a full
+// bucket, so a collision can only ever let a connection in, never keep one out
+typedef struct {
+    uint64_t key; // hash of the address, 0 while unused
+    TokenBucket bucket;
+} AddrSlot;
+
+static AddrSlot addr_slots[ADDR_SLOTS];
+static pthread_mutex_t addr_locks[ADDR_LOCKS] = { [0 ... ADDR_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER };
+static int connections = 0;
+
+bool bucket_take(TokenBucket *b, int rate, int burst, uint64_t now_ms){
+    if(now_ms > b->last_ms){
+        int64_t refill = (int64_t)(now_ms - b->last_ms) * rate; // ms times tokens/s is thousandths
+        b->debt = (refill >= b->debt) ? 0 : b->debt - refill;
+        b->last_ms = now_ms;
+    }
+    if(b->debt + 1000 > (int64_t)burst * 1000){
+        return false;
+    }
+    b->debt += 1000;
+    return true;
+}
+
+// FNV-1a over the address bytes only, the port changes with every connection
+static uint64_t hash_address(const struct sockaddr *addr){
+    const unsigned char *bytes;
+    int len;
+    if(addr->sa_family == AF_INET6){
+        bytes = (const unsigned char *)&((const struct sockaddr_in6 *)addr)->sin6_addr;
+        len = 16;
+    }else{
+        bytes = (const unsigned char *)&((const struct sockaddr_in *)addr)->sin_addr;
+        len = 4;
+    }
+
+    uint64_t h = 14695981039346656037ULL ^ addr->sa_family;
+    for(int i = 0; i < len; i++){
+        h ^= bytes[i];
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+bool admit_address(const struct sockaddr *addr, uint64_t now_ms){
+    if(config.addr_rate <= 0){
+        return true;
+    }
+
+    uint64_t key = hash_address(addr);
+    size_t i = key & (ADDR_SLOTS - 1);
+    pthread_mutex_t *lock = &addr_locks[i % ADDR_LOCKS];
+    pthread_mutex_lock(lock);
+    AddrSlot *slot = &addr_slots[i];
+    if(slot->key != key){
+        slot->key = key;
+        memset(&slot->bucket, 0, sizeof(slot->bucket));
+    }
+    bool admitted = bucket_take(&slot->bucket, config.addr_rate, config.addr_burst, now_ms);
+    pthread_mutex_unlock(lock);
+    return admitted;
+}
+
+bool admit_connection(void){
+    if(__atomic_add_fetch(&connections, 1, __ATOMIC_RELAXED) > config.max_connections){
+        __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+void adopt_connection(void){
+    __atomic_add_fetch(&connections, 1, __ATOMIC_RELAXED);
+}
+
+void release_connection(void){
+    __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+}
+
+int open_connections(void){
+    return __atomic_load_n(&connections, __ATOMIC_RELAXED);
+}
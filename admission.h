@@ -0,0 +1,32 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// token bucket kept as the tokens spent and not yet refilled, in thousandths of a
+// token: refilling needs no floating point and a zeroed bucket is a full one, so a
+// bucket inside a freshly allocated Player needs no setting up
+typedef struct {
+    int64_t debt;
+    uint64_t last_ms;
+} TokenBucket;
+
+// refills at rate tokens a second up to burst, then takes one if there is one
+bool bucket_take(TokenBucket *b, int rate, int burst, uint64_t now_ms);
+
+// connection rate per source address, shared by every shard: false once addr has
+// opened more than config.addr_rate a second beyond config.addr_burst. Always true
+// while config.addr_rate is 0
+bool admit_address(const struct sockaddr *addr, uint64_t now_ms);
+
+// connections this process holds, capped at config.max_connections. admit_connection
+// counts one if there is room, adopt_connection counts one regardless (a game worker
+// taking over a pair the acceptor has already admitted)
+bool admit_connection(void);
+void adopt_connection(void);
+void release_connection(void);
+int open_connections(void);
+
+#endif
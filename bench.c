@@ -0,0 +1,686 @@
+#define _GNU_SOURCE
+
+// nimd_bench: drives many concurrent NGP clients against a running server. Every
+// client connects, OPENs under a fresh name, plays its game to the end and starts
+// over with a new connection until the run is done. Each thread owns its clients
+// and one epoll instance, nothing is shared until the final report
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_EVENTS 256
+#define CONNECT_WINDOW 128 // handshakes in flight per thread, a plain listen backlog drops bursts
+#define RX_INITIAL 512
+
+// log-linear latency histogram in ns: 8 sub-buckets per power of two, so any
+// percentile is off by at most 12.5%
+#define HIST_SUB 8
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+enum { LAT_OPEN_WAIT, LAT_OPEN_NAME, LAT_MOVE_PLAY, LAT_KINDS };
+static const char *lat_names[LAT_KINDS] = { "OPEN->WAIT", "OPEN->NAME", "MOVE->PLAY" };
+
+enum { C_IDLE, C_CONNECTING, C_OPENED, C_PLAYING };
+
+typedef struct {
+    int fd;
+    int state;
+    int p_num;
+    int serial; // bumped for every new connection so names stay unique
+    char *rx;
+    int rx_len;
+    int rx_cap;
+    uint64_t open_sent;
+    uint64_t move_sent; // 0 unless a MOVE is waiting for its PLAY
+    uint64_t move_due; // think time over, 0 unless a move is scheduled
+    int move_pile;
+    int move_quantity;
+} Client;
+
+// a scheduled move, stale once the client's move_due no longer matches
+typedef struct {
+    int index;
+    uint64_t due;
+} ThinkEntry;
+
+typedef struct {
+    int id;
+    int first_client;
+    int client_count;
+    Client *clients;
+    int epoll_fd;
+    int connecting;
+    int next_start; // clients below this index have been started once
+    // scheduled moves, think time is constant so due times stay sorted
+    ThinkEntry *think_ring;
+    int think_cap;
+    int think_head;
+    int think_tail;
+    unsigned rng;
+    pthread_t thread;
+
+    uint64_t connects;
+    uint64_t connect_errors;
+    uint64_t moves;
+    uint64_t invalid_moves;
+    uint64_t games;
+    uint64_t protocol_errors;
+    Histogram lat[LAT_KINDS];
+} BenchThread;
+
+static struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int clients;
+    int threads;
+    int seconds;
+    int think_ms;
+    int invalid_pct;
+    const char *queue;
+    const char *stats_path; // server admin socket, read before and after the run
+} opts = { .clients = 1000, .threads = 4, .seconds = 10, .think_ms = 0, .invalid_pct = 0, .queue = NULL,
+           .stats_path = NULL };
+
+static uint64_t run_start;
+static uint64_t run_end;
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int hist_index(uint64_t v){
+    if(v < HIST_SUB){
+        return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - 3; // HIST_SUB == 1 << 3
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1));
+}
+
+static uint64_t hist_value(int index){
+    if(index < HIST_SUB){
+        return index;
+    }
+    int shift = index / HIST_SUB - 1;
+    return (uint64_t)(HIST_SUB + index % HIST_SUB) << shift;
+}
+
+static void hist_add(Histogram *h, uint64_t v){
+    int i = hist_index(v);
+    if(i >= HIST_BUCKETS){
+        i = HIST_BUCKETS - 1;
+    }
+    h->counts[i]++;
+    h->total++;
+    if(v > h->max){
+        h->max = v;
+    }
+}
+
+static uint64_t hist_percentile(const Histogram *h, double pct){
+    if(h->total == 0){
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(h->total * pct / 100.0);
+    uint64_t seen = 0;
+    for(int i = 0; i < HIST_BUCKETS; i++){
+        seen += h->counts[i];
+        if(seen > rank){
+            return hist_value(i);
+        }
+    }
+    return h->max;
+}
+
+static unsigned next_random(BenchThread *t){
+    t->rng = t->rng * 1103515245u + 12345u;
+    return t->rng >> 8;
+}
+
+static void send_frame(BenchThread *t, Client *c, const char *body){
+    char frame[128];
+    int len = snprintf(frame, sizeof(frame), "0|%02d|%s", (int)strlen(body), body);
+    // frames are tiny and the socket buffer is empty between turns, a short write
+    // means the server stopped reading, the next read sees the connection go
+    if(write(c->fd, frame, len) != len){
+        t->protocol_errors++;
+    }
+}
+
+static void push_think(BenchThread *t, int index, uint64_t due){
+    int next = (t->think_tail + 1) % t->think_cap;
+    if(next == t->think_head){ // full, unroll into a ring twice the size
+        int cap = t->think_cap * 2;
+        ThinkEntry *ring = malloc(cap * sizeof(ThinkEntry));
+        if(!ring){
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        int n = 0;
+        for(int i = t->think_head; i != t->think_tail; i = (i + 1) % t->think_cap){
+            ring[n++] = t->think_ring[i];
+        }
+        free(t->think_ring);
+        t->think_ring = ring;
+        t->think_cap = cap;
+        t->think_head = 0;
+        t->think_tail = n;
+        next = n + 1;
+    }
+    t->think_ring[t->think_tail].index = index;
+    t->think_ring[t->think_tail].due = due;
+    t->think_tail = next;
+}
+
+static void start_client(BenchThread *t, int index);
+
+static void close_client(BenchThread *t, int index, bool restart){
+    Client *c = &t->clients[index];
+    if(c->fd >= 0){
+        epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+    }
+    if(c->state == C_CONNECTING){
+        t->connecting--;
+    }
+    c->state = C_IDLE;
+    c->rx_len = 0;
+    c->move_sent = 0;
+    c->move_due = 0;
+    if(restart && now_ns() < run_end){
+        start_client(t, index);
+    }
+}
+
+static void start_client(BenchThread *t, int index){
+    Client *c = &t->clients[index];
+    c->fd = socket(opts.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(c->fd < 0){
+        perror("socket");
+        t->connect_errors++;
+        return;
+    }
+
+    c->serial++;
+    c->state = C_CONNECTING;
+    t->connecting++;
+    if(connect(c->fd, (struct sockaddr *)&opts.addr, opts.addr_len) < 0 && errno != EINPROGRESS){
+        t->connect_errors++;
+        close_client(t, index, false);
+        return;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    ev.data.u32 = index;
+    epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+static void on_connected(BenchThread *t, int index){
+    Client *c = &t->clients[index];
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if(err != 0){
+        t->connect_errors++;
+        close_client(t, index, true);
+        return;
+    }
+
+    t->connecting--;
+    t->connects++;
+    c->state = C_OPENED;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.u32 = index;
+    epoll_ctl(t->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+
+    char body[64];
+    if(opts.queue){
+        snprintf(body, sizeof(body), "OPEN|b%d.%d|%s|", t->first_client + index, c->serial, opts.queue);
+    }else{
+        snprintf(body, sizeof(body), "OPEN|b%d.%d|", t->first_client + index, c->serial);
+    }
+    c->open_sent = now_ns();
+    send_frame(t, c, body);
+}
+
+// picks the move now while the board is at hand, it is sent once the think time is over
+static void plan_move(BenchThread *t, int index, char *board){
+    Client *c = &t->clients[index];
+
+    int chosen = 0;
+    int chosen_size = 0;
+    int seen = 0;
+    int pile = 0;
+    char *save;
+    for(char *tok = strtok_r(board, " ", &save); tok; tok = strtok_r(NULL, " ", &save)){
+        pile++;
+        int size = atoi(tok);
+        if(size > 0 && (int)(next_random(t) % ++seen) == 0){ // reservoir pick
+            chosen = pile;
+            chosen_size = size;
+        }
+    }
+    if(chosen == 0){
+        t->protocol_errors++;
+        return;
+    }
+
+    c->move_pile = chosen;
+    c->move_quantity = 1 + next_random(t) % chosen_size;
+    if((int)(next_random(t) % 100) < opts.invalid_pct){
+        c->move_quantity = chosen_size + 1;
+    }
+
+    c->move_due = now_ns() + (uint64_t)opts.think_ms * 1000000ULL;
+    push_think(t, index, c->move_due);
+}
+
+static void send_due_moves(BenchThread *t, uint64_t now){
+    while(t->think_head != t->think_tail){
+        ThinkEntry *e = &t->think_ring[t->think_head];
+        if(e->due > now){
+            break;
+        }
+        t->think_head = (t->think_head + 1) % t->think_cap;
+        Client *c = &t->clients[e->index];
+        if(c->move_due != e->due || c->state != C_PLAYING){
+            continue; // game ended while the client was thinking
+        }
+
+        char body[48];
+        snprintf(body, sizeof(body), "MOVE|%d|%d|", c->move_pile, c->move_quantity);
+        c->move_due = 0;
+        c->move_sent = now_ns();
+        t->moves++;
+        send_frame(t, c, body);
+    }
+}
+
+// returns false once the connection has been closed
+static bool on_frame(BenchThread *t, int index, char *body){
+    Client *c = &t->clients[index];
+    uint64_t now = now_ns();
+
+    char *fields[4] = { NULL, NULL, NULL, NULL };
+    int n = 0;
+    for(char *s = body; n < 4 && *s; ){
+        fields[n++] = s;
+        char *bar = strchr(s, '|');
+        if(!bar){
+            break;
+        }
+        *bar = '\0';
+        s = bar + 1;
+    }
+    if(n == 0){
+        t->protocol_errors++;
+        close_client(t, index, true);
+        return false;
+    }
+
+    if(strcmp(fields[0], "WAIT") == 0){
+        hist_add(&t->lat[LAT_OPEN_WAIT], now - c->open_sent);
+    }else if(strcmp(fields[0], "NAME") == 0 && fields[1]){
+        hist_add(&t->lat[LAT_OPEN_NAME], now - c->open_sent);
+        c->p_num = atoi(fields[1]);
+        c->state = C_PLAYING;
+    }else if(strcmp(fields[0], "PLAY") == 0 && fields[2]){
+        if(c->move_sent){
+            hist_add(&t->lat[LAT_MOVE_PLAY], now - c->move_sent);
+            c->move_sent = 0;
+        }
+        if(atoi(fields[1]) == c->p_num && c->move_due == 0){
+            plan_move(t, index, fields[2]);
+        }
+    }else if(strcmp(fields[0], "FAIL") == 0){
+        if(fields[1] && strncmp(fields[1], "33", 2) == 0){
+            t->invalid_moves++; // the PLAY that follows resends the board
+        }else{
+            t->protocol_errors++;
+            close_client(t, index, true);
+            return false;
+        }
+    }else if(strcmp(fields[0], "OVER") == 0){
+        if(c->p_num == 1){
+            t->games++; // both players see it, count it once
+        }
+        close_client(t, index, true);
+        return false;
+    }else{
+        t->protocol_errors++;
+    }
+    return true;
+}
+
+// same framing as tests.c's get_msg, but over whatever has arrived so far, and the
+// length field may be wider than two digits for large boards
+static void on_readable(BenchThread *t, int index){
+    Client *c = &t->clients[index];
+    while(1){
+        if(c->rx_len == c->rx_cap){
+            int cap = c->rx_cap ? c->rx_cap * 2 : RX_INITIAL;
+            char *rx = realloc(c->rx, cap);
+            if(!rx){
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            c->rx = rx;
+            c->rx_cap = cap;
+        }
+
+        ssize_t got = read(c->fd, c->rx + c->rx_len, c->rx_cap - c->rx_len);
+        if(got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)){
+            t->protocol_errors++; // the server never hangs up first in a clean game
+            close_client(t, index, true);
+            return;
+        }
+        if(got < 0){
+            return;
+        }
+        c->rx_len += got;
+
+        int pos = 0;
+        while(1){
+            char *frame = c->rx + pos;
+            int avail = c->rx_len - pos;
+            char *bar = (avail > 2) ? memchr(frame + 2, '|', avail - 2) : NULL;
+            if(!bar){
+                break;
+            }
+            int body_len = atoi(frame + 2);
+            int header_len = bar - frame + 1;
+            if((frame[0] != '0' && frame[0] != '2') || frame[1] != '|' || body_len <= 0){ // '2': a wide board frame
+                t->protocol_errors++;
+                close_client(t, index, true);
+                return;
+            }
+            if(avail < header_len + body_len){
+                break;
+            }
+
+            char saved = frame[header_len + body_len];
+            frame[header_len + body_len] = '\0';
+            if(!on_frame(t, index, frame + header_len)){
+                return;
+            }
+            frame[header_len + body_len] = saved;
+            pos += header_len + body_len;
+        }
+
+        memmove(c->rx, c->rx + pos, c->rx_len - pos);
+        c->rx_len -= pos;
+    }
+}
+
+static void *bench_main(void *arg){
+    BenchThread *t = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while(1){
+        uint64_t now = now_ns();
+        if(now >= run_end){
+            break;
+        }
+
+        // ramp up: a burst of tens of thousands of SYNs would just overflow the backlog
+        while(t->next_start < t->client_count && t->connecting < CONNECT_WINDOW){
+            start_client(t, t->next_start++);
+        }
+
+        int timeout = 100;
+        if(t->think_head != t->think_tail){
+            uint64_t due = t->think_ring[t->think_head].due;
+            timeout = (due > now) ? (int)((due - now) / 1000000) : 0;
+        }
+
+        int n = epoll_wait(t->epoll_fd, events, MAX_EVENTS, timeout);
+        for(int i = 0; i < n; i++){
+            int index = events[i].data.u32;
+            Client *c = &t->clients[index];
+            if(c->state == C_CONNECTING){
+                if(events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)){
+                    on_connected(t, index);
+                }
+                continue;
+            }
+            if(c->state != C_IDLE){
+                on_readable(t, index);
+            }
+        }
+        send_due_moves(t, now_ns());
+    }
+
+    for(int i = 0; i < t->client_count; i++){
+        if(t->clients[i].fd >= 0){
+            close(t->clients[i].fd);
+        }
+        free(t->clients[i].rx);
+    }
+    close(t->epoll_fd);
+    return NULL;
+}
+
+static void usage(const char *prog){
+    fprintf(stderr, "Usage: %s [-c clients] [-T threads] [-d seconds] [-k think_ms] "
+            "[-i invalid_pct] [-q queue] [-h host] [-s server_stats_socket] <port>\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static void resolve(const char *host, const char *port){
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if(err != 0){
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&opts.addr, res->ai_addr, res->ai_addrlen);
+    opts.addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+}
+
+// one counter from the server's stats snapshot, -1 if it cannot be read
+static long long server_counter(const char *name){
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, opts.stats_path, sizeof(addr.sun_path) - 1);
+    if(fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        perror(opts.stats_path);
+        if(fd >= 0){
+            close(fd);
+        }
+        return -1;
+    }
+
+    static char snapshot[16 * 1024];
+    int len = 0;
+    ssize_t n;
+    while(len < (int)sizeof(snapshot) - 1 && (n = read(fd, snapshot + len, sizeof(snapshot) - 1 - len)) > 0){
+        len += n;
+    }
+    close(fd);
+    snapshot[len] = '\0';
+
+    size_t name_len = strlen(name);
+    for(char *line = snapshot; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL){
+        if(strncmp(line, name, name_len) == 0 && line[name_len] == ' '){
+            return atoll(line + name_len + 1);
+        }
+    }
+    return -1;
+}
+
+// every client needs an fd, ask for as many as the hard limit allows
+static void raise_fd_limit(int needed){
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) < 0){
+        return;
+    }
+    if(rl.rlim_cur < (rlim_t)needed + 64){
+        rl.rlim_cur = (rl.rlim_max < (rlim_t)needed + 64) ? rl.rlim_max : (rlim_t)needed + 64;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if(rl.rlim_cur < (rlim_t)needed + 64){
+        fprintf(stderr, "warning: fd limit %llu is below %d clients\n",
+                (unsigned long long)rl.rlim_cur, needed);
+    }
+}
+
+static long long syscalls_before = -1;
+static long long moves_before = -1;
+
+static void report(BenchThread *threads){
+    BenchThread sum;
+    memset(&sum, 0, sizeof(sum));
+    for(int i = 0; i < opts.threads; i++){
+        BenchThread *t = &threads[i];
+        sum.connects += t->connects;
+        sum.connect_errors += t->connect_errors;
+        sum.moves += t->moves;
+        sum.invalid_moves += t->invalid_moves;
+        sum.games += t->games;
+        sum.protocol_errors += t->protocol_errors;
+        for(int k = 0; k < LAT_KINDS; k++){
+            for(int b = 0; b < HIST_BUCKETS; b++){
+                sum.lat[k].counts[b] += t->lat[k].counts[b];
+            }
+            sum.lat[k].total += t->lat[k].total;
+            if(t->lat[k].max > sum.lat[k].max){
+                sum.lat[k].max = t->lat[k].max;
+            }
+        }
+    }
+
+    double secs = (now_ns() - run_start) / 1e9;
+    printf("clients %d, threads %d, %.1fs\n", opts.clients, opts.threads, secs);
+    printf("connections %llu (%.0f/s), connect errors %llu\n", (unsigned long long)sum.connects,
+           sum.connects / secs, (unsigned long long)sum.connect_errors);
+    printf("moves %llu (%.0f/s), invalid %llu, games %llu, protocol errors %llu\n",
+           (unsigned long long)sum.moves, sum.moves / secs, (unsigned long long)sum.invalid_moves,
+           (unsigned long long)sum.games, (unsigned long long)sum.protocol_errors);
+    printf("%-12s %10s %10s %10s %10s %10s\n", "latency(us)", "count", "p50", "p99", "p999", "max");
+    for(int k = 0; k < LAT_KINDS; k++){
+        Histogram *h = &sum.lat[k];
+        printf("%-12s %10llu %10.1f %10.1f %10.1f %10.1f\n", lat_names[k], (unsigned long long)h->total,
+               hist_percentile(h, 50) / 1e3, hist_percentile(h, 99) / 1e3,
+               hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+    }
+
+    // the server's own count, so it covers whatever backend it runs and every thread
+    if(opts.stats_path && syscalls_before >= 0){
+        long long syscalls = server_counter("io_syscalls") - syscalls_before;
+        long long moves = server_counter("moves") - moves_before;
+        if(moves > 0){
+            printf("server I/O syscalls %lld, %.2f per move\n", syscalls, (double)syscalls / moves);
+        }
+    }
+}
+
+int main(int argc, char *argv[]){
+    const char *host = "127.0.0.1";
+    int opt;
+    while((opt = getopt(argc, argv, "c:T:d:k:i:q:h:s:")) != -1){
+        switch(opt){
+        case 'c': opts.clients = atoi(optarg); break;
+        case 'T': opts.threads = atoi(optarg); break;
+        case 'd': opts.seconds = atoi(optarg); break;
+        case 'k': opts.think_ms = atoi(optarg); break;
+        case 'i': opts.invalid_pct = atoi(optarg); break;
+        case 'q': opts.queue = optarg; break;
+        case 'h': host = optarg; break;
+        case 's': opts.stats_path = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1 || opts.clients <= 0 || opts.threads <= 0 || opts.seconds <= 0 ||
+       opts.think_ms < 0 || opts.invalid_pct < 0 || opts.invalid_pct > 100){
+        usage(argv[0]);
+    }
+    if(opts.threads > opts.clients){
+        opts.threads = opts.clients;
+    }
+    resolve(host, argv[optind]);
+    raise_fd_limit(opts.clients);
+
+    BenchThread *threads = calloc(opts.threads, sizeof(BenchThread));
+    if(!threads){
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    if(opts.stats_path){
+        syscalls_before = server_counter("io_syscalls");
+        moves_before = server_counter("moves");
+    }
+    run_start = now_ns();
+    run_end = run_start + (uint64_t)opts.seconds * 1000000000ULL;
+
+    int first = 0;
+    for(int i = 0; i < opts.threads; i++){
+        BenchThread *t = &threads[i];
+        t->id = i;
+        t->first_client = first;
+        t->client_count = opts.clients / opts.threads + (i < opts.clients % opts.threads);
+        first += t->client_count;
+        t->clients = calloc(t->client_count, sizeof(Client));
+        t->think_cap = t->client_count + 1;
+        t->think_ring = calloc(t->think_cap, sizeof(ThinkEntry));
+        t->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        t->rng = 2654435761u * (i + 1);
+        if(!t->clients || !t->think_ring || t->epoll_fd < 0){
+            perror("bench setup");
+            exit(EXIT_FAILURE);
+        }
+        for(int c = 0; c < t->client_count; c++){
+            t->clients[c].fd = -1;
+        }
+        if(pthread_create(&t->thread, NULL, bench_main, t) != 0){
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for(int i = 0; i < opts.threads; i++){
+        pthread_join(threads[i].thread, NULL);
+    }
+    report(threads);
+
+    for(int i = 0; i < opts.threads; i++){
+        free(threads[i].clients);
+        free(threads[i].think_ring);
+    }
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,36 @@
+#include "bot.h"
+#include "config.h"
+#include <stdint.h>
+#include <string.h>
+
+static __thread uint64_t rng_state;
+
+void bot_init(void){
+    strategy_init();
+}
+
+Player *bot_new(void){
+    Player *bot = new_player();
+    if(bot){
+        strcpy(bot->name, BOT_NAME);
+        bot->bot = true;
+    }
+    return bot;
+}
+
+void bot_move(Game *g, Player *bot){
+    if(board_over(&g->board)){
+        return;
+    }
+    Move move = strategy_move(&g->board, config.bot_level, &rng_state);
+
+    // handed over already decoded, as a binary MOVE is
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.version = BIN_VERSION;
+    strcpy(msg.type, "MOVE");
+    msg.field_num = 2;
+    msg.values[0] = move.pile;
+    msg.values[1] = move.quantity;
+    handle_move(g, bot, &msg);
+}
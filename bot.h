@@ -0,0 +1,19 @@
+#ifndef BOT_H
+#define BOT_H
+
+#include "handlers.h"
+
+#define BOT_NAME "nimbot"
+#define BOT_LEVELS STRATEGY_LEVELS // 0 plays at random, 3 never misses a winning move
+
+// server-side opponent for a player left waiting longer than config.bot_wait, it plays
+// the engine's strategy of level config.bot_level. bot_init builds its tablebase
+void bot_init(void);
+
+// a Player with no socket, whatever is queued for it is discarded on flush
+Player *bot_new(void);
+
+// plays the bot's turn through handle_move, like a MOVE frame from a client would
+void bot_move(Game *g, Player *bot);
+
+#endif
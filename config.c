@@ -0,0 +1,311 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "config.h"
+#include "message.h"
+#include "send.h"
+#include "bot.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+Config config = {
+    .port = 0,
+    .out_hwm = 64 * 1024,
+    .workers = 0, // core count
+    .game_procs = 0,
+    .bot_wait = 0,
+    .bot_level = BOT_LEVELS - 1,
+    .log_level = LOG_INFO,
+    .handshake_timeout = 10 * 1000,
+    .turn_timeout = 60 * 1000,
+    .idle_timeout = 5 * 60 * 1000,
+    .io_backend = IO_EPOLL,
+    .journal_dir = NULL,
+    .stats_path = NULL,
+    .max_connections = 0,
+    .max_waiting = 0,
+    .frame_rate = 50,
+    .frame_burst = 100,
+    .addr_rate = 0,
+    .addr_burst = 0,
+    .bind_addr = NULL,
+    .backlog = 4096, // bursts of connects queue instead of being dropped, somaxconn caps it
+    .nodelay = 1, // a PLAY must not sit out Nagle behind the opponent's delayed ACK
+    .defer_accept = -1, // the handshake timeout, unless set
+    .rcvbuf = 0,
+    .sndbuf = 0,
+};
+
+static void usage(const char *prog){
+    fprintf(stderr, "Usage: %s [-f config_file] [-A bind_addr] [-L backlog] [-N nodelay 0|1] [-D defer_accept_s] [-R rcvbuf_bytes] [-S sndbuf_bytes] [-o out_hwm_bytes] [-t threads] [-P game_procs] [-b bot_wait_ms] [-l bot_level] [-s stats_socket] [-v log_level] [-H handshake_ms] [-M move_ms] [-I idle_ms] [-E epoll|uring] [-j journal_dir] [-C max_connections] [-W max_waiting] [-r frames_per_s[:burst]] [-a conns_per_addr_s[:burst]] [port]\n"
+            "Config file lines are \"key value\" with the long names: port bind backlog nodelay defer_accept rcvbuf sndbuf threads game_procs out_hwm bot_wait bot_level stats_socket log_level handshake_ms move_ms idle_ms io journal max_connections max_waiting frame_rate addr_rate\n"
+            "Signals: SIGQUIT drains (no new games, exit after the last), SIGUSR2 hands every connection and game over to a fresh start of the binary\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static int parse_timeout(const char *arg, const char *what){
+    int ms = atoi(arg);
+    if(ms < 0){
+        fprintf(stderr, "Invalid %s timeout.\n", what);
+        exit(EXIT_FAILURE);
+    }
+    return ms;
+}
+
+// socket buffer size in bytes with an optional k or m suffix, 0 leaves it to the
+// kernel's autotuning
+static int parse_size(const char *arg, const char *what){
+    char *end;
+    long bytes = strtol(arg, &end, 10);
+    if(*end == 'k' || *end == 'K'){
+        bytes *= 1024;
+        end++;
+    }else if(*end == 'm' || *end == 'M'){
+        bytes *= 1024 * 1024;
+        end++;
+    }
+    if(*end != '\0' || bytes < 0 || bytes > (1 << 30)){
+        fprintf(stderr, "Invalid %s buffer size.\n", what);
+        exit(EXIT_FAILURE);
+    }
+    return (int)bytes;
+}
+
+// "rate[:burst]", the burst defaults to twice the rate
+static void parse_rate(const char *arg, const char *what, int *rate, int *burst){
+    char *end;
+    *rate = (int)strtol(arg, &end, 10);
+    *burst = (*end == ':') ? (int)strtol(end + 1, &end, 10) : 2 * *rate;
+    if(*end != '\0' || *rate < 0 || (*rate > 0 && *burst < 1)){
+        fprintf(stderr, "Invalid %s rate.\n", what);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// one setting by its option letter, from the command line or the config file
+static void set_option(int opt, const char *arg, const char *prog){
+    switch(opt){
+    case 'o':
+        config.out_hwm = atoi(arg);
+        if(config.out_hwm <= max_board_frame_length()){
+            fprintf(stderr, "Output high-water mark must exceed %d bytes.\n", max_board_frame_length());
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case 't':
+        config.workers = atoi(arg);
+        if(config.workers <= 0){
+            fprintf(stderr, "Invalid thread count.\n");
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case 'P':
+        config.game_procs = atoi(arg);
+        if(config.game_procs < 0){
+            fprintf(stderr, "Invalid game process count.\n");
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case 'b':
+        config.bot_wait = atoi(arg);
+        if(config.bot_wait < 0){
+            fprintf(stderr, "Invalid bot wait.\n");
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case 'l':
+        config.bot_level = atoi(arg);
+        if(config.bot_level < 0 || config.bot_level >= BOT_LEVELS){
+            fprintf(stderr, "Bot level must be between 0 and %d.\n", BOT_LEVELS - 1);
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case 's':
+        config.stats_path = arg;
+        break;
+    case 'j':
+        config.journal_dir = arg;
+        break;
+    case 'v':
+        config.log_level = atoi(arg);
+        if(config.log_level < 0 || config.log_level >= LOG_LEVELS){
+            fprintf(stderr, "Log level must be between 0 (debug) and %d (warnings only).\n", LOG_LEVELS - 1);
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case 'H':
+        config.handshake_timeout = parse_timeout(arg, "handshake");
+        break;
+    case 'M':
+        config.turn_timeout = parse_timeout(arg, "move");
+        break;
+    case 'I':
+        config.idle_timeout = parse_timeout(arg, "idle");
+        break;
+    case 'E':
+        if(strcmp(arg, "epoll") == 0){
+            config.io_backend = IO_EPOLL;
+        }else if(strcmp(arg, "uring") == 0){
+            config.io_backend = IO_URING;
+        }else{
+            fprintf(stderr, "I/O backend must be epoll or uring.\n");
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case 'C':
+        config.max_connections = atoi(arg);
+        if(config.max_connections <= 0){
+            fprintf(stderr, "Invalid connection limit.\n");
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case 'W':
+        config.max_waiting = atoi(arg);
+        if(config.max_waiting < 0){
+            fprintf(stderr, "Invalid waiting player limit.\n");
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case 'r':
+        parse_rate(arg, "frame", &config.frame_rate, &config.frame_burst);
+        if(config.frame_rate == 0){
+            fprintf(stderr, "Frame rate must be positive.\n");
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case 'a':
+        parse_rate(arg, "address", &config.addr_rate, &config.addr_burst);
+        break;
+    case 'f':
+        break; // read before everything else
+    case 'A':
+        config.bind_addr = arg;
+        break;
+    case 'L':
+        config.backlog = atoi(arg);
+        if(config.backlog <= 0){
+            fprintf(stderr, "Invalid listen backlog.\n");
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case 'N':
+        config.nodelay = atoi(arg);
+        if(config.nodelay != 0 && config.nodelay != 1){
+            fprintf(stderr, "TCP_NODELAY must be 0 or 1.\n");
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case 'D':
+        config.defer_accept = atoi(arg);
+        if(config.defer_accept < 0){
+            fprintf(stderr, "Invalid TCP_DEFER_ACCEPT seconds.\n");
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case 'R':
+        config.rcvbuf = parse_size(arg, "receive");
+        break;
+    case 'S':
+        config.sndbuf = parse_size(arg, "send");
+        break;
+    case 'p':
+        config.port = atoi(arg);
+        if(config.port <= 0 || config.port > 65535){
+            fprintf(stderr, "Invalid port number.\n");
+            exit(EXIT_FAILURE);
+        }
+        break;
+    default:
+        usage(prog);
+    }
+}
+
+// config file keys, each the long name of an option letter. Lines are "key value" or
+// "key = value", # starts a comment
+static const struct {
+    const char *key;
+    int opt;
+} file_keys[] = {
+    { "port", 'p' }, { "bind", 'A' }, { "backlog", 'L' }, { "nodelay", 'N' }, { "defer_accept", 'D' },
+    { "rcvbuf", 'R' }, { "sndbuf", 'S' }, { "threads", 't' }, { "game_procs", 'P' }, { "out_hwm", 'o' },
+    { "bot_wait", 'b' }, { "bot_level", 'l' }, { "stats_socket", 's' }, { "log_level", 'v' },
+    { "handshake_ms", 'H' }, { "move_ms", 'M' }, { "idle_ms", 'I' }, { "io", 'E' }, { "journal", 'j' },
+    { "max_connections", 'C' }, { "max_waiting", 'W' }, { "frame_rate", 'r' }, { "addr_rate", 'a' },
+};
+
+static void load_file(const char *path, const char *prog){
+    FILE *f = fopen(path, "r");
+    if(!f){
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    char line[512];
+    int number = 0;
+    while(fgets(line, sizeof(line), f)){
+        number++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        char *key = line + strspn(line, " \t");
+        if(*key == '\0'){
+            continue;
+        }
+        char *value = key + strcspn(key, " \t=");
+        if(*value != '\0'){
+            *value++ = '\0';
+        }
+        value += strspn(value, " \t=");
+        value[strcspn(value, " \t")] = '\0';
+
+        size_t i = 0;
+        while(i < sizeof(file_keys) / sizeof(file_keys[0]) && strcmp(file_keys[i].key, key) != 0){
+            i++;
+        }
+        if(i == sizeof(file_keys) / sizeof(file_keys[0]) || *value == '\0'){
+            fprintf(stderr, "%s:%d: unknown setting or missing value\n", path, number);
+            exit(EXIT_FAILURE);
+        }
+        char *copy = strdup(value); // paths and addresses are kept for good
+        if(!copy){
+            perror("strdup");
+            exit(EXIT_FAILURE);
+        }
+        set_option(file_keys[i].opt, copy, prog);
+    }
+    fclose(f);
+}
+
+void parse_config(int argc, char *argv[]){
+    static const char *options = "f:o:t:P:b:l:s:v:H:M:I:E:j:C:W:r:a:A:L:N:D:R:S:";
+
+    // the file first wherever -f is, so the command line overrides it
+    int opt;
+    opterr = 0;
+    while((opt = getopt(argc, argv, options)) != -1){
+        if(opt == 'f'){
+            load_file(optarg, argv[0]);
+        }
+    }
+    optind = 0; // 0, not 1, also resets getopt's position inside a group like -t2
+    opterr = 1;
+    while((opt = getopt(argc, argv, options)) != -1){
+        set_option(opt, optarg, argv[0]);
+    }
+
+    if(optind == argc - 1){
+        set_option('p', argv[optind], argv[0]);
+    }else if(optind != argc || config.port == 0){
+        usage(argv[0]);
+    }
+
+    if(config.workers == 0){
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        config.workers = (cores > 0) ? (int)cores : 1;
+    }
+    // a connection wakes a shard only once its OPEN is in. One that sends nothing is
+    // still handed over when the deferral runs out, and the handshake timer closes it
+    if(config.defer_accept < 0){
+        config.defer_accept = (config.handshake_timeout + 999) / 1000;
+    }
+}
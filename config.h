@@ -0,0 +1,40 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+enum { IO_EPOLL, IO_URING };
+
+typedef struct {
+    int port;
+    int out_hwm; // bytes a client may have queued and unread before it is dropped
+    int workers; // reactor threads, each with its own SO_REUSEPORT listener
+    int game_procs; // pre-forked game worker processes, 0 runs games in the reactor threads
+    int bot_wait; // ms a player waits for an opponent before the bot takes the seat, 0 disables it
+    int bot_level; // bot strength, 0 (random) to BOT_LEVELS - 1 (perfect)
+    int log_level; // LOG_DEBUG, LOG_INFO or LOG_WARN, records below it are not queued
+    int handshake_timeout; // ms from accept until OPEN before the connection is closed, 0 disables it
+    int turn_timeout; // ms a player has for each move before forfeiting, 0 disables it
+    int idle_timeout; // ms a waiting player may stay silent before it is disconnected, 0 disables it
+    int io_backend; // IO_EPOLL or IO_URING, the same handlers run on either
+    const char *journal_dir; // directory for the game journal, NULL if off
+    const char *stats_path; // Unix socket answering every connection with a stats snapshot, NULL if off
+    int max_connections; // client sockets held at once, 0 sizes it from the fd limit at startup
+    int max_waiting; // players waiting for an opponent across every queue, 0 for no cap
+    int frame_rate; // frames a second a connection may send on average
+    int frame_burst; // frames it may send at once, past both it is dropped
+    int addr_rate; // connections a second one source address may open, 0 for no limit
+    int addr_burst;
+    const char *bind_addr; // numeric IPv4 or IPv6 address to listen on, NULL for every address of both
+    int backlog; // accept queue of each listener, the kernel caps it at net.core.somaxconn
+    int nodelay; // TCP_NODELAY on client sockets, 1 unless a frame may wait to be coalesced
+    int defer_accept; // seconds TCP_DEFER_ACCEPT holds a connection back until its OPEN arrives, 0 is off. Defaults to the handshake timeout
+    int rcvbuf; // SO_RCVBUF and SO_SNDBUF of client sockets, 0 leaves them autotuned
+    int sndbuf;
+} Config;
+
+extern Config config;
+
+// fills config from the command line and the config file it names with -f, options on
+// the command line win. Exits with a usage message on bad input
+void parse_config(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,190 @@
+#include "engine.h"
+#include "slab.h"
+#include <time.h>
+
+// standard board states in mixed radix, pile i holds 0..2i+1 stones
+#define TABLE_STATES (2 * 4 * 6 * 8 * 10)
+
+static Move tablebase[TABLE_STATES]; // pile 0 once the board is empty
+
+// chance in percent of playing the best move instead of a random legal one
+static const int optimal_percent[STRATEGY_LEVELS] = { 0, 50, 85, 100 };
+
+int board_for_tag(const char *tag){
+    if(tag[0] != 'B' || tag[1] == '\0'){
+        return STANDARD_PILES;
+    }
+
+    int piles = 0;
+    for(const char *c = tag + 1; *c; c++){
+        if(*c < '0' || *c > '9'){
+            return STANDARD_PILES; // some other tag that happens to start with B
+        }
+        piles = piles * 10 + (*c - '0');
+        if(piles > MAX_PILES){
+            return -1;
+        }
+    }
+    return (piles > 0) ? piles : -1;
+}
+
+bool board_init(Board *b, int pile_count){
+    b->piles = b->small_piles;
+    if(pile_count > STANDARD_PILES){
+        b->piles = counted_malloc(pile_count * sizeof(int));
+        if(!b->piles){
+            b->piles = b->small_piles;
+            return false;
+        }
+    }
+    b->pile_count = pile_count;
+    board_reset(b);
+    return true;
+}
+
+void board_reset(Board *b){
+    b->stones_left = 0;
+    b->nim_sum = 0;
+    for(int i = 0; i < b->pile_count; i++){
+        b->piles[i] = 2 * i + 1;
+        b->stones_left += b->piles[i];
+        b->nim_sum ^= b->piles[i];
+    }
+    b->next_p = 1;
+}
+
+void board_restore(Board *b, const int *piles, int next_p){
+    b->stones_left = 0;
+    b->nim_sum = 0;
+    for(int i = 0; i < b->pile_count; i++){
+        b->piles[i] = piles[i];
+        b->stones_left += piles[i];
+        b->nim_sum ^= piles[i];
+    }
+    b->next_p = next_p;
+}
+
+void board_free(Board *b){
+    if(b->piles && b->piles != b->small_piles){
+        counted_free(b->piles);
+    }
+    b->piles = b->small_piles;
+}
+
+int board_check(const Board *b, int p_num, Move m){
+    if(p_num != b->next_p){
+        return MOVE_NOT_TURN;
+    }
+    if(m.pile < 1 || m.pile > b->pile_count){
+        return MOVE_BAD_PILE;
+    }
+    if(m.quantity < 1 || m.quantity > b->piles[m.pile - 1]){
+        return MOVE_BAD_QUANTITY;
+    }
+    return MOVE_OK;
+}
+
+int board_apply(Board *b, int p_num, Move m){
+    int r = board_check(b, p_num, m);
+    if(r != MOVE_OK){
+        return r;
+    }
+
+    int *slot = &b->piles[m.pile - 1];
+    b->nim_sum ^= *slot ^ (*slot - m.quantity);
+    *slot -= m.quantity;
+    b->stones_left -= m.quantity;
+    if(b->stones_left > 0){
+        b->next_p = (p_num == 1) ? 2 : 1;
+    }
+    return MOVE_OK;
+}
+
+bool board_over(const Board *b){
+    return b->stones_left == 0;
+}
+
+int board_winner(const Board *b){
+    return board_over(b) ? b->next_p : 0;
+}
+
+uint32_t strategy_random(uint64_t *rng){
+    if(*rng == 0){
+        *rng = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)rng;
+        *rng |= 1;
+    }
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+    return (uint32_t)(*rng >> 16);
+}
+
+// best move for any board: empty a pile down to where the nim-sum becomes zero, or
+// take a single stone from the largest pile when the position is already lost
+static Move solve(const int *piles, int count, int nim_sum){
+    Move move = { 0, 0 };
+    for(int i = 0; i < count; i++){
+        if(nim_sum != 0 && (piles[i] ^ nim_sum) < piles[i]){
+            move.pile = i + 1;
+            move.quantity = piles[i] - (piles[i] ^ nim_sum);
+            return move;
+        }
+        if(nim_sum == 0 && piles[i] > 0 && (move.pile == 0 || piles[i] > piles[move.pile - 1])){
+            move.pile = i + 1;
+            move.quantity = 1;
+        }
+    }
+    return move;
+}
+
+static int standard_index(const int *piles){
+    int index = 0;
+    for(int i = STANDARD_PILES - 1; i >= 0; i--){
+        index = index * (2 * i + 2) + piles[i];
+    }
+    return index;
+}
+
+void strategy_init(void){
+    for(int index = 0; index < TABLE_STATES; index++){
+        int piles[STANDARD_PILES];
+        int rest = index;
+        int nim_sum = 0;
+        for(int i = 0; i < STANDARD_PILES; i++){
+            piles[i] = rest % (2 * i + 2);
+            rest /= 2 * i + 2;
+            nim_sum ^= piles[i];
+        }
+        tablebase[index] = solve(piles, STANDARD_PILES, nim_sum);
+    }
+}
+
+// the standard board is a table lookup, larger ones are solved from the running nim-sum
+Move strategy_best(const Board *b){
+    if(b->pile_count == STANDARD_PILES){
+        return tablebase[standard_index(b->piles)];
+    }
+    return solve(b->piles, b->pile_count, b->nim_sum);
+}
+
+// stones are picked uniformly, so larger piles are chosen more often
+Move strategy_random_move(const Board *b, uint64_t *rng){
+    Move move = { 0, 0 };
+    long stone = strategy_random(rng) % b->stones_left;
+    for(int i = 0; i < b->pile_count; i++){
+        if(stone < b->piles[i]){
+            move.pile = i + 1;
+            move.quantity = 1 + strategy_random(rng) % b->piles[i];
+            break;
+        }
+        stone -= b->piles[i];
+    }
+    return move;
+}
+
+Move strategy_move(const Board *b, int level, uint64_t *rng){
+    if((int)(strategy_random(rng) % 100) >= optimal_percent[level]){
+        return strategy_random_move(b, rng);
+    }
+    return strategy_best(b);
+}
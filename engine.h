@@ -0,0 +1,58 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define STANDARD_PILES 5 // 1, 3, 5, 7, 9
+#define MAX_PILES 4096 // largest board a "B<n>" queue tag may ask for
+#define STRATEGY_LEVELS 4 // 0 plays at random, 3 never misses a winning move
+
+// the rules of Nim and nothing else: no players, sockets or output, so the same code
+// referees the networked games (handlers.c wraps it) and the simulated ones (nimd_sim).
+// Whoever takes the last stone wins
+typedef struct {
+    int pile_count;
+    int *piles; // small_piles unless the board is too big for it
+    int small_piles[STANDARD_PILES];
+    long stones_left; // kept up to date by every move so checking for the end is O(1)
+    int nim_sum; // xor of every pile, also kept up to date by every move
+    int next_p; // p_num of whose turn it is, stays with the winner once the board is empty
+} Board;
+
+typedef struct {
+    int pile; // 1-based
+    int quantity;
+} Move;
+
+// why board_check refused a move
+enum { MOVE_OK, MOVE_NOT_TURN, MOVE_BAD_PILE, MOVE_BAD_QUANTITY };
+
+// "B<n>" as the queue tag asks for n piles of 1, 3, 5, ... any other tag plays the
+// standard board. Returns the pile count, -1 if n is out of range
+int board_for_tag(const char *tag);
+
+// pile_count piles of 1, 3, 5, ... with player 1 to move. false if a large board could
+// not be allocated, board_free releases it
+bool board_init(Board *b, int pile_count);
+void board_reset(Board *b); // back to the starting position, same pile count
+// puts the board where a recovered game left off
+void board_restore(Board *b, const int *piles, int next_p);
+void board_free(Board *b);
+
+int board_check(const Board *b, int p_num, Move m);
+// plays m for p_num if board_check allows it, the turn passes unless it emptied the board
+int board_apply(Board *b, int p_num, Move m);
+bool board_over(const Board *b);
+int board_winner(const Board *b); // p_num, 0 while stones are left
+
+// strategies for the bot and the simulator. rng is the caller's xorshift state, a zero
+// state seeds itself. strategy_init builds the standard board's tablebase once
+void strategy_init(void);
+uint32_t strategy_random(uint64_t *rng);
+Move strategy_best(const Board *b);
+Move strategy_random_move(const Board *b, uint64_t *rng);
+// level 0 plays at random, STRATEGY_LEVELS - 1 always plays best
+Move strategy_move(const Board *b, int level, uint64_t *rng);
+
+#endif
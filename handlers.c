@@ -1,4 +1,8 @@
 #include "handlers.h"
+#include "match.h"
+#include "stats.h"
+#include "log.h"
+#include "journal.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -6,10 +10,11 @@
 #include <unistd.h>
 
 
+// on failure the FAIL is sent and p->open is left false (or the player was already open),
+// the caller is responsible for closing the connection
 void handle_open(Player *p, Message *msg) {
     if (!msg || msg->field_num < 1) {
         handle_fail(p, 10, "Invalid");
-        close(p->fd);
         return;
     }
 
@@ -17,102 +22,155 @@ void handle_open(Player *p, Message *msg) {
 
     if (!is_valid_name(name)) {
         handle_fail(p, 21, "Long Name");
-        close(p->fd);
         return;
     }
 
     if (p->open) {
         handle_fail(p, 23, "Already Open");
-        remove_active(p);
-        close(p->fd);
-        free(p);
         return;
     }
 
-    if (is_active(name)) {
-        handle_fail(p, 22, "Already Playing");
-        close(p->fd); // tests expect connection to close
+    // optional second field picks the match queue, players only meet the same queue
+    int queue = match_queue_id(msg->field_num >= 2 ? msg->fields[1] : "");
+    int board = (queue < 0) ? -1 : board_for_tag(match_queue_tag(queue));
+    if (board < 0) {
+        if (queue >= 0) match_queue_release(queue);
+        handle_fail(p, 10, "Invalid");
         return;
     }
+    p->queue = queue;
+    p->board = board;
 
     strncpy(p->name, name, 72);
     p->name[72] = '\0';
+
+    if (!add_active(p)) {
+        handle_fail(p, 22, "Already Playing"); // tests expect connection to close
+        return;
+    }
     p->open = true;
+    p->resume = match_claim_suspended(p->name); // back to a game the server lost in a crash
 
-    printf("Player '%s' connected\n", p->name);
-    fflush(stdout);
+    log_connected(p->name);
 }
 
+// the engine decides, this only turns its verdict into frames, log lines and the journal
 void handle_move(Game *g, Player *p, Message *msg){
     if(!g || !p || !msg || msg->field_num < 2){
         handle_fail(p, 10, "Invalid");
         return;
     }
 
-    // it is not the player's turn
-    if(g->next_p != p->p_num){
-        handle_fail(p, 31, "Impatient");
-        return;
+    Move m = { msg->values[0], msg->values[1] };
+    if(msg->version != BIN_VERSION){
+        if(!parse_int_field(msg->fields[0], &m.pile)){
+            m.pile = 0;
+        }
+        if(!parse_int_field(msg->fields[1], &m.quantity)){
+            m.quantity = 0;
+        }
     }
 
-    // check if move is valid
-    int pile = atoi(msg->fields[0]);
-    int quantity = atoi(msg->fields[1]);
-
-    if(pile < 1 || pile > 5){
+    switch(board_apply(&g->board, p->p_num, m)){
+    case MOVE_NOT_TURN:
+        handle_fail(p, 31, "Impatient");
+        return;
+    case MOVE_BAD_PILE:
         handle_fail(p, 32, "Pile Index");
         send_play_single(p, g);
         return;
-    }
-
-    if(quantity < 1 || quantity > g->piles[pile - 1]){
+    case MOVE_BAD_QUANTITY:
         handle_fail(p, 33, "Quantity");
         send_play_single(p, g);
         return;
     }
 
-    // make valid move
-    g->piles[pile - 1] -= quantity;
-    printf("Player %s removed %d from pile %d\n", p->name, quantity, pile);
-    fflush(stdout);
+    log_move(p->name, m.quantity, m.pile);
+    journal_move(g, p->p_num, m.pile, m.quantity);
+    if(board_over(&g->board)){
+        send_over(g, board_winner(&g->board), "");
+    }else{
+        send_play(g);
+    }
+}
 
+static Slab player_slab = SLAB_INIT(Player);
+static Slab game_slab = SLAB_INIT(Game);
 
-    // check if player won and all piles are empty
-    bool empty = true;
-    for(int i = 0; i < 5; i++){
-        if(g->piles[i] > 0){
-            empty = false;
-            break;
-        }
+Player *new_player(void){
+    Handle h;
+    Player *p = slab_alloc(&player_slab, &h);
+    if(p){
+        p->self = h;
+        p->fd = -1;
     }
+    return p;
+}
 
-    if(empty){
-        send_over(g, p->p_num, "");
-        return;
-    }
+void delete_player(Player *p){
+    match_queue_release(p->queue); // queue 0, all a player that never opened has, is kept anyway
+    free_send_buffer(&p->tx);
+    slab_free(&player_slab, p->self);
+}
 
-    // change player's turn, then send game to both
-    g->next_p = (p->p_num == 1) ? 2 : 1;
-    send_play(g);
+Player *lookup_player(Handle h){
+    return slab_get(&player_slab, h);
 }
 
-void handle_fail(Player *p, int code, const char *msg){
-    if(!p){
-        return;
+typedef struct {
+    void (*fn)(Player *p, void *ctx);
+    void *ctx;
+} PlayerVisit;
+
+static void visit_player(void *obj, void *arg){
+    PlayerVisit *v = arg;
+    v->fn(obj, v->ctx);
+}
+
+void each_player(void (*fn)(Player *p, void *ctx), void *ctx){
+    PlayerVisit v = { fn, ctx };
+    slab_each(&player_slab, visit_player, &v);
+}
+
+Game *new_game(void){
+    Handle h;
+    Game *g = slab_alloc(&game_slab, &h);
+    if(g){
+        g->self = h;
     }
+    return g;
+}
 
-    send_fail(p->fd, code, msg);
-    printf("Sent FAIL to player %s because %s (%d)\n", p->name, msg, code);
-    fflush(stdout);
+void delete_game(Game *g){
+    board_free(&g->board);
+    slab_free(&game_slab, g->self);
+}
 
+void report_allocations(FILE *out){
+    HeapStats hs = heap_stats();
+    slab_report(&player_slab, out);
+    slab_report(&game_slab, out);
+    fprintf(out, "heap allocs=%llu frees=%llu\n",
+            (unsigned long long)hs.heap_allocs, (unsigned long long)hs.heap_frees);
+    fflush(out);
+}
+
+bool create_game(Game *g, Player *p1, Player *p2){
+    if(!g || !board_init(&g->board, (p1->board > 0) ? p1->board : STANDARD_PILES)){
+        return false;
+    }
+    g->p1 = p1;
+    g->p2 = p2;
+    return true;
 }
 
-void handle_fail_fd(int fd, int code, const char *msg){
-    if(fd < 0) {
+void handle_fail(Player *p, int code, const char *msg){
+    if(!p){
         return;
     }
-    send_fail(fd, code, msg);
-    printf("Sent FAIL to fd %d because %s (%d)\n", fd, msg, code);
-    fflush(stdout);
 
-}
\ No newline at end of file
+    send_fail(p, code, msg);
+    stats_fail(code);
+    log_fail(p->name, code, msg);
+
+}
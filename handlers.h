@@ -1,32 +1,82 @@
 #ifndef HANDLERS_H
 #define HANDLERS_H
 
+#include <stdio.h>
 #include "message.h"
 #include "send.h"
+#include "registry.h"
+#include "slab.h"
+#include "timer.h"
+#include "engine.h"
+#include "admission.h"
 
 //#define MAX_MSG_LENGTH 72
 
 typedef struct Player {
+    Handle self;
     int fd;
     char name[73];
     int p_num; // 1 or 2
     bool open;
+    bool binary; // speaks protocol version 1, picked by the connection's OPEN
+    bool closed; // connection already torn down, waiting to be freed
+    struct Game *game; // game the player is in, NULL while waiting
+    struct Player *next; // link for the reactor's lists
+    RecvBuffer rx; // bytes received but not yet handled, frames may be pipelined
+    SendBuffer tx; // frames not yet accepted by the kernel, flushed at the end of each event
+    bool want_write; // waiting for writability because tx could not be fully flushed
+    struct Reactor *owner; // shard whose thread alone touches this player
+    Handle match; // waiter on another shard this player is being handed over to
+    bool handoff_pending; // waiter already paired by another shard, guarded by the match lock
+    int queue; // match queue named in OPEN
+    int board; // pile count the queue plays with
+    int match_state; // MATCH_IDLE or MATCH_WAITING, guarded by the match lock
+    struct Player *q_prev, *q_next; // links in the match queue while waiting
+    bool opening; // OPEN accepted this batch, frames behind it wait until it is paired
+    struct Player *pending_next; // link in the shard's list of OPENs to pair
+    struct Player *partner; // waiter it was paired with at the end of the batch
+    uint64_t accepted_at; // stats_now() at accept
+    uint64_t wait_start; // stats_now() when it joined its match queue
+    bool bot; // server-side opponent with no socket
+    Timer timer; // handshake deadline, idle limit or move clock, whichever applies now
+    bool recv_armed; // io_uring backend: a multishot recv is outstanding on fd
+    bool dirty; // io_uring backend: tx is sent once the batch is done, for a spectator
+                // it is on Reactor.watch_dirty on either backend
+    struct Player *dirty_next;
+    struct SuspendedGame *resume; // journaled game this name has a seat in, set by OPEN
+    bool spectator; // sent WATCH instead of OPEN, only ever receives its game's frames
+    struct Game *watching; // game a spectator is subscribed to
+    struct Player *watch_prev, *watch_next; // links in the game's list of spectators
+    WatchQueue *watch_queue; // shared frames not sent yet, allocated when it subscribes
+    TokenBucket frames; // every frame received takes a token, running dry drops the client
+    bool refused; // match_batch found the waiting players at config.max_waiting
 } Player;
 
 typedef struct Game {
+    Handle self;
     Player *p1;
     Player *p2;
-    int piles[5];     // 5 piles of 1, 3, 5, 7, 9
-    int next_p;  // p_num of whose turn it is
+    Board board; // the engine's state, handle_move referees every MOVE against it
+    uint64_t journal_id; // identifies the game's journal records, 0 while journaling is off
+    Player *watchers; // spectators, all owned by the game's shard
 } Game;
 
-bool is_active(const char *name);
-void add_active(Player *p);
-void remove_active(Player *p);
+// Players and Games come from slab pools, code that keeps a reference across events
+// or threads stores the Handle and resolves it with lookup_player
+Player *new_player(void);
+void delete_player(Player *p);
+Player *lookup_player(Handle h);
+// every allocated Player, only while no shard is running (see slab_each)
+void each_player(void (*fn)(Player *p, void *ctx), void *ctx);
+Game *new_game(void);
+void delete_game(Game *g);
+void report_allocations(FILE *out);
+
+// false if a large board could not be allocated
+bool create_game(Game *g, Player *p1, Player *p2);
 
 void handle_open(Player *p, Message *msg);
 void handle_move(Game *g, Player *p, Message *msg);
 void handle_fail(Player *p, int code, const char *msg);
-void handle_fail_fd(int fd, int code, const char *msg);
 
 #endif 
@@ -0,0 +1,636 @@
+#define _GNU_SOURCE
+
+#include "journal.h"
+#include "handlers.h"
+#include "slab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+
+#define JOURNAL_MAGIC "NIMDJRN1"
+
+typedef struct {
+    char magic[8];
+    uint64_t committed; // end of the records a reader may trust, after the batch's own records
+} SegmentHeader;
+
+typedef struct Segment {
+    int fd;
+    char *base; // JOURNAL_SEGMENT_BYTES mapped shared
+    uint64_t tail; // writer only
+    uint64_t committed; // stored by the writer with release, read by the syncer
+    uint64_t synced; // syncer only
+    bool retired; // the writer has moved on to a new segment, guarded by segment_lock
+    struct Segment *next;
+} Segment;
+
+typedef struct {
+    int id;
+    int seq;
+    Segment *seg; // NULL once a segment could not be created, the thread stops journaling
+} Journal;
+
+static const char *journal_dir = NULL;
+static unsigned long long started_at; // part of every file name, so a restart never reuses one
+static uint64_t next_game_id;
+static Segment *segments = NULL; // every mapped segment, guarded by segment_lock
+static bool syncer_started = false;
+static pthread_t syncer;
+static pthread_mutex_t segment_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread Journal *mine = NULL;
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// ids only have to differ between every process that ever wrote to the directory
+static void seed_game_ids(void){
+    uint64_t seed;
+    if(getrandom(&seed, sizeof(seed), 0) != sizeof(seed)){
+        seed = now_ns() ^ ((uint64_t)getpid() << 40);
+    }
+    next_game_id = seed & ~0xffffffULL; // the low bits count games
+}
+
+static uint32_t checksum(const JournalRecord *rec){
+    const unsigned char *bytes = (const unsigned char *)rec + sizeof(rec->checksum);
+    int length = rec->length - (int)sizeof(rec->checksum);
+    uint32_t hash = 2166136261u;
+    for(int i = 0; i < length; i++){
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int padded(int length){
+    return (length + 7) & ~7;
+}
+
+void journal_open(const char *dir){
+    struct stat st;
+    if(stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)){
+        fprintf(stderr, "Journal directory %s is not usable.\n", dir);
+        exit(EXIT_FAILURE);
+    }
+    journal_dir = dir;
+    started_at = (unsigned long long)time(NULL);
+    seed_game_ids();
+}
+
+bool journal_enabled(void){
+    return journal_dir != NULL;
+}
+
+static Segment *open_segment(Journal *j){
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/nimd-%010llu-%07d-%03d-%06d.journal",
+             journal_dir, started_at, (int)getpid(), j->id, j->seq++);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if(fd < 0){
+        perror(path);
+        return NULL;
+    }
+    // blocks are reserved up front so appending never waits on the filesystem for space
+    if(posix_fallocate(fd, 0, JOURNAL_SEGMENT_BYTES) != 0 && ftruncate(fd, JOURNAL_SEGMENT_BYTES) < 0){
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+    char *base = mmap(NULL, JOURNAL_SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    Segment *s = counted_calloc(1, sizeof(Segment));
+    if(base == MAP_FAILED || !s){
+        perror("journal segment");
+        if(base != MAP_FAILED){
+            munmap(base, JOURNAL_SEGMENT_BYTES);
+        }
+        counted_free(s);
+        close(fd);
+        return NULL;
+    }
+
+    SegmentHeader *h = (SegmentHeader *)base;
+    memcpy(h->magic, JOURNAL_MAGIC, sizeof(h->magic));
+    h->committed = JOURNAL_HEADER_BYTES;
+    s->fd = fd;
+    s->base = base;
+    s->tail = JOURNAL_HEADER_BYTES;
+    s->committed = JOURNAL_HEADER_BYTES;
+
+    pthread_mutex_lock(&segment_lock);
+    s->next = segments;
+    segments = s;
+    pthread_mutex_unlock(&segment_lock);
+    return s;
+}
+
+static void publish(Segment *s){
+    SegmentHeader *h = (SegmentHeader *)s->base;
+    __atomic_store_n(&h->committed, s->tail, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->committed, s->tail, __ATOMIC_RELEASE);
+}
+
+// syncs each segment's newly committed range, data before the header that vouches for
+// it, and unmaps the segments their writers are done with
+static void *syncer_main(void *arg){
+    (void)arg;
+    struct timespec interval = { 0, JOURNAL_SYNC_MS * 1000000L };
+    while(1){
+        nanosleep(&interval, NULL);
+
+        pthread_mutex_lock(&segment_lock);
+        Segment **link = &segments;
+        while(*link){
+            Segment *s = *link;
+            uint64_t committed = __atomic_load_n(&s->committed, __ATOMIC_ACQUIRE);
+            if(committed > s->synced){
+                uint64_t from = s->synced & ~(uint64_t)(JOURNAL_HEADER_BYTES - 1);
+                msync(s->base + from, committed - from, MS_SYNC);
+                msync(s->base, JOURNAL_HEADER_BYTES, MS_SYNC);
+                s->synced = committed;
+            }
+            if(s->retired){
+                *link = s->next;
+                munmap(s->base, JOURNAL_SEGMENT_BYTES);
+                close(s->fd);
+                counted_free(s);
+                continue;
+            }
+            link = &s->next;
+        }
+        pthread_mutex_unlock(&segment_lock);
+    }
+    return NULL;
+}
+
+void journal_attach(int id){
+    if(!journal_dir || mine){
+        return;
+    }
+
+    Journal *j = counted_calloc(1, sizeof(Journal));
+    if(!j){
+        return;
+    }
+    j->id = id;
+    j->seg = open_segment(j);
+    if(!j->seg){
+        counted_free(j);
+        return; // this thread's games go unjournaled
+    }
+    mine = j;
+
+    pthread_mutex_lock(&segment_lock);
+    if(!syncer_started){
+        syncer_started = pthread_create(&syncer, NULL, syncer_main, NULL) == 0;
+    }
+    pthread_mutex_unlock(&segment_lock);
+}
+
+void journal_forked(void){
+    // the parent's sync thread did not survive the fork and its segments belong to it
+    segments = NULL;
+    syncer_started = false;
+    mine = NULL;
+    pthread_mutex_init(&segment_lock, NULL);
+    seed_game_ids();
+}
+
+void journal_commit(void){
+    Journal *j = mine;
+    if(j && j->seg && j->seg->tail != j->seg->committed){
+        publish(j->seg);
+    }
+}
+
+// room for one record in the calling thread's segment, moving on to a fresh segment
+// when this one is full. NULL if the thread is not journaling
+static void *reserve(int length){
+    Journal *j = mine;
+    if(!j || !j->seg){
+        return NULL;
+    }
+
+    Segment *s = j->seg;
+    if(s->tail + length > JOURNAL_SEGMENT_BYTES){
+        publish(s);
+        pthread_mutex_lock(&segment_lock);
+        s->retired = true;
+        pthread_mutex_unlock(&segment_lock);
+        j->seg = open_segment(j);
+        if(!j->seg){
+            return NULL;
+        }
+        s = j->seg;
+    }
+    void *at = s->base + s->tail;
+    s->tail += length;
+    return at;
+}
+
+static void seal(JournalRecord *rec, int type, int length, uint64_t game){
+    rec->type = type;
+    rec->length = length;
+    rec->game = game;
+    rec->time = now_ns();
+    rec->checksum = checksum(rec);
+}
+
+uint64_t journal_game_id(void){
+    return journal_dir ? __atomic_add_fetch(&next_game_id, 1, __ATOMIC_RELAXED) : 0;
+}
+
+static void append_state(int type, uint64_t game, const char *names[2], bool bot,
+                         int pile_count, int next_p, const int *piles, uint64_t active){
+    int name_len[2] = { (int)strlen(names[0]), (int)strlen(names[1]) };
+    int length = sizeof(JournalState) + name_len[0] + name_len[1];
+    if(piles){
+        length += pile_count * sizeof(uint16_t);
+    }
+    length = padded(length);
+
+    JournalState *st = reserve(length);
+    if(!st){
+        return;
+    }
+    memset(st, 0, length);
+    st->active = active;
+    st->pile_count = pile_count;
+    st->next_p = next_p;
+    st->bot = bot;
+    char *out = st->names;
+    for(int i = 0; i < 2; i++){
+        st->name_len[i] = name_len[i];
+        memcpy(out, names[i], name_len[i]);
+        out += name_len[i];
+    }
+    for(int i = 0; piles && i < pile_count; i++){
+        uint16_t pile = piles[i];
+        memcpy(out, &pile, sizeof(pile));
+        out += sizeof(pile);
+    }
+    seal(&st->h, type, length, game);
+}
+
+void journal_match(const Game *g){
+    if(!mine){
+        return;
+    }
+    const char *names[2] = { g->p1->name, g->p2->name };
+    append_state(JR_MATCH, g->journal_id, names, g->p2->bot, g->board.pile_count, g->board.next_p, NULL, 0);
+}
+
+void journal_move(const Game *g, int p_num, int pile, int quantity){
+    JournalMove *m = reserve(sizeof(JournalMove));
+    if(!m){
+        return;
+    }
+    m->p_num = p_num;
+    m->pad = 0;
+    m->pile = pile;
+    m->quantity = quantity;
+    seal(&m->h, JR_MOVE, sizeof(JournalMove), g->journal_id);
+}
+
+void journal_over(const Game *g, int winner, int reason){
+    JournalOver *o = reserve(sizeof(JournalOver));
+    if(!o){
+        return;
+    }
+    memset(o->pad, 0, sizeof(o->pad));
+    o->winner = winner;
+    o->reason = reason;
+    seal(&o->h, JR_OVER, sizeof(JournalOver), g->journal_id);
+}
+
+// a record's fixed part must fit in its length, the checksum only proves it is intact
+static bool well_formed(const JournalRecord *rec){
+    switch(rec->type){
+    case JR_MATCH:
+    case JR_RESTORE: {
+        if(rec->length < sizeof(JournalState)){
+            return false;
+        }
+        const JournalState *st = (const JournalState *)rec;
+        int need = sizeof(JournalState) + st->name_len[0] + st->name_len[1];
+        if(rec->type == JR_RESTORE){
+            need += st->pile_count * sizeof(uint16_t);
+        }
+        return st->name_len[0] <= 72 && st->name_len[1] <= 72 && need <= rec->length;
+    }
+    case JR_MOVE:
+        return rec->length == sizeof(JournalMove);
+    case JR_OVER:
+        return rec->length == sizeof(JournalOver);
+    default:
+        return true; // newer record types are passed on for the reader to skip
+    }
+}
+
+int journal_scan(const char *path, void (*fn)(const JournalRecord *rec, void *ctx), void *ctx){
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        return -1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < JOURNAL_HEADER_BYTES){
+        close(fd);
+        return -1;
+    }
+    char *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED){
+        return -1;
+    }
+
+    const SegmentHeader *h = (const SegmentHeader *)base;
+    if(memcmp(h->magic, JOURNAL_MAGIC, sizeof(h->magic)) != 0){
+        munmap(base, st.st_size);
+        return -1;
+    }
+    uint64_t end = __atomic_load_n(&h->committed, __ATOMIC_ACQUIRE);
+    if(end > (uint64_t)st.st_size){
+        end = st.st_size;
+    }
+
+    int count = 0;
+    uint64_t at = JOURNAL_HEADER_BYTES;
+    while(at + sizeof(JournalRecord) <= end){
+        const JournalRecord *rec = (const JournalRecord *)(base + at);
+        if(rec->length < sizeof(JournalRecord) || rec->length % 8 != 0 || at + rec->length > end ||
+           checksum(rec) != rec->checksum || !well_formed(rec)){
+            break; // a torn write can only be the last thing in the segment
+        }
+        fn(rec, ctx);
+        count++;
+        at += rec->length;
+    }
+    munmap(base, st.st_size);
+    return count;
+}
+
+// recovery: games by id while the segments are replayed, chained through next
+typedef struct {
+    SuspendedGame **buckets;
+    uint64_t mask;
+    int count;
+} GameTable;
+
+static uint64_t bucket_of(const GameTable *t, uint64_t id){
+    return ((id ^ (id >> 29)) * 0x9e3779b97f4a7c15ULL >> 20) & t->mask;
+}
+
+static SuspendedGame *table_find(const GameTable *t, uint64_t id){
+    for(SuspendedGame *s = t->buckets[bucket_of(t, id)]; s; s = s->next){
+        if(s->id == id){
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static bool table_grow(GameTable *t){
+    uint64_t size = (t->mask + 1) * 2;
+    SuspendedGame **buckets = counted_calloc(size, sizeof(SuspendedGame *));
+    if(!buckets){
+        return false;
+    }
+    SuspendedGame **old = t->buckets;
+    uint64_t old_size = t->mask + 1;
+    t->buckets = buckets;
+    t->mask = size - 1;
+    for(uint64_t i = 0; i < old_size; i++){
+        while(old[i]){
+            SuspendedGame *s = old[i];
+            old[i] = s->next;
+            uint64_t b = bucket_of(t, s->id);
+            s->next = buckets[b];
+            buckets[b] = s;
+        }
+    }
+    counted_free(old);
+    return true;
+}
+
+static SuspendedGame *table_add(GameTable *t, uint64_t id){
+    if(t->count >= (int)(t->mask + 1) * 2 && !table_grow(t)){
+        return NULL;
+    }
+    SuspendedGame *s = counted_calloc(1, sizeof(SuspendedGame));
+    if(!s){
+        return NULL;
+    }
+    s->id = id;
+    uint64_t b = bucket_of(t, id);
+    s->next = t->buckets[b];
+    t->buckets[b] = s;
+    t->count++;
+    return s;
+}
+
+void journal_free_suspended(SuspendedGame *s){
+    counted_free(s->piles);
+    counted_free(s);
+}
+
+static void load_state(SuspendedGame *s, const JournalState *st){
+    if(st->pile_count < 1 || st->pile_count > MAX_PILES){
+        s->over = true; // not a board this server could have played
+        return;
+    }
+    if(s->pile_count != st->pile_count){
+        int *piles = counted_malloc(st->pile_count * sizeof(int));
+        if(!piles){
+            s->over = true;
+            return;
+        }
+        counted_free(s->piles);
+        s->piles = piles;
+        s->pile_count = st->pile_count;
+    }
+
+    const char *in = st->names;
+    for(int i = 0; i < 2; i++){
+        memcpy(s->names[i], in, st->name_len[i]);
+        s->names[i][st->name_len[i]] = '\0';
+        in += st->name_len[i];
+    }
+    for(int i = 0; i < s->pile_count; i++){
+        uint16_t pile = 2 * i + 1;
+        if(st->h.type == JR_RESTORE){
+            memcpy(&pile, in, sizeof(pile));
+            in += sizeof(pile);
+        }
+        s->piles[i] = pile;
+    }
+    s->next_p = (st->next_p == 2) ? 2 : 1;
+    s->bot = st->bot;
+    s->over = false;
+    s->active = (st->h.type == JR_RESTORE) ? st->active : st->h.time;
+}
+
+static void replay(const JournalRecord *rec, void *ctx){
+    GameTable *t = ctx;
+    SuspendedGame *s = table_find(t, rec->game);
+    if(s && rec->time < s->seen){
+        return; // an older copy of a game already replayed from a newer segment
+    }
+
+    switch(rec->type){
+    case JR_MATCH:
+    case JR_RESTORE:
+        if(!s && !(s = table_add(t, rec->game))){
+            return;
+        }
+        load_state(s, (const JournalState *)rec);
+        break;
+    case JR_MOVE: {
+        const JournalMove *m = (const JournalMove *)rec;
+        if(!s || s->over){
+            return; // started in a segment that is gone
+        }
+        if(m->pile < 1 || m->pile > s->pile_count || m->quantity > (uint32_t)s->piles[m->pile - 1]){
+            s->over = true; // cannot be this game's history, do not guess
+            break;
+        }
+        s->piles[m->pile - 1] -= m->quantity;
+        s->next_p = (m->p_num == 1) ? 2 : 1;
+        s->active = rec->time;
+        break;
+    }
+    case JR_OVER:
+        // kept as a tombstone so an older copy of the game cannot bring it back
+        if(!s && !(s = table_add(t, rec->game))){
+            return;
+        }
+        s->over = true;
+        break;
+    default:
+        return;
+    }
+    s->seen = rec->time;
+}
+
+static int by_name(const void *a, const void *b){
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// segment files to replay, oldest first since the names start with the process start time
+static int list_segments(int pid, char ***out){
+    DIR *dir = opendir(journal_dir);
+    if(!dir){
+        perror(journal_dir);
+        return 0;
+    }
+
+    char **names = NULL;
+    int count = 0;
+    int cap = 0;
+    struct dirent *de;
+    while((de = readdir(dir))){
+        unsigned long long started;
+        int file_pid, id, seq, end = 0;
+        if(sscanf(de->d_name, "nimd-%llu-%d-%d-%d.journal%n", &started, &file_pid, &id, &seq, &end) != 4 ||
+           de->d_name[end] != '\0'){
+            continue;
+        }
+        // at startup everything from earlier runs, this run's own workers are alive
+        if(pid == 0 ? started == started_at : file_pid != pid){
+            continue;
+        }
+        if(count == cap){
+            cap = cap ? cap * 2 : 16;
+            char **grown = counted_realloc(names, cap * sizeof(char *));
+            if(!grown){
+                break;
+            }
+            names = grown;
+        }
+        names[count] = counted_malloc(strlen(de->d_name) + 1);
+        if(!names[count]){
+            break;
+        }
+        strcpy(names[count++], de->d_name);
+    }
+    closedir(dir);
+
+    qsort(names, count, sizeof(char *), by_name);
+    *out = names;
+    return count;
+}
+
+SuspendedGame *journal_recover(int pid){
+    if(!journal_dir){
+        return NULL;
+    }
+
+    char **files = NULL;
+    int file_count = list_segments(pid, &files);
+    GameTable t = { .buckets = counted_calloc(1024, sizeof(SuspendedGame *)), .mask = 1023 };
+    if(!t.buckets){
+        perror("journal recovery");
+        return NULL;
+    }
+
+    char path[PATH_MAX];
+    for(int i = 0; i < file_count; i++){
+        snprintf(path, sizeof(path), "%s/%s", journal_dir, files[i]);
+        if(journal_scan(path, replay, &t) < 0){
+            fprintf(stderr, "%s is not a journal segment, skipped\n", path);
+        }
+    }
+
+    // what is left unfinished, recent and between two people is carried over
+    SuspendedGame *resumable = NULL;
+    uint64_t oldest = now_ns() - (uint64_t)JOURNAL_RESUME_S * 1000000000ULL;
+    for(uint64_t b = 0; b <= t.mask; b++){
+        while(t.buckets[b]){
+            SuspendedGame *s = t.buckets[b];
+            t.buckets[b] = s->next;
+            if(s->over || s->bot || s->active < oldest || !s->names[0][0] || !s->names[1][0]){
+                journal_free_suspended(s);
+                continue;
+            }
+            s->next = resumable;
+            resumable = s;
+        }
+    }
+    counted_free(t.buckets);
+
+    // the games are written again before the files they came from are retired, so a
+    // crash in between replays them twice at worst
+    journal_attach(0);
+    Journal *j = mine;
+    for(SuspendedGame *s = resumable; s; s = s->next){
+        const char *names[2] = { s->names[0], s->names[1] };
+        append_state(JR_RESTORE, s->id, names, false, s->pile_count, s->next_p, s->piles, s->active);
+    }
+    if(j && j->seg){
+        publish(j->seg);
+        msync(j->seg->base, j->seg->tail, MS_SYNC);
+    }
+
+    char closed[PATH_MAX + 8];
+    for(int i = 0; i < file_count; i++){
+        snprintf(path, sizeof(path), "%s/%s", journal_dir, files[i]);
+        snprintf(closed, sizeof(closed), "%s.closed", path);
+        if(j && j->seg && rename(path, closed) < 0){
+            perror(path);
+        }
+        counted_free(files[i]);
+    }
+    counted_free(files);
+    return resumable;
+}
@@ -0,0 +1,104 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct Game;
+struct Player;
+
+// append-only record of every game: MATCH when it starts, each accepted MOVE and the
+// OVER. Every thread appends to its own memory-mapped segment files
+// (<dir>/nimd-<start>-<pid>-<thread>-<seq>.journal), so writing is a memcpy with no
+// lock and no syscall. Records become visible at the end of each batch (group commit)
+// and a background thread msyncs them to disk. After a crash the unfinished games are
+// rebuilt from the segments and carry on once both players are back
+#define JOURNAL_SEGMENT_BYTES (16 * 1024 * 1024)
+#define JOURNAL_HEADER_BYTES 4096 // first page of a segment, records follow it
+#define JOURNAL_SYNC_MS 20 // how often committed records are msynced
+#define JOURNAL_RESUME_S 600 // games silent for longer are not resumed after a restart
+
+enum { JR_MATCH = 1, JR_MOVE, JR_OVER, JR_RESTORE };
+enum { JOVER_WIN, JOVER_FORFEIT };
+
+// every record starts with this and is padded to 8 bytes
+typedef struct {
+    uint32_t checksum; // FNV-1a over everything after it, a torn record fails it
+    uint16_t type;
+    uint16_t length; // whole record, padding included
+    uint64_t game;
+    uint64_t time; // CLOCK_REALTIME ns
+} JournalRecord;
+
+// MATCH and RESTORE body, followed by both names and, for RESTORE, the piles as
+// uint16_t (MATCH starts from the standard 1, 3, 5, ... board)
+typedef struct {
+    JournalRecord h;
+    uint64_t active; // RESTORE: time of the game's last move, 0 for MATCH
+    uint16_t pile_count;
+    uint8_t next_p;
+    uint8_t bot; // p2 is the server's bot, such games are not resumed
+    uint8_t name_len[2];
+    uint8_t pad[2];
+    char names[];
+} JournalState;
+
+typedef struct {
+    JournalRecord h;
+    uint8_t p_num;
+    uint8_t pad;
+    uint16_t pile;
+    uint32_t quantity;
+} JournalMove;
+
+typedef struct {
+    JournalRecord h;
+    uint8_t winner;
+    uint8_t reason; // JOVER_WIN or JOVER_FORFEIT
+    uint8_t pad[6];
+} JournalOver;
+
+// an unfinished game rebuilt from the journal, waiting for both players to reconnect
+typedef struct SuspendedGame {
+    uint64_t id;
+    uint64_t seen; // time of the newest record applied, older ones are stale copies
+    uint64_t active; // time of its last move
+    char names[2][73];
+    int pile_count;
+    int next_p;
+    int *piles;
+    bool bot;
+    bool over;
+    struct Player *waiter; // one seat already back, guarded by the match lock
+    bool claimed[2]; // seat held by an open connection, guarded by the match lock
+    struct SuspendedGame *next;
+} SuspendedGame;
+
+// turns the journal on, call once before anything attaches. Exits if dir is unusable
+void journal_open(const char *dir);
+bool journal_enabled(void);
+// gives the calling thread its own segment and starts the sync thread on first use,
+// a thread that already has one keeps it
+void journal_attach(int id);
+// in a freshly forked child: forget the parent's segments and sync thread
+void journal_forked(void);
+// publishes what the calling thread appended since its last commit, end of every batch
+void journal_commit(void);
+
+// the calling thread's records, nothing happens if it has no segment
+uint64_t journal_game_id(void);
+void journal_match(const struct Game *g);
+void journal_move(const struct Game *g, int p_num, int pile, int quantity);
+void journal_over(const struct Game *g, int winner, int reason);
+
+// replays every segment in the directory (pid 0) or only those written by pid, writes
+// the unfinished games into the calling thread's segment as RESTORE records and
+// retires the replayed files (renamed to .closed). Returns the games to resume
+SuspendedGame *journal_recover(int pid);
+void journal_free_suspended(SuspendedGame *s);
+
+// offline reading: calls fn for each committed record of one segment file, returns
+// the number of records or -1 if the file is not a journal segment
+int journal_scan(const char *path, void (*fn)(const JournalRecord *rec, void *ctx), void *ctx);
+
+#endif
@@ -0,0 +1,129 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+// reads journal segments offline (live ones too, up to their last commit): every
+// record as a line, or with -s only the totals over all the segments given
+typedef struct {
+    int summary;
+    long records;
+    long matches;
+    long bot_matches;
+    long restores;
+    long moves;
+    long stones;
+    long overs;
+    long forfeits;
+    long wins[3]; // by seat
+} Totals;
+
+static void print_time(uint64_t ns) {
+    time_t sec = ns / 1000000000ULL;
+    struct tm tm;
+    char when[32];
+    localtime_r(&sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%03d ", when, (int)(ns / 1000000 % 1000));
+}
+
+static void print_state(const JournalState *st) {
+    const char *name = st->names;
+    printf("%s %.*s vs %.*s, %d piles", st->h.type == JR_MATCH ? "MATCH" : "RESTORE",
+           st->name_len[0], name, st->name_len[1], name + st->name_len[0], st->pile_count);
+    if (st->h.type == JR_RESTORE) {
+        printf(", player %d to move", st->next_p);
+    }
+    printf("%s\n", st->bot ? " (bot)" : "");
+}
+
+static void on_record(const JournalRecord *rec, void *ctx) {
+    Totals *t = ctx;
+    t->records++;
+
+    const JournalMove *m = (const JournalMove *)rec;
+    const JournalOver *o = (const JournalOver *)rec;
+    switch (rec->type) {
+    case JR_MATCH:
+        t->matches++;
+        t->bot_matches += ((const JournalState *)rec)->bot;
+        break;
+    case JR_RESTORE:
+        t->restores++;
+        break;
+    case JR_MOVE:
+        t->moves++;
+        t->stones += m->quantity;
+        break;
+    case JR_OVER:
+        t->overs++;
+        t->forfeits += o->reason == JOVER_FORFEIT;
+        if (o->winner == 1 || o->winner == 2) t->wins[o->winner]++;
+        break;
+    }
+    if (t->summary) return;
+
+    print_time(rec->time);
+    printf("%016llx ", (unsigned long long)rec->game);
+    switch (rec->type) {
+    case JR_MATCH:
+    case JR_RESTORE:
+        print_state((const JournalState *)rec);
+        break;
+    case JR_MOVE:
+        printf("MOVE player %d took %u from pile %d\n", m->p_num, m->quantity, m->pile);
+        break;
+    case JR_OVER:
+        printf("OVER player %d wins%s\n", o->winner, o->reason == JOVER_FORFEIT ? " by forfeit" : "");
+        break;
+    default:
+        printf("record type %d, %d bytes\n", rec->type, rec->length);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    Totals t;
+    memset(&t, 0, sizeof(t));
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        if (opt == 's') {
+            t.summary = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-s] segment...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind == argc) {
+        fprintf(stderr, "Usage: %s [-s] segment...\n", argv[0]);
+        return 1;
+    }
+
+    int status = 0;
+    for (int i = optind; i < argc; i++) {
+        if (journal_scan(argv[i], on_record, &t) < 0) {
+            fprintf(stderr, "%s: not a journal segment\n", argv[i]);
+            status = 1;
+        }
+    }
+
+    if (t.summary) {
+        printf("records %ld\n", t.records);
+        printf("games_started %ld\n", t.matches);
+        printf("bot_games %ld\n", t.bot_matches);
+        printf("games_restored %ld\n", t.restores);
+        printf("games_finished %ld\n", t.overs);
+        printf("forfeits %ld\n", t.forfeits);
+        printf("first_player_wins %ld\n", t.wins[1]);
+        printf("second_player_wins %ld\n", t.wins[2]);
+        printf("moves %ld\n", t.moves);
+        printf("stones_per_move %.2f\n", t.moves ? (double)t.stones / t.moves : 0.0);
+        printf("moves_per_game %.2f\n", t.matches ? (double)t.moves / t.matches : 0.0);
+    }
+    return status;
+}
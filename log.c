@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+
+#include "log.h"
+#include "config.h"
+#include "slab.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define MAX_LOG_RINGS 256
+#define LOG_BATCH (64 * 1024) // bytes formatted before each write()
+#define LOG_LINE_MAX 256 // room left in the batch for one more formatted line
+
+enum { EV_ACCEPTED, EV_CONNECTED, EV_MOVE, EV_FAIL, EV_MATCHED, EV_TEXT };
+
+typedef struct {
+    uint16_t event;
+    uint16_t level;
+    int32_t a;
+    int32_t b;
+    const char *reason; // string literal, never freed
+    char text[LOG_TEXT_MAX]; // player name or preformatted line
+} LogRecord;
+
+// single producer (the owning thread) and single consumer (the writer), head and
+// tail only ever grow and are published with release stores
+typedef struct {
+    LogRecord records[LOG_RING_SIZE];
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped; // written by the producer only
+    uint64_t sampled_out; // noisy records skipped on purpose, producer only
+    uint64_t noisy_second;
+    int noisy_count;
+    uint64_t reported_dropped; // writer only
+    uint64_t reported_sampled;
+} LogRing;
+
+static LogRing *rings[MAX_LOG_RINGS];
+static int ring_count = 0;
+static bool writer_started = false;
+static pthread_t writer;
+static pthread_mutex_t attach_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread LogRing *mine = NULL;
+
+// the writer blocks on wake_cond once every ring is empty. It sets writer_sleeping
+// first, and the first producer to publish a record after that clears it and signals,
+// so a busy log costs producers one atomic load per record and no syscall
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static bool writer_sleeping = false;
+
+static int format_record(char *out, int cap, const LogRecord *rec){
+    switch(rec->event){
+    case EV_ACCEPTED:
+        return snprintf(out, cap, "nimd server accepted connection from client\n");
+    case EV_CONNECTED:
+        return snprintf(out, cap, "Player '%s' connected\n", rec->text);
+    case EV_MOVE:
+        return snprintf(out, cap, "Player %s removed %d from pile %d\n", rec->text, rec->a, rec->b);
+    case EV_FAIL:
+        return snprintf(out, cap, "Sent FAIL to player %s because %s (%d)\n", rec->text, rec->reason, rec->a);
+    case EV_MATCHED:
+        return snprintf(out, cap, "Two players have been matched\n");
+    default:
+        return snprintf(out, cap, "%s\n", rec->text);
+    }
+}
+
+static void write_all(const char *buf, int len){
+    while(len > 0){
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if(n <= 0){
+            return; // nowhere to log to, not worth stopping a game over
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// writes the batch out first if another line might not fit
+static void make_room(char *batch, int *len){
+    if(*len > LOG_BATCH - LOG_LINE_MAX){
+        write_all(batch, *len);
+        *len = 0;
+    }
+}
+
+// formats everything queued so far, returns the number of records written out
+static int drain_rings(void){
+    static char batch[LOG_BATCH];
+    int len = 0;
+    int written = 0;
+
+    pthread_mutex_lock(&drain_lock);
+    int count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < count; i++){
+        LogRing *r = rings[i];
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = r->tail;
+        for(; tail != head; tail++){
+            make_room(batch, &len);
+            len += format_record(batch + len, LOG_BATCH - len, &r->records[tail & (LOG_RING_SIZE - 1)]);
+            written++;
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        uint64_t sampled = __atomic_load_n(&r->sampled_out, __ATOMIC_RELAXED);
+        if(dropped != r->reported_dropped || sampled != r->reported_sampled){
+            make_room(batch, &len);
+            len += snprintf(batch + len, LOG_BATCH - len, "log: %llu records dropped, %llu noisy records sampled out\n",
+                            (unsigned long long)(dropped - r->reported_dropped),
+                            (unsigned long long)(sampled - r->reported_sampled));
+            r->reported_dropped = dropped;
+            r->reported_sampled = sampled;
+        }
+    }
+    if(len > 0){
+        write_all(batch, len);
+    }
+    pthread_mutex_unlock(&drain_lock);
+    return written;
+}
+
+static bool rings_pending(void){
+    int count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < count; i++){
+        if(__atomic_load_n(&rings[i]->head, __ATOMIC_SEQ_CST) != __atomic_load_n(&rings[i]->tail, __ATOMIC_ACQUIRE)){
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *writer_main(void *arg){
+    (void)arg;
+    while(1){
+        if(drain_rings() > 0){
+            continue;
+        }
+        pthread_mutex_lock(&wake_lock);
+        __atomic_store_n(&writer_sleeping, true, __ATOMIC_SEQ_CST);
+        // checked after announcing the sleep: a record published before it is seen
+        // here, one published after it finds writer_sleeping set
+        while(__atomic_load_n(&writer_sleeping, __ATOMIC_SEQ_CST) && !rings_pending()){
+            pthread_cond_wait(&wake_cond, &wake_lock);
+        }
+        __atomic_store_n(&writer_sleeping, false, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&wake_lock);
+    }
+    return NULL;
+}
+
+static void wake_writer(void){
+    if(__atomic_load_n(&writer_sleeping, __ATOMIC_SEQ_CST) &&
+       __atomic_exchange_n(&writer_sleeping, false, __ATOMIC_SEQ_CST)){
+        pthread_mutex_lock(&wake_lock);
+        pthread_cond_signal(&wake_cond);
+        pthread_mutex_unlock(&wake_lock);
+    }
+}
+
+void log_attach(void){
+    LogRing *r = counted_calloc(1, sizeof(LogRing));
+    if(!r){
+        return; // this thread keeps logging synchronously
+    }
+
+    pthread_mutex_lock(&attach_lock);
+    if(ring_count == MAX_LOG_RINGS){
+        pthread_mutex_unlock(&attach_lock);
+        counted_free(r);
+        return;
+    }
+    rings[ring_count] = r;
+    __atomic_store_n(&ring_count, ring_count + 1, __ATOMIC_RELEASE);
+    if(!writer_started){
+        fflush(stdout); // lines printed before the writer existed go first
+        writer_started = pthread_create(&writer, NULL, writer_main, NULL) == 0;
+    }
+    pthread_mutex_unlock(&attach_lock);
+    mine = r;
+}
+
+void log_forked(void){
+    // the parent's writer thread did not survive the fork and its rings belong to it
+    ring_count = 0;
+    writer_started = false;
+    mine = NULL;
+    pthread_mutex_init(&attach_lock, NULL);
+    pthread_mutex_init(&drain_lock, NULL);
+    pthread_mutex_init(&wake_lock, NULL);
+    pthread_cond_init(&wake_cond, NULL);
+    writer_sleeping = false;
+}
+
+void log_flush(void){
+    while(drain_rings() > 0){
+    }
+}
+
+static void push(const LogRecord *rec){
+    if(rec->level < config.log_level){
+        return;
+    }
+
+    LogRing *r = mine;
+    if(!r){
+        char line[LOG_TEXT_MAX + 128];
+        int len = format_record(line, sizeof(line), rec);
+        fwrite(line, 1, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1, stdout);
+        fflush(stdout);
+        return;
+    }
+
+    uint64_t head = r->head;
+    if(head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE){
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    r->records[head & (LOG_RING_SIZE - 1)] = *rec;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST); // ordered before the writer_sleeping load
+    wake_writer();
+}
+
+static void copy_text(LogRecord *rec, const char *text){
+    strncpy(rec->text, text, LOG_TEXT_MAX - 1);
+    rec->text[LOG_TEXT_MAX - 1] = '\0';
+}
+
+void log_accepted(void){
+    LogRecord rec = { .event = EV_ACCEPTED, .level = LOG_INFO };
+    push(&rec);
+}
+
+void log_connected(const char *name){
+    LogRecord rec = { .event = EV_CONNECTED, .level = LOG_INFO };
+    copy_text(&rec, name);
+    push(&rec);
+}
+
+void log_move(const char *name, int quantity, int pile){
+    LogRecord rec = { .event = EV_MOVE, .level = LOG_INFO, .a = quantity, .b = pile };
+    copy_text(&rec, name);
+    push(&rec);
+}
+
+// a client hammering MOVE out of turn would otherwise own the log, so past a burst
+// per second only a sample of its FAILs is kept
+static bool keep_noisy(void){
+    LogRing *r = mine;
+    if(!r){
+        return true;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    if((uint64_t)ts.tv_sec != r->noisy_second){
+        r->noisy_second = ts.tv_sec;
+        r->noisy_count = 0;
+    }
+    if(r->noisy_count++ < LOG_NOISY_BURST || r->noisy_count % LOG_NOISY_SAMPLE == 0){
+        return true;
+    }
+    __atomic_store_n(&r->sampled_out, r->sampled_out + 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+void log_fail(const char *name, int code, const char *reason){
+    if(code == 31 && !keep_noisy()){
+        return;
+    }
+    LogRecord rec = { .event = EV_FAIL, .level = LOG_INFO, .a = code, .reason = reason };
+    copy_text(&rec, name);
+    push(&rec);
+}
+
+void log_matched(void){
+    LogRecord rec = { .event = EV_MATCHED, .level = LOG_INFO };
+    push(&rec);
+}
+
+void log_text(int level, const char *fmt, ...){
+    LogRecord rec = { .event = EV_TEXT, .level = level };
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(rec.text, sizeof(rec.text), fmt, ap);
+    va_end(ap);
+    push(&rec);
+}
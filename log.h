@@ -0,0 +1,31 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+// handlers push fixed-size binary records into a ring owned by their thread, a
+// background thread formats them and writes them to stdout in batches. A full ring
+// drops the record and counts it, the count is logged once there is room again
+enum { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_LEVELS };
+
+#define LOG_RING_SIZE 4096 // records per thread, power of two
+#define LOG_TEXT_MAX 96
+#define LOG_NOISY_BURST 20 // noisy records logged per thread and second before sampling
+#define LOG_NOISY_SAMPLE 100 // past the burst, one noisy record in this many is kept
+
+// gives the calling thread its own ring and starts the writer thread on first use.
+// Threads that never attach log synchronously
+void log_attach(void);
+// in a freshly forked child: forget the parent's rings and writer thread
+void log_forked(void);
+// drains every ring on the calling thread, for a process about to exit
+void log_flush(void);
+
+void log_accepted(void);
+void log_connected(const char *name);
+void log_move(const char *name, int quantity, int pile);
+void log_fail(const char *name, int code, const char *reason); // Impatient is sampled
+void log_matched(void);
+void log_text(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
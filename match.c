@@ -0,0 +1,345 @@
+#include "match.h"
+#include "handlers.h"
+#include "journal.h"
+#include <string.h>
+#include "stats.h"
+#include "config.h"
+#include <ctype.h>
+#include <pthread.h>
+
+// players of one queue in arrival order, linked through q_prev/q_next
+typedef struct {
+    char tag[MATCH_TAG_LEN + 1];
+    struct Player *head;
+    struct Player *tail;
+    int waiting;
+    int refs; // players holding the id, the slot is free again once none do
+} MatchQueue;
+
+// queues are created on first use and freed once no player holds their id, so made up
+// tags cannot use up the slots for good. Queue 0 is the default one and always exists
+static pthread_mutex_t match_lock = PTHREAD_MUTEX_INITIALIZER;
+static MatchQueue queues[MAX_QUEUES];
+static int queue_count = 1;
+static SuspendedGame *suspended = NULL; // linked through next
+static int suspended_count = 0;
+static int total_waiting = 0; // over every queue, checked against config.max_waiting
+
+static bool is_valid_tag(const char *tag){
+    int length = strlen(tag);
+    if(length > MATCH_TAG_LEN){
+        return false;
+    }
+    for(int i = 0; i < length; i++){
+        unsigned char ch = (unsigned char)tag[i];
+        if(!isalnum(ch) && ch != '-' && ch != '_' && ch != '.'){
+            return false;
+        }
+    }
+    return true;
+}
+
+int match_queue_id(const char *tag){
+    if(!tag || !is_valid_tag(tag)){
+        return -1;
+    }
+
+    pthread_mutex_lock(&match_lock);
+    int id = -1;
+    int free_slot = -1;
+    for(int i = 0; i < queue_count; i++){
+        if(i > 0 && queues[i].refs == 0){
+            if(free_slot < 0){
+                free_slot = i;
+            }
+        }else if(strcmp(queues[i].tag, tag) == 0){
+            id = i;
+            break;
+        }
+    }
+    if(id < 0 && free_slot < 0 && queue_count < MAX_QUEUES){
+        free_slot = queue_count++;
+    }
+    if(id < 0 && free_slot >= 0){
+        id = free_slot;
+        strcpy(queues[id].tag, tag);
+    }
+    if(id >= 0){
+        queues[id].refs++;
+    }
+    pthread_mutex_unlock(&match_lock);
+    return id;
+}
+
+void match_queue_release(int id){
+    pthread_mutex_lock(&match_lock);
+    if(id > 0){
+        queues[id].refs--; // its last waiter is gone too, waiters hold the id as well
+    }
+    pthread_mutex_unlock(&match_lock);
+}
+
+const char *match_queue_tag(int id){
+    return queues[id].tag; // never changes while the caller holds the id
+}
+
+int match_waiting(int id){
+    pthread_mutex_lock(&match_lock);
+    int waiting = queues[id].waiting;
+    pthread_mutex_unlock(&match_lock);
+    return waiting;
+}
+
+int match_queue_count(void){
+    pthread_mutex_lock(&match_lock);
+    int count = queue_count;
+    pthread_mutex_unlock(&match_lock);
+    return count;
+}
+
+void match_suspend(SuspendedGame *list){
+    pthread_mutex_lock(&match_lock);
+    while(list){
+        SuspendedGame *s = list;
+        list = s->next;
+        s->waiter = NULL;
+        s->next = suspended;
+        suspended = s;
+        suspended_count++;
+    }
+    pthread_mutex_unlock(&match_lock);
+}
+
+static int seat_of(const SuspendedGame *s, const char *name){
+    if(strcmp(s->names[0], name) == 0){
+        return 0;
+    }
+    return (strcmp(s->names[1], name) == 0) ? 1 : -1;
+}
+
+// claimed under the lock, so no other shard can pair, hand off or free the game
+// between finding it and taking the seat
+SuspendedGame *match_claim_suspended(const char *name){
+    pthread_mutex_lock(&match_lock);
+    SuspendedGame *s = suspended;
+    while(s){
+        int seat = seat_of(s, name);
+        if(seat >= 0 && !s->claimed[seat]){
+            s->claimed[seat] = true;
+            break;
+        }
+        s = s->next;
+    }
+    pthread_mutex_unlock(&match_lock);
+    return s;
+}
+
+// caller holds the match lock
+static void release_seat(Player *p){
+    p->resume->claimed[seat_of(p->resume, p->name)] = false;
+    p->resume = NULL;
+}
+
+void match_resume_done(SuspendedGame *s){
+    pthread_mutex_lock(&match_lock);
+    for(SuspendedGame **link = &suspended; *link; link = &(*link)->next){
+        if(*link == s){
+            *link = s->next;
+            suspended_count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&match_lock);
+}
+
+int match_suspended(void){
+    pthread_mutex_lock(&match_lock);
+    int count = suspended_count;
+    pthread_mutex_unlock(&match_lock);
+    return count;
+}
+
+void match_defer(Player **pending, Player *p){
+    p->opening = true;
+    p->partner = NULL;
+    p->pending_next = *pending;
+    *pending = p;
+}
+
+static void push_waiter(MatchQueue *q, Player *p, uint64_t now){
+    p->q_next = NULL;
+    p->q_prev = q->tail;
+    if(q->tail){
+        q->tail->q_next = p;
+    }else{
+        q->head = p;
+    }
+    q->tail = p;
+    q->waiting++;
+    total_waiting++;
+    p->wait_start = now;
+    p->match_state = MATCH_WAITING;
+}
+
+static void unlink_waiter(MatchQueue *q, Player *p){
+    if(p->q_prev){
+        p->q_prev->q_next = p->q_next;
+    }else{
+        q->head = p->q_next;
+    }
+    if(p->q_next){
+        p->q_next->q_prev = p->q_prev;
+    }else{
+        q->tail = p->q_prev;
+    }
+    p->q_prev = NULL;
+    p->q_next = NULL;
+    q->waiting--;
+    total_waiting--;
+    p->match_state = MATCH_IDLE;
+}
+
+Player *match_batch(Player **pending){
+    // the list was built by pushing at the front, reverse it so OPENs pair in arrival order
+    Player *batch = NULL;
+    while(*pending){
+        Player *p = *pending;
+        *pending = p->pending_next;
+        p->opening = false;
+        if(p->closed){
+            continue;
+        }
+        p->pending_next = batch;
+        batch = p;
+    }
+
+    uint64_t now = stats_now();
+    pthread_mutex_lock(&match_lock);
+    for(Player *p = batch; p; p = p->pending_next){
+        Player *waiter;
+        if(p->resume){ // only the other seat of its game will do
+            waiter = p->resume->waiter;
+            if(!waiter){
+                p->resume->waiter = p;
+                p->wait_start = now;
+                p->match_state = MATCH_RESUMING;
+                send_wait(p);
+                continue;
+            }
+            p->resume->waiter = NULL;
+            waiter->match_state = MATCH_IDLE;
+        }else{
+            MatchQueue *q = &queues[p->queue];
+            waiter = q->head;
+            if(!waiter && config.max_waiting > 0 && total_waiting >= config.max_waiting){
+                p->refused = true; // pairing with a waiter is still fine, only joining is not
+                continue;
+            }
+            if(!waiter){
+                push_waiter(q, p, now);
+                send_wait(p); // before the unlock, another shard may pair p right after
+                continue;
+            }
+            unlink_waiter(q, waiter);
+        }
+
+        stats_record(HIST_QUEUE_WAIT, now - waiter->wait_start);
+        if(waiter->owner != p->owner){
+            waiter->handoff_pending = true; // its shard must not free it before the handoff lands
+        }
+        p->partner = waiter;
+    }
+    pthread_mutex_unlock(&match_lock);
+    return batch;
+}
+
+void match_requeue(Player *p){
+    pthread_mutex_lock(&match_lock);
+    if(p->resume){
+        if(!p->resume->waiter){
+            p->resume->waiter = p;
+            p->match_state = MATCH_RESUMING;
+        }
+        pthread_mutex_unlock(&match_lock);
+        return;
+    }
+
+    // the old process's shards each pass their own waiters on, so they arrive out of
+    // order and are slotted in by how long they have waited
+    MatchQueue *q = &queues[p->queue];
+    Player *before = q->tail;
+    while(before && before->wait_start > p->wait_start){
+        before = before->q_prev;
+    }
+    p->q_prev = before;
+    p->q_next = before ? before->q_next : q->head;
+    if(p->q_next){
+        p->q_next->q_prev = p;
+    }else{
+        q->tail = p;
+    }
+    if(before){
+        before->q_next = p;
+    }else{
+        q->head = p;
+    }
+    q->waiting++;
+    total_waiting++;
+    p->match_state = MATCH_WAITING;
+    pthread_mutex_unlock(&match_lock);
+}
+
+SuspendedGame *match_take_suspended(void){
+    pthread_mutex_lock(&match_lock);
+    SuspendedGame *list = suspended;
+    suspended = NULL;
+    suspended_count = 0;
+    pthread_mutex_unlock(&match_lock);
+    return list;
+}
+
+Player *match_expired(struct Reactor *owner, long max_wait_ms){
+    Player *expired = NULL;
+    uint64_t now = stats_now();
+    uint64_t max_wait = (uint64_t)max_wait_ms * 1000000ULL;
+
+    pthread_mutex_lock(&match_lock);
+    for(int i = 0; i < queue_count; i++){
+        // queues are in arrival order, so the walk stops at the first recent waiter
+        Player *p = queues[i].head;
+        while(p && now - p->wait_start >= max_wait){
+            Player *next = p->q_next;
+            if(p->owner == owner){
+                unlink_waiter(&queues[i], p);
+                stats_record(HIST_QUEUE_WAIT, now - p->wait_start);
+                p->pending_next = expired;
+                expired = p;
+            }
+            p = next;
+        }
+    }
+    pthread_mutex_unlock(&match_lock);
+    return expired;
+}
+
+bool match_leave(Player *p){
+    pthread_mutex_lock(&match_lock);
+    if(p->match_state == MATCH_WAITING){
+        unlink_waiter(&queues[p->queue], p);
+    }else if(p->match_state == MATCH_RESUMING){
+        p->resume->waiter = NULL; // the seat is free for the player's next connection
+        p->match_state = MATCH_IDLE;
+        release_seat(p);
+    }else if(p->opening && p->resume){ // claimed, but the batch will skip it
+        release_seat(p);
+    }
+    bool handoff_pending = p->handoff_pending;
+    pthread_mutex_unlock(&match_lock);
+    return handoff_pending;
+}
+
+void match_handoff_done(Player *waiter){
+    pthread_mutex_lock(&match_lock);
+    waiter->handoff_pending = false;
+    pthread_mutex_unlock(&match_lock);
+}
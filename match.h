@@ -0,0 +1,63 @@
+#ifndef MATCH_H
+#define MATCH_H
+
+#include <stdbool.h>
+
+struct Player;
+struct Reactor;
+struct SuspendedGame;
+
+#define MATCH_TAG_LEN 16 // longest queue name accepted as the second field of OPEN
+#define MAX_QUEUES 64
+
+// Player.match_state, guarded by the match lock since another shard may pair a waiter
+#define MATCH_IDLE 0
+#define MATCH_WAITING 1 // linked into its queue until an opponent shows up
+#define MATCH_RESUMING 2 // back for a suspended game, waiting for the other seat
+
+// named queues shared by every shard: players only meet others that gave the same tag
+// in OPEN, an OPEN without one joins the default queue "". Returns the queue id, or -1
+// if the tag is malformed or every queue is taken. Each id returned is held until
+// match_queue_release, a queue no one holds gives its slot to the next new tag
+int match_queue_id(const char *tag);
+void match_queue_release(int id);
+const char *match_queue_tag(int id);
+int match_waiting(int id); // players currently waiting in a queue
+int match_queue_count(void); // every id in use is below it
+
+// games recovered from the journal act as private two-seat queues: OPEN with a name
+// that has a seat in one claims it (Player.resume) and the batch pairs the two seats
+// with each other only. They stay until both players are back or the process exits.
+// A claimed seat is the claimer's alone, match_leave gives it up if the connection
+// goes before the game resumes
+void match_suspend(struct SuspendedGame *list);
+struct SuspendedGame *match_claim_suspended(const char *name); // NULL if no free seat
+// the game is being played again: forget it, the caller frees it
+void match_resume_done(struct SuspendedGame *s);
+int match_suspended(void);
+
+// holds p (flagged opening) until the end of the batch, pending is the calling shard's own list
+void match_defer(struct Player **pending, struct Player *p);
+
+// pairs every pending player under one lock acquisition: each either takes the oldest
+// waiter of its queue (left in p->partner) or is queued itself and sent WAIT.
+// Returns the batch, linked through pending_next, minus players closed meanwhile
+struct Player *match_batch(struct Player **pending);
+
+// unlinks the waiters owned by this shard that have waited at least max_wait_ms and
+// returns them linked through pending_next, waiters of other shards are left alone
+struct Player *match_expired(struct Reactor *owner, long max_wait_ms);
+
+// a waiter carried over from the process this one replaced, which already sent it
+// WAIT: back into its queue (or its suspended game's seat) by its original wait_start
+void match_requeue(struct Player *p);
+// empties the suspended games for passing them on to a new process, the caller owns them
+struct SuspendedGame *match_take_suspended(void);
+
+// takes a waiting player out of its queue, O(1). Returns true if another shard already
+// paired it and is handing its opponent over, the handoff then frees it
+bool match_leave(struct Player *p);
+// called by the waiter's shard once the opponent handed over to it has arrived
+void match_handoff_done(struct Player *waiter);
+
+#endif
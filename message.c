@@ -7,112 +7,199 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <strings.h>
+#include <limits.h>
+#include <sys/socket.h>
+
+int parse_header(const char *buf, int len) {
+    // version
+    if (len < 1) return 0;
+    if (buf[0] != '0' && buf[0] != WIDE_VERSION) return -1;
+    bool wide = buf[0] == WIDE_VERSION;
+
+    // first '|'
+    if (len < 2) return 0;
+    if (buf[1] != '|') return -1;
+
+    // 2-digit length, 5 digits in a wide frame
+    int end = header_length(buf) - 1;
+    int msg_len = 0;
+    for (int i = 2; i < end; i++) {
+        if (len <= i) return 0;
+        if (!isdigit((unsigned char)buf[i])) return -1;
+        msg_len = msg_len * 10 + (buf[i] - '0');
+    }
 
-Message *read_message(int sock_fd) {
-    char version, bar, len[3];
+    if (msg_len <= 0 || msg_len > (wide ? MAX_WIDE_MSG_LENGTH : MAX_MSG_LENGTH)) return -1;
 
-    // read version
-    if (read(sock_fd, &version, 1) <= 0) return NULL;
-    if (version != '0') return NULL;
+    // second '|'
+    if (len <= end) return 0;
+    if (buf[end] != '|') return -1;
 
-    // read first '|'
-    if (read(sock_fd, &bar, 1) <= 0) return NULL;
-    if (bar != '|') return NULL;
+    return msg_len;
+}
 
-    // read 2-digit length
-    if (read(sock_fd, len, 2) <= 0) return NULL;
-    if (!isdigit(len[0]) || !isdigit(len[1])) return NULL;
-    len[2] = '\0';
+int header_length(const char *buf) {
+    return (buf[0] == WIDE_VERSION) ? WIDE_HEADER_LENGTH : HEADER_LENGTH;
+}
 
-    int msg_len = atoi(len);
-    if (msg_len <= 0 || msg_len > MAX_MSG_LENGTH) return NULL;
+// splits the body in place, every field ends up NUL-terminated inside the buffer
+static int split_fields(char *body, int msg_len, Message *msg) {
+    // ensure last character is '|'
+    if (body[msg_len - 1] != '|') return -2;
 
-    // read second '|'
-    if (read(sock_fd, &bar, 1) <= 0) return NULL;
-    if (bar != '|') return NULL;
+    char *fields[MAX_FIELDS + 1];
+    int num = 0;
+    char *token = body;
+    for (int i = 0; i < msg_len && num <= MAX_FIELDS; i++) {
+        if (body[i] != '|') continue;
+        body[i] = '\0';
+        if (*token) fields[num++] = token; // empty fields are skipped like strtok would
+        token = body + i + 1;
+    }
 
-    // read message content (including trailing '|')
-    char *buf = malloc(msg_len + 1);
-    if (!buf) return NULL;
+    if (num < 1) return -2; // at least message type
 
-    int bytes_read = 0;
-    while (bytes_read < msg_len) {
-        int n = read(sock_fd, buf + bytes_read, msg_len - bytes_read);
-        if (n <= 0) {
-            free(buf);
-            return NULL;
-        }
-        bytes_read += n;
-    }
-    buf[msg_len] = '\0';
+    msg->version = '0';
+    msg->length = msg_len;
+    strncpy(msg->type, fields[0], 5);
+    msg->type[5] = '\0';
 
-    // ensure last character is '|'
-    if (buf[msg_len - 1] != '|') {
-        free(buf);
-        return NULL;
+    msg->field_num = num - 1;
+    for (int i = 0; i < msg->field_num; i++) {
+        msg->fields[i] = fields[i + 1];
     }
+    return 1;
+}
 
-    // split fields
-    char *fields[20];
-    int num = 0;
-    char *ptr = NULL;
-    char *token = strtok_r(buf, "|", &ptr);
-    while (token && num < 20) {
-        fields[num++] = token;
-        token = strtok_r(NULL, "|", &ptr);
+// slide the unparsed tail to the front so a whole frame always fits
+static void compact(RecvBuffer *rb) {
+    if (rb->start > 0) {
+        memmove(rb->data, rb->data + rb->start, rb->end - rb->start);
+        rb->end -= rb->start;
+        rb->start = 0;
     }
+}
 
-    if (num < 1) { // at least message type
-        free(buf);
-        return NULL;
-    }
+int recv_fill(RecvBuffer *rb, int fd) {
+    compact(rb);
+    int n = recv(fd, rb->data + rb->end, RECV_BUF_SIZE - rb->end, 0);
+    if (n > 0) rb->end += n;
+    return n;
+}
 
-    Message *msg = malloc(sizeof(Message));
-    if (!msg) {
-        free(buf);
-        return NULL;
-    }
+int recv_append(RecvBuffer *rb, const char *data, int len) {
+    compact(rb);
+    if (len > RECV_BUF_SIZE - rb->end) len = RECV_BUF_SIZE - rb->end;
+    memcpy(rb->data + rb->end, data, len);
+    rb->end += len;
+    return len;
+}
 
-    msg->version = version;
-    msg->length = msg_len;
-    strncpy(msg->type, fields[0], 4);
-    msg->type[4] = '\0';
+void bin_put16(char *out, int value) {
+    out[0] = (char)(value >> 8);
+    out[1] = (char)value;
+}
 
-    msg->field_num = num - 1;
-    msg->fields = malloc(sizeof(char*) * msg->field_num);
-    if (!msg->fields) {
-        free(msg);
-        free(buf);
-        return NULL;
-    }
+void bin_put32(char *out, unsigned value) {
+    bin_put16(out, value >> 16);
+    bin_put16(out + 2, value & 0xffff);
+}
 
-    for (int i = 0; i < msg->field_num; i++) {
-        msg->fields[i] = strdup(fields[i + 1] ? fields[i + 1] : "");
-        if (!msg->fields[i]) {
-            for (int j = 0; j < i; j++) free(msg->fields[j]);
-            free(msg->fields);
-            free(msg);
-            free(buf);
-            return NULL;
+int bin_get16(const char *in) {
+    return ((unsigned char)in[0] << 8) | (unsigned char)in[1];
+}
+
+unsigned bin_get32(const char *in) {
+    return ((unsigned)bin_get16(in) << 16) | (unsigned)bin_get16(in + 2);
+}
+
+static const char *bin_types[] = { "", "OPEN", "WAIT", "NAME", "PLAY", "MOVE", "OVER", "FAIL", "WATCH" };
+
+// a NUL padded field is usable as a string in place if the NUL is inside it
+static bool terminated(const char *field, int width) {
+    return memchr(field, '\0', width) != NULL;
+}
+
+// fills msg the way split_fields would, so the handlers see the same message either
+// way; only MOVE differs, its numbers arrive decoded in values
+static int decode_binary(int type, char *body, int len, Message *msg) {
+    if (type < BIN_OPEN || type > BIN_WATCH) return -2;
+
+    msg->version = BIN_VERSION;
+    msg->length = len;
+    strcpy(msg->type, bin_types[type]);
+    msg->field_num = 0;
+
+    if (type == BIN_OPEN) {
+        if (len != BIN_OPEN_LENGTH || !terminated(body, BIN_NAME_FIELD) ||
+            !terminated(body + BIN_NAME_FIELD, BIN_TAG_FIELD)) return -2;
+        msg->fields[0] = body;
+        msg->fields[1] = body + BIN_NAME_FIELD;
+        msg->field_num = 2;
+    } else if (type == BIN_MOVE) {
+        if (len != BIN_MOVE_LENGTH) return -2;
+        for (int i = 0; i < 2; i++) {
+            unsigned value = bin_get32(body + 4 * i);
+            msg->values[i] = (value > INT_MAX) ? -1 : (int)value; // out of range either way
+            msg->fields[i] = NULL;
         }
+        msg->field_num = 2;
+    } else if (type == BIN_WATCH) {
+        if (len != BIN_NAME_FIELD || !terminated(body, BIN_NAME_FIELD)) return -2;
+        msg->fields[0] = body;
+        msg->field_num = 1;
     }
+    return 1;
+}
 
-    free(buf);
-    return msg;
+static int next_binary(RecvBuffer *rb, Message *msg) {
+    char *frame = rb->data + rb->start;
+    int avail = rb->end - rb->start;
+    if (avail < BIN_HEADER_LENGTH) return 0;
+
+    int msg_len = bin_get16(frame + 2);
+    if (msg_len > BIN_MAX_BODY) return -1;
+    if (avail < BIN_HEADER_LENGTH + msg_len) return 0;
+
+    rb->start += BIN_HEADER_LENGTH + msg_len;
+    return decode_binary((unsigned char)frame[1], frame + BIN_HEADER_LENGTH, msg_len, msg);
 }
 
-void free_message(Message *msg) { // free message and all attributes
-    if(!msg){
-        return;
-    } 
+int next_message(RecvBuffer *rb, Message *msg) {
+    char *frame = rb->data + rb->start;
+    int avail = rb->end - rb->start;
+    if (avail > 0 && frame[0] == BIN_VERSION) return next_binary(rb, msg);
 
-    if(msg->fields){
-        for(int i = 0; i < msg->field_num; i++){
-            free(msg->fields[i]); 
-        }
-        free(msg->fields);
+    int full_header = (avail > 0) ? header_length(frame) : HEADER_LENGTH;
+    int header_len = (avail < full_header) ? avail : full_header;
+    int msg_len = parse_header(frame, header_len);
+    if (msg_len < 0) return -1;
+    if (full_header + msg_len > RECV_BUF_SIZE) return -1; // could never arrive whole
+    if (msg_len == 0 || avail < full_header + msg_len) return 0;
+
+    rb->start += full_header + msg_len;
+    return split_fields(frame + full_header, msg_len, msg);
+}
+
+bool parse_int_field(const char *s, int *out) {
+    if (!s || !*s) return false;
+
+    int sign = 1;
+    if (*s == '-' || *s == '+') {
+        if (*s == '-') sign = -1;
+        s++;
+    }
+    if (!*s) return false;
+
+    long value = 0;
+    for (; *s; s++) {
+        if (!isdigit((unsigned char)*s)) return false;
+        value = value * 10 + (*s - '0');
+        if (value > INT_MAX) return false;
     }
-    free(msg);
+
+    *out = (int)(sign * value);
+    return true;
 }
 
 bool is_valid_name(const char *name){
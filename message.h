@@ -4,17 +4,75 @@
 #include <stdbool.h>
 
 #define MAX_MSG_LENGTH 99
+#define HEADER_LENGTH 5 // "0|NN|"
+#define MAX_FRAME_LENGTH (HEADER_LENGTH + MAX_MSG_LENGTH)
+
+// the PLAY and OVER of a large "B<n>" board do not fit a two-digit length. The server
+// sends those, and only those, as version '2' text frames whose length always has five
+// digits: "2|20481|PLAY|1|1 3 5 ...|". Everything else stays "0|NN|"
+#define WIDE_VERSION '2'
+#define WIDE_HEADER_LENGTH 8 // "2|NNNNN|"
+#define MAX_WIDE_MSG_LENGTH 99999
+#define MAX_FIELDS 20
+#define RECV_BUF_SIZE 1024 // per connection, holds several pipelined frames
+
+// protocol version 1, for clients that never need to read their frames: fixed-width
+// binary records behind the version byte '1', a type code and the body length as a
+// big-endian u16. Every integer is big-endian, names and tags are NUL padded fields
+//   OPEN  name[73] tag[17]          WAIT  (empty)
+//   NAME  u8 p_num, name[73]        MOVE  u32 pile, u32 quantity
+//   PLAY  u8 next_p, u8 0, u16 pile_count, u16 piles[pile_count]
+//   OVER  u8 winner, u8 forfeit, u16 pile_count, u16 piles[pile_count]
+//   FAIL  u16 code                  WATCH name[73]
+// The OPEN picks the version a connection speaks for the rest of its life, text and
+// binary clients share the port and may play each other
+#define BIN_VERSION '1'
+#define BIN_HEADER_LENGTH 4
+#define BIN_NAME_FIELD 73
+#define BIN_TAG_FIELD 17
+#define BIN_OPEN_LENGTH (BIN_NAME_FIELD + BIN_TAG_FIELD)
+#define BIN_MOVE_LENGTH 8
+#define BIN_MAX_BODY BIN_OPEN_LENGTH // longest frame a client sends
+enum { BIN_OPEN = 1, BIN_WAIT, BIN_NAME, BIN_PLAY, BIN_MOVE, BIN_OVER, BIN_FAIL, BIN_WATCH };
 
 typedef struct {
-    char version; // should always be 0
-    char type[5]; // message type (OPEN, WAIT, NAME, PLAY, MOVE, OVER, FAIL), 4 ASCII characters
+    char version; // '0' for text frames, BIN_VERSION for binary ones
+    char type[6]; // message type (OPEN, WAIT, NAME, PLAY, MOVE, OVER, FAIL, WATCH), up to 5 ASCII characters
     int field_num; // number of fields, depending on message type
-    char **fields; // array of fields
+    char *fields[MAX_FIELDS]; // point into the RecvBuffer the message was parsed from
+    int values[2]; // binary MOVE: pile and quantity, already decoded (fields are NULL)
     int length;
 } Message;
 
-Message *read_message(int sock_fd);
-void free_message(Message *msg);
+typedef struct {
+    char data[RECV_BUF_SIZE];
+    int start; // first byte not yet parsed
+    int end;   // one past the last byte received
+} RecvBuffer;
+
+// checks the first len bytes of a text frame header of either width, returns the body
+// length once the whole header is present, 0 if more bytes are needed and -1 if malformed
+int parse_header(const char *buf, int len);
+// HEADER_LENGTH or WIDE_HEADER_LENGTH by the version byte buf starts with
+int header_length(const char *buf);
+
+// one recv() of as much as the buffer can hold, returns its result
+int recv_fill(RecvBuffer *rb, int fd);
+// copies bytes that were received elsewhere, returns how many fit
+int recv_append(RecvBuffer *rb, const char *data, int len);
+
+// extracts the next complete frame of either version: 1 on success, 0 if more bytes are needed, -1 if the
+// header is malformed (the stream cannot be resynchronized) and -2 if the frame was
+// skipped because its body is malformed. msg is only valid until the next recv_fill
+int next_message(RecvBuffer *rb, Message *msg);
+
+// strict decimal parse, false on junk or overflow instead of atoi's silent garbage
+bool parse_int_field(const char *s, int *out);
 bool is_valid_name(const char *name);
 
+void bin_put16(char *out, int value);
+void bin_put32(char *out, unsigned value);
+int bin_get16(const char *in);
+unsigned bin_get32(const char *in);
+
 #endif 
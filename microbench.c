@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "handlers.h"
+#include "message.h"
+#include "send.h"
+
+#define ROUNDS 20000
+
+// measures the per-frame codec path: parsing frames out of a RecvBuffer and encoding
+// frames into a SendBuffer, alone and together with the syscalls that move them.
+// Linked with --wrap so every malloc and send/recv made by the server code is counted
+
+static uint64_t allocs;
+static uint64_t syscalls;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+ssize_t __real_send(int fd, const void *buf, size_t len, int flags);
+ssize_t __real_recv(int fd, void *buf, size_t len, int flags);
+
+void *__wrap_malloc(size_t size) { allocs++; return __real_malloc(size); }
+void *__wrap_calloc(size_t n, size_t size) { allocs++; return __real_calloc(n, size); }
+void *__wrap_realloc(void *ptr, size_t size) { allocs++; return __real_realloc(ptr, size); }
+ssize_t __wrap_send(int fd, const void *buf, size_t len, int flags) { syscalls++; return __real_send(fd, buf, len, flags); }
+ssize_t __wrap_recv(int fd, void *buf, size_t len, int flags) { syscalls++; return __real_recv(fd, buf, len, flags); }
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+typedef struct {
+    double t0;
+    uint64_t allocs0;
+    uint64_t syscalls0;
+} Sample;
+
+static Sample start_sample() {
+    Sample s = { now_ns(), allocs, syscalls };
+    return s;
+}
+
+static void report(const char *name, Sample s, long frames) {
+    if (!name) return; // warm-up
+    double ns = now_ns() - s.t0;
+    printf("%-28s %10ld %10.1f %10.3f %10.3f\n", name, frames, ns / frames,
+           (double)(allocs - s.allocs0) / frames, (double)(syscalls - s.syscalls0) / frames);
+}
+
+// corpus: a few frames repeated until a RecvBuffer is full, so every pass parses a
+// whole buffer the way one large recv() would deliver it. Binary frames hold NULs
+// and come with their lengths, text ones are measured with strlen
+static const int *corpus_lens = NULL;
+
+static int build_corpus(char *buf, int cap, const char **frames, int count) {
+    int len = 0;
+    for (int i = 0; ; i = (i + 1) % count) {
+        int n = corpus_lens ? corpus_lens[i] : (int)strlen(frames[i]);
+        if (len + n > cap) break;
+        memcpy(buf + len, frames[i], n);
+        len += n;
+    }
+    return len;
+}
+
+static void bench_parse(const char *name, const char **frames, int count) {
+    char corpus[RECV_BUF_SIZE];
+    int len = build_corpus(corpus, sizeof(corpus), frames, count);
+    static RecvBuffer rb;
+    Message msg;
+    long parsed = 0;
+
+    Sample s = start_sample();
+    for (int r = 0; r < ROUNDS; r++) {
+        memcpy(rb.data, corpus, len);
+        rb.start = 0;
+        rb.end = len;
+        while (1) {
+            int res = next_message(&rb, &msg);
+            if (res == 0) break;
+            parsed++;
+            if (res == -1) {
+                // a bad header ends the connection, skip to the next frame as a new one would
+                int header = (rb.end - rb.start < HEADER_LENGTH) ? rb.end - rb.start : HEADER_LENGTH;
+                const char *bar = memchr(rb.data + rb.start + header, '0', rb.end - rb.start - header);
+                if (!bar) break;
+                rb.start = bar - rb.data;
+            }
+        }
+    }
+    report(name, s, parsed);
+}
+
+// same frames, but delivered through a socketpair and pulled in with recv_fill
+static void bench_recv(const char *name, const char **frames, int count) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) { perror("socketpair"); exit(1); }
+    char corpus[RECV_BUF_SIZE];
+    int len = build_corpus(corpus, sizeof(corpus), frames, count);
+    static RecvBuffer rb;
+    Message msg;
+    long parsed = 0;
+
+    Sample s = start_sample();
+    for (int r = 0; r < ROUNDS; r++) {
+        if (write(sv[0], corpus, len) != len) { perror("write"); exit(1); }
+        rb.start = rb.end = 0;
+        while (rb.end < len) {
+            if (recv_fill(&rb, sv[1]) <= 0) { perror("recv"); exit(1); }
+        }
+        while (next_message(&rb, &msg) > 0) parsed++;
+    }
+    report(name, s, parsed);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void bench_names() {
+    char longest[73];
+    memset(longest, 'n', 72);
+    longest[72] = '\0';
+    const char *names[] = { "Ann", "Charlie", longest, "bad|name" };
+    long checked = 0;
+    int valid = 0;
+
+    Sample s = start_sample();
+    for (int r = 0; r < ROUNDS * 10; r++) {
+        for (int i = 0; i < 4; i++) {
+            valid += is_valid_name(names[i]);
+            checked++;
+        }
+    }
+    report("is_valid_name", s, checked);
+    if (valid != ROUNDS * 10 * 3) printf("unexpected is_valid_name result\n");
+}
+
+// MOVE frames parsed and their numbers decoded the way handle_move gets them
+static void bench_moves(const char *name, const char *frame, int frame_len) {
+    char corpus[RECV_BUF_SIZE];
+    int lens[1] = { frame_len };
+    corpus_lens = lens;
+    int len = build_corpus(corpus, sizeof(corpus), &frame, 1);
+    corpus_lens = NULL;
+    static RecvBuffer rb;
+    Message msg;
+    long parsed = 0;
+    long sum = 0;
+
+    Sample s = start_sample();
+    for (int r = 0; r < ROUNDS; r++) {
+        memcpy(rb.data, corpus, len);
+        rb.start = 0;
+        rb.end = len;
+        while (next_message(&rb, &msg) > 0) {
+            int pile = msg.values[0];
+            int quantity = msg.values[1];
+            if (msg.version != BIN_VERSION) {
+                parse_int_field(msg.fields[0], &pile);
+                parse_int_field(msg.fields[1], &quantity);
+            }
+            sum += pile + quantity;
+            parsed++;
+        }
+    }
+    report(name, s, parsed);
+    if (sum != parsed * 5) printf("unexpected MOVE values\n");
+}
+
+// one PLAY to both players per round; with a peer the queue is flushed each time
+static void bench_send_play(const char *name, int board, bool flush, bool binary) {
+    Player *p1 = new_player();
+    Player *p2 = new_player();
+    Game *g = new_game();
+    p1->board = board;
+    p1->binary = binary;
+    p2->binary = binary;
+    int sv[2] = { -1, -1 };
+    if (flush && socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) { perror("socketpair"); exit(1); }
+    p1->fd = sv[0];
+    p2->fd = sv[0];
+    if (!create_game(g, p1, p2)) { printf("no board\n"); exit(1); }
+
+    static char sink[1 << 16];
+    send_play(g); // buffers grow to size outside the timed loop
+    p1->tx.start = p1->tx.end = p2->tx.start = p2->tx.end = 0;
+
+    Sample s = start_sample();
+    for (int r = 0; r < ROUNDS; r++) {
+        send_play(g);
+        if (flush) {
+            flush_player(p1);
+            flush_player(p2);
+            while (read(sv[1], sink, sizeof(sink)) == sizeof(sink)) {}
+        } else {
+            p1->tx.start = p1->tx.end = p2->tx.start = p2->tx.end = 0;
+        }
+    }
+    report(name, s, ROUNDS * 2L);
+
+    if (flush) { close(sv[0]); close(sv[1]); }
+    delete_game(g);
+    delete_player(p1);
+    delete_player(p2);
+}
+
+static void bench_send_small(const char *name, bool binary) {
+    Player *p = new_player();
+    p->binary = binary;
+    send_fail(p, 33, "Quantity");
+    p->tx.start = p->tx.end = 0;
+
+    Sample s = start_sample();
+    for (int r = 0; r < ROUNDS; r++) {
+        send_wait(p);
+        send_name(p, 1, "Charlie");
+        send_fail(p, 33, "Quantity");
+        p->tx.start = p->tx.end = 0;
+    }
+    report(name, s, ROUNDS * 3L);
+    delete_player(p);
+}
+
+int main() {
+    static char max_frame[MAX_FRAME_LENGTH + 1];
+    char body[MAX_MSG_LENGTH + 1];
+    memset(body, 'x', MAX_MSG_LENGTH);
+    memcpy(body, "OPEN|", 5);
+    body[5 + 72] = '|';
+    body[MAX_MSG_LENGTH - 1] = '|';
+    body[MAX_MSG_LENGTH] = '\0';
+    snprintf(max_frame, sizeof(max_frame), "0|99|%s", body);
+
+    const char *valid[] = { "0|09|OPEN|Ann|", "0|09|MOVE|3|2|", "0|16|OPEN|Charlie|B7|" };
+    const char *longest[] = { max_frame };
+    const char *bad_body[] = { "0|08|MOVE|1|2", "0|09|XXXX|1|2|" };
+    const char *bad_header[] = { "0|x9|MOVE|1|2|", "1|09|MOVE|1|2|" };
+
+    // the same three frames in protocol version 1
+    static char bin_open_ann[4 + BIN_OPEN_LENGTH] = { '1', BIN_OPEN, 0, BIN_OPEN_LENGTH, 'A', 'n', 'n' };
+    static char bin_open_charlie[4 + BIN_OPEN_LENGTH] = { '1', BIN_OPEN, 0, BIN_OPEN_LENGTH, 'C', 'h', 'a', 'r', 'l', 'i', 'e' };
+    memcpy(bin_open_charlie + 4 + BIN_NAME_FIELD, "B7", 2);
+    static const char bin_move[4 + BIN_MOVE_LENGTH] = { '1', BIN_MOVE, 0, BIN_MOVE_LENGTH, 0, 0, 0, 3, 0, 0, 0, 2 };
+    const char *bin_valid[] = { bin_open_ann, bin_move, bin_open_charlie };
+    const int bin_lens[] = { sizeof(bin_open_ann), sizeof(bin_move), sizeof(bin_open_charlie) };
+
+    // untimed pass so slab chunks and send buffers are already in place
+    bench_send_play(NULL, STANDARD_PILES, false, false);
+
+    printf("%-28s %10s %10s %10s %10s\n", "case", "frames", "ns/frame", "allocs/fr", "syscalls/fr");
+    bench_parse("parse valid", valid, 3);
+    bench_parse("parse 99-byte", longest, 1);
+    bench_parse("parse malformed body", bad_body, 2);
+    bench_parse("parse malformed header", bad_header, 2);
+    corpus_lens = bin_lens;
+    bench_parse("parse valid binary", bin_valid, 3);
+    corpus_lens = NULL;
+    bench_moves("MOVE parse+decode text", "0|09|MOVE|3|2|", 14);
+    bench_moves("MOVE parse+decode binary", bin_move, sizeof(bin_move));
+    bench_recv("recv_fill+parse valid", valid, 3);
+    bench_names();
+    bench_send_small("send_wait/name/fail encode", false);
+    bench_send_small("send_wait/name/fail binary", true);
+    bench_send_play("send_play encode", STANDARD_PILES, false, false);
+    bench_send_play("send_play encode binary", STANDARD_PILES, false, true);
+    bench_send_play("send_play encode B4096", MAX_PILES, false, false);
+    bench_send_play("send_play binary B4096", MAX_PILES, false, true);
+    bench_send_play("send_play+flush", STANDARD_PILES, true, false);
+    bench_send_play("send_play+flush binary", STANDARD_PILES, true, true);
+    return 0;
+}
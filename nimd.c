@@ -5,309 +5,193 @@
 #include <string.h>  
 #include <sys/socket.h> 
 #include <netinet/in.h> 
+#include <netinet/tcp.h>
 #include <arpa/inet.h>   
-#include <sys/select.h>
-#include <sys/wait.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include <sys/resource.h>
 
 #include "message.h"
 #include "send.h"
 #include "handlers.h"
+#include "reactor.h"
+#include "config.h"
+#include "prefork.h"
+#include "bot.h"
+#include "journal.h"
+#include "match.h"
+#include "upgrade.h"
+#include "log.h"
+
+// the configured address, or the IPv6 wildcard taking IPv4 as well (the IPv4 one where
+// the kernel has no IPv6)
+static socklen_t listen_address(struct sockaddr_storage *addr){
+    memset(addr, 0, sizeof(*addr));
+    struct sockaddr_in *v4 = (struct sockaddr_in *)addr;
+    struct sockaddr_in6 *v6 = (struct sockaddr_in6 *)addr;
+    const char *bind_addr = config.bind_addr;
+    if (!bind_addr) {
+        int probe = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bind_addr = (probe >= 0) ? "::" : "0.0.0.0";
+        if (probe >= 0) close(probe);
+    }
 
-Player **active_players = NULL; // dynamic list of all players currently in an active game
-int total_active = 0;
-int active_cap = 0;
-
-// function prototypes
-void nimd_game(Player *p1, Player *p2);
-void create_game(Game *g, Player *p1, Player *p2);
-bool is_active(const char *name);
-void add_active(Player *p);
-void remove_active(Player *p);
-
-int main(int argc, char *argv[]) {
-    int sock_fd, port_number;
-    struct sockaddr_in addr;
-
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        exit(EXIT_FAILURE);
+    if (inet_pton(AF_INET6, bind_addr, &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(config.port);
+        return sizeof(*v6);
     }
-    port_number = atoi(argv[1]);
-    if (port_number <= 0) {
-        fprintf(stderr, "Invalid port number.\n");
-        exit(EXIT_FAILURE);
+    if (inet_pton(AF_INET, bind_addr, &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(config.port);
+        return sizeof(*v4);
     }
+    fprintf(stderr, "Bind address %s is not a numeric IPv4 or IPv6 address.\n", bind_addr);
+    exit(EXIT_FAILURE);
+}
+
+// client sockets inherit TCP_NODELAY and the buffer sizes from their listener, so
+// accepting one costs no extra setsockopt. Also applied to listeners taken over in an
+// upgrade, listen() on one that already listens just resizes its backlog
+static void tune_listener(int sock_fd){
+    if (setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &config.nodelay, sizeof(config.nodelay)) < 0) perror("TCP_NODELAY");
+    // the first wakeup for a connection is then its OPEN, not the handshake before it
+    if (setsockopt(sock_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config.defer_accept, sizeof(config.defer_accept)) < 0) perror("TCP_DEFER_ACCEPT");
+    if (config.rcvbuf > 0 && setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &config.rcvbuf, sizeof(config.rcvbuf)) < 0) perror("SO_RCVBUF");
+    if (config.sndbuf > 0 && setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &config.sndbuf, sizeof(config.sndbuf)) < 0) perror("SO_SNDBUF");
+    if (listen(sock_fd, config.backlog) < 0) { perror("listen"); exit(EXIT_FAILURE); }
+}
 
-    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+// one listener per shard, SO_REUSEPORT lets the kernel spread connections across them
+static int open_listener(const struct sockaddr_storage *addr, socklen_t addr_len){
+    int sock_fd = socket(addr->ss_family, SOCK_STREAM, 0);
     if (sock_fd < 0) { perror("socket"); exit(EXIT_FAILURE); }
+    fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK); // reactor drains accept() until EAGAIN
+    fcntl(sock_fd, F_SETFD, FD_CLOEXEC);
 
     int opt = 1;
     setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port_number);
-
-    if (bind(sock_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); exit(EXIT_FAILURE); }
-    if (listen(sock_fd, 5) < 0) { perror("listen"); exit(EXIT_FAILURE); }
-
-    printf("nimd server listening on port %d\n", port_number);
-
-    Player *queue_player = NULL;
-
-    while (1) {
-        while (waitpid(-1, NULL, WNOHANG) > 0) ; // reap zombies
-
-        // Check if queued player disconnected
-        if (queue_player) {
-            char tmp;
-            int r = recv(queue_player->fd, &tmp, 1, MSG_PEEK | MSG_DONTWAIT);
-            if (r == 0) {
-                close(queue_player->fd);
-                free(queue_player);
-                queue_player = NULL;
-            }
-        }
-
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_fd = accept(sock_fd, (struct sockaddr*)&client_addr, &client_len);
-        if (client_fd < 0) { perror("accept"); continue; }
-
-        printf("nimd server accepted connection from client\n");
-
-        Message *msg = read_message(client_fd);
-        if (!msg) {
-            handle_fail_fd(client_fd, 10, "Invalid");
-            close(client_fd);
-            continue;
-        }
-
-        if (strcmp(msg->type, "MOVE") == 0) {
-            handle_fail_fd(client_fd, 24, "Not Playing");
-            close(client_fd);
-            free_message(msg);
-            continue;
-        }
-
-        if (strcmp(msg->type, "OPEN") != 0) {
-            handle_fail_fd(client_fd, 10, "Invalid");
-            close(client_fd);
-            free_message(msg);
-            continue;
-        }
-
-        Player *player = malloc(sizeof(Player));
-        player->fd = client_fd;
-        player->open = false;
-        player->p_num = 0;
-
-        handle_open(player, msg);
-        free_message(msg);
-
-        if (!player->open) { // already handled fail
-            close(client_fd);
-            free(player);
-            continue;
-        }
-
-        if (!queue_player) {
-            queue_player = player;
-            send_wait(queue_player->fd);
-        } else {
-            char tmp;
-            int r = recv(queue_player->fd, &tmp, 1, MSG_PEEK | MSG_DONTWAIT);
-            if (r == 0) {
-                close(queue_player->fd);
-                free(queue_player);
-                queue_player = player;
-                send_wait(queue_player->fd);
-                continue;
-            }
-
-            // Match found
-            Player *p1 = queue_player;
-            Player *p2 = player;
-            queue_player = NULL;
-            add_active(p1);
-            add_active(p2);
-            printf("Two players have been matched\n");
-
-            pid_t pid = fork();
-            if (pid < 0) {
-                perror("fork");
-                // fail both players
-                handle_fail(p1, 50, "Server Error");
-                handle_fail(p2, 50, "Server Error");
-                close(p1->fd); close(p2->fd);
-                remove_active(p1); remove_active(p2);
-                free(p1); free(p2);
-                continue;
-            }
-
-            if (pid == 0) {
-                // Child process handles the game
-                close(sock_fd); // child does not accept new connections
-                nimd_game(p1, p2);
-                exit(0);
-            }
-        }
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) { perror("setsockopt"); exit(EXIT_FAILURE); }
+    if (addr->ss_family == AF_INET6) {
+        int v6only = 0;
+        setsockopt(sock_fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
     }
 
-    close(sock_fd);
-    return 0;
+    if (bind(sock_fd, (const struct sockaddr *)addr, addr_len) < 0) { perror("bind"); exit(EXIT_FAILURE); }
+    tune_listener(sock_fd);
+    return sock_fd;
 }
 
-void nimd_game(Player *p1, Player *p2) {
-    Game g;
-    create_game(&g, p1, p2);
-    p1->p_num = 1;
-    p2->p_num = 2;
-
-    send_name(p1->fd, 1, p2->name);
-    send_name(p2->fd, 2, p1->name);
-    send_play(&g);
-
-    int max_fd = (p1->fd > p2->fd) ? p1->fd : p2->fd;
-
-    while (1) {
-        // Player *current_p = (g.next_p == 1) ? p1 : p2;
-
-        // Message *msg = read_message(current_p->fd);
-        // if (!msg) {
-        //     Player *winner = (g.next_p == 1) ? p2 : p1;
-        //     send_over(&g, winner->p_num, "Forfeit");
-        //     break;
-        // }
-
-        // // if (strcmp(msg->type, "MOVE") != 0) {
-        // //     handle_fail(current_p, 31, "Expected MOVE");
-        // //     free_message(msg);
-        // //     continue;
-        // // }
-
-        // handle_move(&g, current_p, msg);
-        // free_message(msg);
-
-        // bool empty = true;
-        // for (int i = 0; i < 5; i++)
-        //     if (g.piles[i] > 0) { empty = false; break; }
-
-        // if (empty) break;
+// admin socket for stats snapshots, local only so it needs no authentication
+static int open_stats_listener(const char *path){
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) { fprintf(stderr, "Stats socket path too long.\n"); exit(EXIT_FAILURE); }
 
-        // extra credit
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        FD_SET(p1->fd, &read_fds);
-        FD_SET(p2->fd, &read_fds);
-
-        int r = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
-        if(r < 0){
-            perror("select");
-            break;
-        }
-
-        Player *players[2] = {p1, p2};
-        for(int i = 0; i < 2; i++){
-            Player *p = players[i];
-            if(!FD_ISSET(p->fd, &read_fds)) continue;
+    int sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock_fd < 0) { perror("socket"); exit(EXIT_FAILURE); }
 
-            char tmp;
-            int r = recv(p->fd, &tmp, 1, MSG_PEEK | MSG_DONTWAIT);
-            if (r == 0) {
-                Player *winner = (p == p1) ? p2 : p1;
-                send_over(&g, winner->p_num, "Forfeit");
-                remove_active(p1); remove_active(p2);
-                close(p1->fd); close(p2->fd);
-                free(p1); free(p2);
-                return;
-            }
-            
-            Message *msg = read_message(p->fd);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path); // left over from a previous run
 
-                // if(strcmp(msg->type, "OPEN") == 0){
-                //     handle_fail(p, 23, "Already Open");
-                //     free_message(msg);
-                //     continue
-                // }
+    if (bind(sock_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); exit(EXIT_FAILURE); }
+    if (listen(sock_fd, 16) < 0) { perror("listen"); exit(EXIT_FAILURE); }
+    return sock_fd;
+}
 
-            if (!msg) {
-                handle_fail(p, 10, "Invalid");
-                free_message(msg);
-                continue;
-            }
+// signals are handled synchronously by shard 0 through a signalfd, so they are blocked
+// here before any thread or game worker exists and every one of them inherits the mask
+static int setup_signals(void){
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD); // game worker died
+    sigaddset(&mask, SIGUSR1); // dump allocation counters
+    sigaddset(&mask, SIGQUIT); // drain: finish the running games, start no new ones, exit
+    sigaddset(&mask, SIGUSR2); // upgrade: hand everything over to a freshly started binary
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) { perror("sigprocmask"); exit(EXIT_FAILURE); }
+
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) { perror("signalfd"); exit(EXIT_FAILURE); }
+    return fd;
+}
 
-            if(strcmp(msg->type, "OPEN") == 0){
-                handle_open(p, msg);
-                continue;
-            }
+// clients may have every fd the hard limit allows less a reserve for the listeners,
+// eventfds, rings, journal and worker channels, so the connection cap is normally hit
+// well before accept() runs into EMFILE
+static void size_connection_cap(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) { perror("getrlimit"); exit(EXIT_FAILURE); }
+    if (rl.rlim_cur < rl.rlim_max && rl.rlim_max != RLIM_INFINITY) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0) getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (config.max_connections > 0) return;
 
-            if (p->p_num != g.next_p) {
-                handle_fail(p, 31, "Impatient");
-                free_message(msg);
-                continue;
-            }
+    long limit = (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > 1000000) ? 1000000 : (long)rl.rlim_cur;
+    long reserve = 32 + 4L * config.workers;
+    config.max_connections = (limit > 2 * reserve) ? (int)(limit - reserve) : (int)(limit / 2);
+}
 
-            handle_move(&g, p, msg);
-            free_message(msg);
+int main(int argc, char *argv[]) {
+    parse_config(argc, argv);
+    size_connection_cap();
+    upgrade_init(argv);
 
-            bool empty = true;
-            for (int i = 0; i < 5; i++)
-                if (g.piles[i] > 0) { empty = false; break; }
+    signal(SIGPIPE, SIG_IGN); // a peer vanishing mid-write must not take down every game
+    int signal_fd = setup_signals();
 
-            if (empty) break;
-        }
+    if (config.bot_wait > 0) {
+        bot_init();
     }
 
-    remove_active(p1); remove_active(p2);
-    close(p1->fd); close(p2->fd);
-    free(p1); free(p2);
-}
-
-void create_game(Game *g, Player *p1, Player *p2){
-    if(!g){
-        return;
+    if (config.journal_dir) {
+        journal_open(config.journal_dir);
     }
-    g->p1 = p1;
-    g->p2 = p2;
-    g->piles[0] = 1;
-    g->piles[1] = 3;
-    g->piles[2] = 5;
-    g->piles[3] = 7;
-    g->piles[4] = 9;
-    g->next_p = 1;
-}
 
-bool is_active(const char *name){
-    for(int i = 0; i < total_active; i++){
-        if(active_players[i] && strcmp(active_players[i]->name, name) == 0){
-            return true;
-        }
+    // workers are forked while the process is still single threaded and holds no sockets
+    if (config.game_procs > 0) {
+        prefork_start(config.game_procs);
     }
-    return false;
-}
 
-void add_active(Player *p){
-    if(total_active >= active_cap){
-        int new_cap = (active_cap == 0) ? 20 : active_cap * 2;
-        Player **new_list = realloc(active_players, new_cap * sizeof(Player*));
-        if(!new_list){
-            perror("realloc");
-            exit(EXIT_FAILURE);
+    int *listen_fds = counted_malloc(config.workers * sizeof(int));
+    if (!listen_fds) { perror("malloc"); exit(EXIT_FAILURE); }
+    int listeners = 0;
+    UpgradeItem *inherited = NULL;
+
+    // games a previous run lost in a crash wait for their players to reconnect. After an
+    // upgrade the previous process passes its own suspended games on instead, and the
+    // games it was playing continue here under their journal ids
+    if (upgrade_inherited()) {
+        listeners = upgrade_receive(listen_fds, config.workers, &inherited);
+    } else if (config.journal_dir) {
+        SuspendedGame *games = journal_recover(0);
+        int count = 0;
+        for (SuspendedGame *s = games; s; s = s->next) {
+            count++;
         }
-        active_players = new_list;
-        active_cap = new_cap;
+        match_suspend(games);
+        printf("nimd recovered %d unfinished game(s) from %s\n", count, config.journal_dir);
     }
-    active_players[total_active++] = p;
-}
 
-void remove_active(Player *p){
-    for(int i = 0; i < total_active; i++){
-        if(active_players[i] == p){
-            memmove(&active_players[i], &active_players[i + 1], (total_active - i - 1)*sizeof(Player*));
-            total_active--;
-            return;
-        }
+    struct sockaddr_storage addr;
+    socklen_t addr_len = listen_address(&addr);
+    for (int i = 0; i < config.workers; i++) {
+        if (i < listeners) tune_listener(listen_fds[i]); // the new binary's settings apply to them too
+        else listen_fds[i] = open_listener(&addr, addr_len);
     }
-}
\ No newline at end of file
+
+    char host[INET6_ADDRSTRLEN];
+    const void *ip = (addr.ss_family == AF_INET6) ? (const void *)&((struct sockaddr_in6 *)&addr)->sin6_addr
+                                                   : (const void *)&((struct sockaddr_in *)&addr)->sin_addr;
+    inet_ntop(addr.ss_family, ip, host, sizeof(host));
+    printf("nimd server listening on %s port %d with %d worker thread(s), up to %d connections\n", host, config.port, config.workers, config.max_connections);
+
+    int stats_fd = config.stats_path ? open_stats_listener(config.stats_path) : -1;
+
+    reactor_run(listen_fds, config.workers, signal_fd, stats_fd, inherited);
+    log_flush();
+    return 0;
+}
@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+
+#include "prefork.h"
+#include "handlers.h"
+#include "reactor.h"
+#include "log.h"
+#include "journal.h"
+#include "match.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define HANDOFF_TX_MAX 256 // a waiter's unsent WAIT travels with it
+#define REGISTRY_SHARED_CAP (256 * 1024)
+
+// everything a worker needs to rebuild a Player besides the fd itself
+typedef struct {
+    char name[73];
+    int board; // pile count of the queue the pair was matched in
+    bool binary; // protocol version its OPEN picked
+    int rx_len;
+    int tx_len;
+    char rx[RECV_BUF_SIZE]; // frames pipelined behind the OPEN
+    char tx[HANDOFF_TX_MAX];
+} HandoffPlayer;
+
+typedef struct {
+    int count; // 2 for a matched pair, 1 for a spectator of the game players[0].name is in
+    HandoffPlayer players[2];
+} HandoffMsg;
+
+typedef struct {
+    pid_t pid;
+    int channel_fd; // parent's end of the SOCK_SEQPACKET pair
+} Worker;
+
+static Worker *workers = NULL;
+static int worker_count = 0;
+static int next_worker = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool prefork_enabled(void){
+    return worker_count > 0;
+}
+
+static void spawn_worker(Worker *w){
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0){
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+
+    fflush(stdout); // or buffered lines would be printed by both processes
+    pid_t pid = fork();
+    if(pid < 0){
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+
+    if(pid == 0){
+        // keep only stdio and the channel, a respawned worker would otherwise hold
+        // listeners and every client socket the parent had open
+        if(dup2(sv[1], 3) < 0){
+            _exit(EXIT_FAILURE);
+        }
+        close_range(4, ~0U, 0);
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        log_forked();
+        journal_forked();
+        reactor_run_worker(3);
+        log_flush();
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(sv[1]);
+    w->pid = pid;
+    w->channel_fd = sv[0];
+}
+
+void prefork_start(int count){
+    registry_init_shared(REGISTRY_SHARED_CAP);
+
+    workers = counted_calloc(count, sizeof(Worker));
+    if(!workers){
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    worker_count = count;
+    for(int i = 0; i < count; i++){
+        spawn_worker(&workers[i]);
+    }
+    printf("nimd started %d game worker process(es)\n", count);
+}
+
+void prefork_reap(void){
+    // SIGCHLD coalesces, waitpid is what finds every dead child
+    pid_t pid;
+    while((pid = waitpid(-1, NULL, WNOHANG)) > 0){
+        registry_purge_owner(pid); // its games are gone, so are their names
+        match_suspend(journal_recover(pid)); // unless the journal can bring them back
+
+        pthread_mutex_lock(&pool_lock);
+        for(int i = 0; i < worker_count; i++){
+            if(workers[i].pid == pid){
+                log_text(LOG_WARN, "game worker %d exited, respawning", (int)pid);
+                close(workers[i].channel_fd);
+                spawn_worker(&workers[i]);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+static int pack_player(HandoffPlayer *hp, Player *p){
+    flush_player(p);
+    int pending = p->tx.end - p->tx.start;
+    if(pending > HANDOFF_TX_MAX){
+        return -1;
+    }
+
+    strcpy(hp->name, p->name);
+    hp->board = p->board;
+    hp->binary = p->binary;
+    hp->tx_len = pending;
+    if(pending > 0){
+        memcpy(hp->tx, p->tx.data + p->tx.start, pending);
+    }
+    hp->rx_len = p->rx.end - p->rx.start;
+    memcpy(hp->rx, p->rx.data + p->rx.start, hp->rx_len);
+    return 0;
+}
+
+// worker is the pool slot to use, NULL for the next one round robin. Returns the pid
+// of the worker the message went to, -1 if it could not be sent
+static pid_t send_handoff(HandoffMsg *msg, const int *fds, Worker *worker){
+    struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(msg->count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, msg->count * sizeof(int));
+    mh.msg_controllen = CMSG_SPACE(msg->count * sizeof(int));
+
+    pthread_mutex_lock(&pool_lock);
+    Worker *w = worker;
+    if(!w){
+        w = &workers[next_worker];
+        next_worker = (next_worker + 1) % worker_count;
+    }
+    ssize_t sent = sendmsg(w->channel_fd, &mh, MSG_NOSIGNAL);
+    pid_t pid = w->pid;
+    pthread_mutex_unlock(&pool_lock);
+
+    if(sent != (ssize_t)sizeof(*msg)){
+        perror("sendmsg");
+        return -1;
+    }
+    return pid;
+}
+
+int prefork_dispatch(Player *p1, Player *p2){
+    HandoffMsg msg;
+    memset(&msg, 0, sizeof(msg));
+    if(pack_player(&msg.players[0], p1) < 0 || pack_player(&msg.players[1], p2) < 0){
+        return -1;
+    }
+    msg.count = 2;
+    int fds[2] = { p1->fd, p2->fd };
+    pid_t pid = send_handoff(&msg, fds, NULL);
+    if(pid < 0){
+        return -1;
+    }
+
+    // the worker's game now owns both names
+    registry_transfer(p1->name, pid);
+    registry_transfer(p2->name, pid);
+    return 0;
+}
+
+int prefork_watch(Player *p, int pid){
+    HandoffMsg msg;
+    memset(&msg, 0, sizeof(msg));
+    if(pack_player(&msg.players[0], p) < 0){
+        return -1;
+    }
+    msg.count = 1;
+
+    Worker *w = NULL;
+    pthread_mutex_lock(&pool_lock);
+    for(int i = 0; i < worker_count; i++){
+        if(workers[i].pid == pid){
+            w = &workers[i];
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if(!w){ // died since the name was looked up
+        return -1;
+    }
+    return (send_handoff(&msg, &p->fd, w) < 0) ? -1 : 0;
+}
+
+static Player *unpack_player(const HandoffPlayer *hp, int fd){
+    Player *p = new_player();
+    if(!p){
+        return NULL;
+    }
+
+    p->fd = fd;
+    p->open = true;
+    strcpy(p->name, hp->name);
+    p->board = hp->board;
+    p->binary = hp->binary;
+    memcpy(p->rx.data, hp->rx, hp->rx_len);
+    p->rx.end = hp->rx_len;
+    if(hp->tx_len > 0){
+        queue_bytes(p, hp->tx, hp->tx_len); // what the shard could not deliver yet
+    }
+    return p;
+}
+
+int prefork_receive(int channel_fd, Player *out[2]){
+    HandoffMsg msg;
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    ssize_t n = recvmsg(channel_fd, &mh, MSG_CMSG_CLOEXEC);
+    if(n <= 0){
+        return (n < 0 && (errno == EAGAIN || errno == EINTR)) ? 0 : -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    if(n != (ssize_t)sizeof(msg) || (msg.count != 1 && msg.count != 2) || !cmsg ||
+       cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(msg.count * sizeof(int))){
+        fprintf(stderr, "malformed handoff from the acceptor\n");
+        return -1;
+    }
+
+    int fds[2];
+    memcpy(fds, CMSG_DATA(cmsg), msg.count * sizeof(int));
+    bool lost = false;
+    for(int i = 0; i < msg.count; i++){
+        out[i] = unpack_player(&msg.players[i], fds[i]);
+        lost |= !out[i];
+    }
+    if(msg.count == 1){ // a spectator, it has not opened and holds no name
+        out[1] = NULL;
+        if(out[0]){
+            out[0]->open = false;
+            out[0]->spectator = true;
+        }
+    }
+    if(lost){
+        for(int i = 0; i < msg.count; i++){
+            close(fds[i]);
+            if(out[i]){
+                delete_player(out[i]);
+            }
+        }
+        return 0; // pair lost, the channel itself is fine
+    }
+    for(int i = 0; i < msg.count; i++){
+        if(!out[i]->spectator){
+            registry_adopt(out[i]);
+        }
+    }
+    return msg.count;
+}
@@ -0,0 +1,30 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include <stdbool.h>
+
+struct Player;
+
+// optional pool of pre-forked game processes: the shards keep accepting and matching,
+// then pass each matched pair's sockets to a worker over a Unix socket (SCM_RIGHTS)
+bool prefork_enabled(void);
+
+// forks the pool before any listener or thread exists, SIGCHLD must already be blocked
+void prefork_start(int workers);
+
+// called on SIGCHLD: reaps dead workers, frees their names and respawns them
+void prefork_reap(void);
+
+// hands the pair to a worker, 0 on success. The caller still closes its copies of the fds
+int prefork_dispatch(struct Player *p1, struct Player *p2);
+
+// hands a spectator to the worker process pid, whose game the player named p->name
+// is in. 0 on success, the caller closes its copy of the fd
+int prefork_watch(struct Player *p, int pid);
+
+// worker side: reads one pair, or one spectator, off the channel into freshly allocated
+// players. Returns 2 with out filled, 1 with only out[0] (a spectator of out[0]->name),
+// 0 if nothing usable arrived and -1 if the channel is gone
+int prefork_receive(int channel_fd, struct Player *out[2]);
+
+#endif
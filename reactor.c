@@ -0,0 +1,1586 @@
+#define _GNU_SOURCE
+
+#include "reactor.h"
+#include "handlers.h"
+#include "prefork.h"
+#include "match.h"
+#include "bot.h"
+#include "config.h"
+#include "stats.h"
+#include "registry.h"
+#include "log.h"
+#include "journal.h"
+#include "admission.h"
+#include "upgrade.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <signal.h>
+
+#define MAX_EVENTS 256
+
+// epoll data for the non-player fds of a shard
+#define LISTEN_TAG ((void *)1)
+#define WAKE_TAG ((void *)2)
+#define SIGNAL_TAG ((void *)3)
+#define CHANNEL_TAG ((void *)4)
+#define STATS_TAG ((void *)5)
+#define UPGRADE_TAG ((void *)6)
+
+// io_uring user_data: the shard's own fds use their tag's value alone, player requests
+// put the op in bits 24-31 of the player's handle, which slot indexes never reach. 0
+// marks a completion that has already been dealt with
+enum { OP_RECV = 6, OP_SEND, OP_WRITABLE };
+#define OP_SHIFT 24
+#define OP_MASK ((uint64_t)0xff << OP_SHIFT)
+_Static_assert((uint64_t)SLAB_MAX_CHUNKS * SLAB_CHUNK_OBJS < (1ULL << OP_SHIFT), "slot index reaches the op bits");
+
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 1024 // provided recv buffers per shard, RECV_BUF_SIZE each
+
+#define STATS_SNAPSHOT_MAX (16 * 1024)
+#define LISTEN_PAUSE_MS 100 // a listener out of fds with no spare left waits this long
+
+static Reactor *shards = NULL;
+static int shard_count = 0;
+
+// held in reserve for accept() failing with EMFILE: giving it up makes room to take the
+// connection at the head of the backlog and refuse it, where leaving it there would
+// only have the listener reported readable again straight away
+static int spare_fd = -1;
+static pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// RUNNING until shard 0 reads SIGQUIT (drain) or SIGUSR2 (upgrade), every shard looks at
+// it once per batch
+enum { RUNNING, DRAINING, UPGRADING };
+static int run_state = RUNNING;
+static pthread_barrier_t upgrade_barrier; // the old process's shards stop and pass on together
+static pthread_barrier_t inherit_barrier; // the new process's shards adopt in two steps
+static bool inheriting = false;
+
+static void on_disconnect(Player *p);
+static void on_player_timer(Timer *t);
+static void on_bot_tick(Timer *t);
+static void on_listen_resume(Timer *t);
+static void adopt_client(Reactor *r, int client_fd);
+
+// waiters are checked a few times per bot_wait, so the bot shows up at most a
+// quarter late
+static void arm_bot_timer(Reactor *r){
+    timer_arm(&r->wheel, &r->bot_timer, config.bot_wait / 4, on_bot_tick);
+}
+
+// (re)starts the player's one timer, a limit of 0 means that deadline is off
+static void arm_player(Player *p, int ms){
+    if(ms > 0){
+        timer_arm(&p->owner->wheel, &p->timer, ms, on_player_timer);
+    }else{
+        timer_cancel(&p->owner->wheel, &p->timer);
+    }
+}
+
+// the wheel's clock, good enough for the token buckets and free to read
+static uint64_t wheel_ms(Reactor *r){
+    return r->wheel.now * TIMER_TICK_MS;
+}
+
+static bool is_tag(void *ptr){
+    return (uintptr_t)ptr <= (uintptr_t)UPGRADE_TAG;
+}
+
+static int op_of(uint64_t user_data){
+    return (user_data & OP_MASK) ? (int)((user_data & OP_MASK) >> OP_SHIFT) : (int)user_data;
+}
+
+static uint64_t player_op(Player *p, int op){
+    return p->self | ((uint64_t)op << OP_SHIFT);
+}
+
+static void arm_recv(Player *p){
+    uring_prep_recv_multishot(uring_sqe(p->owner->ring), p->fd, player_op(p, OP_RECV));
+    p->recv_armed = true;
+}
+
+// the listener gets a multishot accept, the other fds a multishot poll whose
+// completion runs the same handler epoll would
+static void arm_fd(Reactor *r, int fd, void *tag){
+    if(tag == LISTEN_TAG){
+        uring_prep_accept_multishot(uring_sqe(r->ring), fd, (uintptr_t)tag);
+    }else{
+        uring_prep_poll(uring_sqe(r->ring), fd, POLLIN, 1, (uintptr_t)tag);
+    }
+}
+
+static void watch_fd(Reactor *r, int fd, void *ptr){
+    if(r->ring){
+        if(is_tag(ptr)){
+            arm_fd(r, fd, ptr);
+        }else{
+            arm_recv(ptr);
+        }
+        return;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = ptr;
+    stats_count(STAT_SYSCALLS);
+    if(epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0){
+        perror("epoll_ctl");
+    }
+}
+
+// on io_uring the cancel is synchronous and whatever was already received for a player
+// is moved into its rx, so no completion for it can turn up once this returns and the
+// player may change hands right away
+static void unwatch_fd(Reactor *r, int fd, void *ptr){
+    Player *p = is_tag(ptr) ? NULL : ptr;
+    if(!r->ring){
+        stats_count(STAT_SYSCALLS);
+        epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        return;
+    }
+    if(p && !p->recv_armed && !p->want_write){
+        return; // nothing outstanding
+    }
+
+    stats_count(STAT_SYSCALLS);
+    if(uring_cancel_fd(r->ring, fd) < 0){
+        perror("io_uring cancel");
+    }
+    unsigned ready = uring_ready(r->ring);
+    for(unsigned i = 0; i < ready; i++){
+        struct io_uring_cqe *cqe = uring_cqe_at(r->ring, i);
+        bool mine = p ? (cqe->user_data & OP_MASK) && (cqe->user_data & ~OP_MASK) == p->self
+                      : cqe->user_data == (uintptr_t)ptr;
+        if(!mine || op_of(cqe->user_data) == OP_SEND){ // sends were accounted already
+            continue;
+        }
+        if(ptr == LISTEN_TAG && cqe->res >= 0){ // accepted already, it is not lost with the accept
+            adopt_client(r, cqe->res);
+        }
+        if(cqe->flags & IORING_CQE_F_BUFFER){
+            unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if(cqe->res > 0){
+                recv_append(&p->rx, uring_buffer(r->ring, bid), cqe->res); // past RECV_BUF_SIZE it is a flood anyway
+            }
+            uring_recycle(r->ring, bid);
+        }
+        cqe->user_data = 0;
+    }
+    if(p){
+        p->recv_armed = false;
+        p->want_write = false;
+    }
+}
+
+// only ask for writability while something is queued, otherwise it fires constantly
+static void set_want_write(Player *p, bool want_write){
+    if(p->want_write == want_write){
+        return;
+    }
+
+    stats_count(STAT_SYSCALLS);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = p;
+    if(epoll_ctl(p->owner->epoll_fd, EPOLL_CTL_MOD, p->fd, &ev) < 0){
+        perror("epoll_ctl");
+    }
+    p->want_write = want_write;
+}
+
+// close the connection and release everything the player owns, the struct itself
+// stays alive until the end of the batch since later events may still point at it
+static void drop_player(Player *p){
+    if(!p || p->closed){
+        return;
+    }
+
+    bool handoff_pending = match_leave(p); // an opening player is skipped by the batch
+    timer_cancel(&p->owner->wheel, &p->timer);
+    if(p->open){
+        remove_active(p);
+    }
+    flush_player(p); // last words (FAIL, OVER) go out before the close
+    if(p->watching){
+        unwatch_game(p);
+        p->owner->spectators--;
+    }
+    if(p->fd >= 0){ // the bot has no socket
+        unwatch_fd(p->owner, p->fd, p);
+        stats_count(STAT_SYSCALLS);
+        close(p->fd);
+        release_connection();
+    }
+    p->closed = true;
+
+    // a waiter already paired by another shard is freed when the handoff arrives
+    if(!handoff_pending){
+        p->next = p->owner->closed_players;
+        p->owner->closed_players = p;
+    }
+}
+
+static void free_closed_players(Reactor *r){
+    while(r->closed_players){
+        Player *next = r->closed_players->next;
+        delete_player(r->closed_players);
+        r->closed_players = next;
+    }
+}
+
+static void end_game(Game *g){
+    stats_count(STAT_GAMES_FINISHED);
+    g->p1->owner->games--;
+    drop_player(g->p1);
+    drop_player(g->p2);
+    while(g->watchers){ // whatever of the OVER fits in their sockets is the last they get
+        drop_player(g->watchers);
+    }
+    delete_game(g);
+}
+
+// the players now live in a game worker: forget them here without releasing their names
+static void release_player(Player *p){
+    p->open = false;
+    p->tx.start = 0;
+    p->tx.end = 0;
+    drop_player(p);
+}
+
+// the clock runs only for whoever is to move, the bot answers at once and needs none
+static void start_clock(Game *g){
+    Player *mover = (g->board.next_p == 1) ? g->p1 : g->p2;
+    Player *other = (mover == g->p1) ? g->p2 : g->p1;
+    timer_cancel(&other->owner->wheel, &other->timer);
+    arm_player(mover, mover->bot ? 0 : config.turn_timeout);
+}
+
+// a recovered game (resume) picks up from its last journaled move under its old id
+static void begin_game(Player *p1, Player *p2, const SuspendedGame *resume){
+    Game *g = new_game();
+    if(!g || !create_game(g, p1, p2)){
+        fprintf(stderr, "game pool exhausted\n");
+        if(g){
+            delete_game(g);
+        }
+        handle_fail(p1, 50, "Server Error");
+        handle_fail(p2, 50, "Server Error");
+        drop_player(p1);
+        drop_player(p2);
+        return;
+    }
+
+    p1->p_num = 1;
+    p2->p_num = 2;
+    p1->game = g;
+    p2->game = g;
+    p1->owner->games++;
+    stats_count(STAT_GAMES_STARTED);
+    if(resume){
+        board_restore(&g->board, resume->piles, resume->next_p);
+        g->journal_id = resume->id;
+    }else{
+        g->journal_id = journal_game_id();
+        journal_match(g);
+    }
+
+    // NAME and PLAY leave in the same send() per player once the event is done
+    send_name(p1, 1, p2->name);
+    send_name(p2, 2, p1->name);
+    send_play(g);
+    start_clock(g);
+}
+
+// both seats of a game lost in a crash are back. Its state is in this process, so it
+// is played here even when games normally go to a worker
+static void resume_game(Player *a, Player *b){
+    SuspendedGame *s = a->resume;
+    a->resume = NULL;
+    b->resume = NULL;
+    match_resume_done(s);
+
+    Player *p1 = (strcmp(a->name, s->names[0]) == 0) ? a : b;
+    Player *p2 = (p1 == a) ? b : a;
+    p1->board = s->pile_count;
+    stats_count(STAT_GAMES_RESUMED);
+    begin_game(p1, p2, s);
+    journal_free_suspended(s);
+}
+
+static void start_game(Player *p1, Player *p2){
+    log_matched();
+    if(p1->resume){
+        resume_game(p1, p2);
+        return;
+    }
+    if(!prefork_enabled()){
+        begin_game(p1, p2, NULL);
+        return;
+    }
+
+    if(p1->owner->ring){ // bytes already received must be in rx before it is packed
+        unwatch_fd(p1->owner, p1->fd, p1);
+        unwatch_fd(p2->owner, p2->fd, p2);
+    }
+    if(prefork_dispatch(p1, p2) < 0){
+        handle_fail(p1, 50, "Server Error");
+        handle_fail(p2, 50, "Server Error");
+        drop_player(p1);
+        drop_player(p2);
+        return;
+    }
+    release_player(p1);
+    release_player(p2);
+}
+
+// a game needs both players on one shard, so p moves to the shard owning its waiter.
+// It is only parked here: events for p may still sit in this batch, so the other shard
+// gets it from deliver_handoffs once the batch is over
+static void hand_over(Player *p, Player *waiter){
+    Reactor *from = p->owner;
+
+    unwatch_fd(from, p->fd, p);
+    timer_cancel(&from->wheel, &p->timer); // the wheel is this thread's, the new owner re-arms
+    p->want_write = false;
+    p->match = waiter->self;
+    p->next = from->outbox;
+    from->outbox = p;
+}
+
+static void deliver_handoffs(Reactor *r){
+    while(r->outbox){
+        Player *p = r->outbox;
+        r->outbox = p->next;
+        // a waiter is kept alive by handoff_pending, a spectator's game may have ended in
+        // the meantime and it learns so back home
+        Player *target = lookup_player(p->match);
+        Reactor *to = (target && target->owner) ? target->owner : r;
+
+        pthread_mutex_lock(&to->inbox_lock);
+        p->next = to->inbox;
+        to->inbox = p;
+        pthread_mutex_unlock(&to->inbox_lock);
+
+        uint64_t one = 1;
+        stats_count(STAT_SYSCALLS);
+        if(write(to->wake_fd, &one, sizeof(one)) < 0){
+            perror("write");
+        }
+    }
+}
+
+static void flush_or_drop(Player *p);
+static void handle_frames(Player *p);
+
+// OPENs are collected during the batch and paired together once it is done, so a burst
+// of them costs one pass over the queues instead of one lock round trip each
+static void pair_pending(Reactor *r){
+    while(r->pending){
+        Player *batch = match_batch(&r->pending);
+        while(batch){
+            Player *p = batch;
+            batch = p->pending_next;
+            p->pending_next = NULL;
+            Player *waiter = p->partner;
+            p->partner = NULL;
+
+            if(p->refused){ // would have been one waiter too many
+                handle_fail(p, 51, "Server Busy");
+                drop_player(p);
+            }else if(!waiter){ // queued and sent WAIT, frames behind the OPEN can go now
+                handle_frames(p);
+            }else if(waiter->owner != r){
+                hand_over(p, waiter);
+            }else if(waiter->closed){ // dropped over a frame pipelined behind its own OPEN
+                match_defer(&r->pending, p);
+            }else{
+                start_game(waiter, p);
+                flush_or_drop(waiter);
+                handle_frames(p);
+            }
+        }
+    }
+}
+
+// a spectator joins the game target is playing, which has to be on the spectator's shard
+static void attach_spectator(Player *p, Player *target){
+    Game *g = (target && !target->closed && target->owner == p->owner) ? target->game : NULL;
+    if(!g){
+        handle_fail(p, 25, "Not Found");
+        drop_player(p);
+        return;
+    }
+    if(!watch_game(p, g)){
+        handle_fail(p, 50, "Server Error");
+        drop_player(p);
+        return;
+    }
+    p->owner->spectators++;
+    flush_or_drop(p);
+}
+
+// WATCH instead of OPEN: the connection becomes a spectator of the game the named
+// player is in. Games live on one shard, or in a game worker, so it may have to move
+// there first
+static void on_watch(Player *p, Message *msg){
+    if(msg->field_num != 1){
+        handle_fail(p, 10, "Invalid");
+        drop_player(p);
+        return;
+    }
+
+    p->spectator = true;
+    timer_cancel(&p->owner->wheel, &p->timer);
+    int pid;
+    Player *target = lookup_player(registry_find(msg->fields[0], &pid));
+    if(pid && pid != getpid() && prefork_enabled()){
+        if(p->owner->ring){ // bytes already received must be in rx before it is packed
+            unwatch_fd(p->owner, p->fd, p);
+        }
+        strcpy(p->name, msg->fields[0]); // registered, so it fits
+        if(prefork_watch(p, pid) < 0){
+            handle_fail(p, 50, "Server Error");
+            drop_player(p);
+            return;
+        }
+        p->tx.start = 0;
+        p->tx.end = 0;
+        drop_player(p); // the worker has its own copy of the socket
+        return;
+    }
+
+    Reactor *owner = target ? target->owner : NULL;
+    if(owner && owner != p->owner){
+        hand_over(p, target);
+        return;
+    }
+    attach_spectator(p, target);
+}
+
+// players handed over by other shards, each to be paired with a waiter owned here
+static void drain_inbox(Reactor *r){
+    uint64_t count;
+    stats_count(STAT_SYSCALLS);
+    if(read(r->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN){
+        perror("read");
+    }
+
+    pthread_mutex_lock(&r->inbox_lock);
+    Player *list = r->inbox;
+    r->inbox = NULL;
+    pthread_mutex_unlock(&r->inbox_lock);
+
+    while(list){
+        Player *p = list;
+        list = p->next;
+        Player *waiter = lookup_player(p->match);
+        p->match = NULL_HANDLE;
+        p->next = NULL;
+        p->owner = r;
+        watch_fd(r, p->fd, p);
+        if(p->spectator){
+            attach_spectator(p, waiter);
+            continue;
+        }
+        arm_player(p, config.idle_timeout);
+
+        if(waiter){
+            match_handoff_done(waiter);
+        }
+
+        if(!waiter || waiter->closed){ // waiter left while p was in flight, p goes back to the queue
+            if(waiter){
+                delete_player(waiter);
+            }
+            match_defer(&r->pending, p);
+            continue;
+        }
+        start_game(waiter, p);
+        handle_frames(p); // frames pipelined behind the OPEN are still in p->rx
+    }
+}
+
+// game worker side: matched pairs arriving from the acceptor process
+static void drain_channel(Reactor *r){
+    while(1){
+        Player *pair[2];
+        int got = prefork_receive(r->channel_fd, pair);
+        if(got == 0){
+            return;
+        }
+        if(got < 0){ // acceptor is gone, finish the games already running then exit
+            unwatch_fd(r, r->channel_fd, CHANNEL_TAG);
+            close(r->channel_fd);
+            r->channel_fd = -1;
+            return;
+        }
+
+        for(int i = 0; i < got; i++){
+            adopt_connection(); // admitted by the acceptor, held here from now on
+        }
+        if(got == 1){ // a spectator of one of the games here
+            Player *p = pair[0];
+            p->owner = r;
+            watch_fd(r, p->fd, p);
+            int pid;
+            attach_spectator(p, lookup_player(registry_find(p->name, &pid)));
+            handle_frames(p);
+            continue;
+        }
+
+        for(int i = 0; i < 2; i++){
+            pair[i]->owner = r;
+            watch_fd(r, pair[i]->fd, pair[i]);
+        }
+        begin_game(pair[0], pair[1], NULL);
+        handle_frames(pair[0]);
+        handle_frames(pair[1]);
+    }
+}
+
+// first frame on a connection must be OPEN
+static void on_handshake(Player *p, Message *msg){
+    if(!msg){
+        handle_fail(p, 10, "Invalid");
+        drop_player(p);
+        return;
+    }
+
+    if(strcmp(msg->type, "MOVE") == 0){
+        handle_fail(p, 24, "Not Playing");
+        drop_player(p);
+        return;
+    }
+
+    if(strcmp(msg->type, "WATCH") == 0){
+        on_watch(p, msg);
+        return;
+    }
+
+    if(strcmp(msg->type, "OPEN") != 0){
+        handle_fail(p, 10, "Invalid");
+        drop_player(p);
+        return;
+    }
+
+    if(__atomic_load_n(&run_state, __ATOMIC_RELAXED) == DRAINING){ // no new games, only the running ones finish
+        handle_fail(p, 51, "Server Busy");
+        drop_player(p);
+        return;
+    }
+
+    handle_open(p, msg);
+    if(!p->open){ // already handled fail
+        drop_player(p);
+        return;
+    }
+    stats_record(HIST_ACCEPT_OPEN, stats_now() - p->accepted_at);
+    arm_player(p, config.idle_timeout);
+
+    match_defer(&p->owner->pending, p);
+}
+
+// player has opened but has no opponent yet
+static void on_waiting(Player *p, Message *msg){
+    if(msg && strcmp(msg->type, "MOVE") == 0){
+        handle_fail(p, 24, "Not Playing");
+        return;
+    }
+
+    if(msg && strcmp(msg->type, "OPEN") == 0){
+        handle_open(p, msg); // sends Already Open
+    }else{
+        handle_fail(p, 10, "Invalid");
+    }
+    drop_player(p);
+}
+
+static void on_game(Player *p, Message *msg){
+    Game *g = p->game;
+
+    if(!msg){
+        handle_fail(p, 10, "Invalid");
+        return;
+    }
+
+    if(strcmp(msg->type, "OPEN") == 0){
+        handle_open(p, msg); // sends Already Open, opponent wins by forfeit
+        Player *winner = (p == g->p1) ? g->p2 : g->p1;
+        send_over(g, winner->p_num, "Forfeit");
+        stats_count(STAT_FORFEITS);
+        end_game(g);
+        return;
+    }
+
+    if(p->p_num != g->board.next_p){
+        handle_fail(p, 31, "Impatient");
+        return;
+    }
+
+    stats_count(STAT_MOVES);
+    uint64_t start = stats_now();
+    long stones = g->board.stones_left;
+    handle_move(g, p, msg);
+
+    Player *opponent = (p == g->p1) ? g->p2 : g->p1;
+    if(opponent->bot && g->board.next_p == opponent->p_num){
+        bot_move(g, opponent); // answers in the same event, both PLAYs leave in one send()
+    }
+    stats_record(HIST_MOVE_DISPATCH, stats_now() - start);
+
+    if(board_over(&g->board)){
+        end_game(g);
+    }else if(g->board.stones_left != stones){ // a rejected move leaves the clock running
+        start_clock(g);
+    }
+}
+
+static void on_disconnect(Player *p){
+    Game *g = p->game;
+    if(!g){
+        drop_player(p);
+        return;
+    }
+
+    Player *winner = (p == g->p1) ? g->p2 : g->p1;
+    send_over(g, winner->p_num, "Forfeit");
+    stats_count(STAT_FORFEITS);
+    end_game(g);
+}
+
+// dispatch one parsed frame according to where the player is in the session,
+// a NULL msg means the frame was well delimited but its contents were malformed
+static void on_message(Player *p, Message *msg){
+    if(p->spectator){ // has nothing to say once it is watching
+        handle_fail(p, 10, "Invalid");
+        drop_player(p);
+    }else if(!p->open){
+        on_handshake(p, msg);
+    }else if(!p->game){
+        on_waiting(p, msg);
+    }else{
+        on_game(p, msg);
+    }
+}
+
+// push out what the player has queued, a client that stopped reading until its queue
+// hit the high-water mark is dropped (forfeiting its game) so it cannot hold anyone up
+static void flush_or_drop(Player *p){
+    if(!p || p->closed || p->match){
+        return;
+    }
+
+    Reactor *owner = p->owner;
+    if(owner->ring && !p->bot && !p->spectator){ // sent by submit_sends once the batch is done
+        if(p->tx.broken){
+            on_disconnect(p);
+        }else if(p->tx.start < p->tx.end && !p->dirty){
+            p->dirty = true;
+            p->dirty_next = owner->dirty;
+            owner->dirty = p;
+        }
+        return;
+    }
+
+    int r = 0;
+    if(p->tx.start < p->tx.end || p->tx.broken || p->watch_queue){
+        uint64_t start = stats_now();
+        r = flush_player(p);
+        stats_record(HIST_WRITE, stats_now() - start);
+    }
+    if(r < 0){
+        on_disconnect(p);
+        return;
+    }
+    if(!p->spectator){ // never waited for, what is left goes with its next frame
+        set_want_write(p, r == 1);
+    }
+}
+
+// every complete frame in the buffer is handled in order, then everything this
+// produced goes out in one send() per socket
+static void handle_frames(Player *p){
+    Message msg;
+    while(!p->closed && !p->match && !p->opening){
+        uint64_t start = stats_now();
+        int r = next_message(&p->rx, &msg);
+        if(r == 0){
+            break;
+        }
+        stats_record(HIST_PARSE, stats_now() - start);
+        stats_count(STAT_FRAMES);
+        if(r == 1 && !p->open){
+            p->binary = msg.version == BIN_VERSION; // replies follow the OPEN's version
+        }else if(r == 1 && (msg.version == BIN_VERSION) != p->binary){
+            r = -2; // a connection does not switch protocols
+        }
+        // every frame costs a token, the ones that are refused too: a flood of bad MOVEs
+        // would otherwise buy a FAIL written back for each
+        if(!bucket_take(&p->frames, config.frame_rate, config.frame_burst, wheel_ms(p->owner))){
+            stats_count(STAT_RATE_LIMITED);
+            handle_fail(p, 52, "Rate Limited");
+            // what it sent past the budget is thrown away unread, a close with it still
+            // queued would reset the connection and the FAIL would be lost with it
+            stats_count(STAT_SYSCALLS);
+            recv(p->fd, NULL, 1 << 20, MSG_DONTWAIT | MSG_TRUNC);
+            on_disconnect(p);
+            break;
+        }
+        if(r == -1){ // bad header, there is no way to find the next frame
+            handle_fail(p, 10, "Invalid");
+            on_disconnect(p);
+            break;
+        }
+        on_message(p, (r == 1) ? &msg : NULL);
+    }
+
+    if(!p->closed){
+        Game *g = p->game;
+        flush_or_drop(p);
+        if(g && !p->closed){
+            flush_or_drop((g->p1 == p) ? g->p2 : g->p1);
+        }
+    }
+}
+
+// one recv() pulls whatever the kernel has, so a dribbled OPEN never blocks and
+// pipelined MOVEs all get processed
+static void on_readable(Player *p){
+    stats_count(STAT_SYSCALLS);
+    int n = recv_fill(&p->rx, p->fd);
+    if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+        on_disconnect(p);
+        return;
+    }
+    handle_frames(p);
+}
+
+// io_uring backend: one completion's worth of bytes from a provided buffer, handled
+// like a recv() of them. A client that fills rx without completing a frame is dropped,
+// as it is by recv_fill
+static void on_received(Player *p, const char *data, int len){
+    while(len > 0 && !p->closed){
+        int n = recv_append(&p->rx, data, len);
+        if(n == 0){
+            on_disconnect(p);
+            return;
+        }
+        data += n;
+        len -= n;
+        handle_frames(p);
+    }
+}
+
+// turned away before it has a Player: one text FAIL straight into the new socket's
+// empty buffer and closed, the client has not said which protocol it speaks yet
+static void refuse_client(int client_fd, int code, const char *msg){
+    char body[48];
+    char frame[56];
+    int body_len = snprintf(body, sizeof(body), "FAIL|%02d %s|", code, msg);
+    int len = snprintf(frame, sizeof(frame), "0|%02d|%s", body_len, body);
+    stats_count(STAT_SYSCALLS);
+    send(client_fd, frame, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client_fd);
+    stats_count(STAT_REFUSED);
+    stats_fail(code);
+}
+
+static void adopt_client(Reactor *r, int client_fd){
+    log_accepted();
+    stats_count(STAT_CONNECTIONS);
+
+    if(config.addr_rate > 0){
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        if(getpeername(client_fd, (struct sockaddr *)&addr, &addr_len) == 0 &&
+           !admit_address((struct sockaddr *)&addr, wheel_ms(r))){
+            refuse_client(client_fd, 52, "Rate Limited");
+            return;
+        }
+    }
+    if(!admit_connection()){
+        refuse_client(client_fd, 51, "Server Busy");
+        return;
+    }
+
+    Player *player = new_player();
+    if(!player){
+        fprintf(stderr, "player pool exhausted\n");
+        release_connection();
+        refuse_client(client_fd, 51, "Server Busy");
+        return;
+    }
+    player->fd = client_fd;
+    player->open = false;
+    player->p_num = 0;
+    player->game = NULL;
+    player->closed = false;
+    player->rx.start = 0;
+    player->rx.end = 0;
+    player->want_write = false;
+    player->owner = r;
+    player->accepted_at = stats_now();
+    arm_player(player, config.handshake_timeout);
+
+    watch_fd(r, client_fd, player);
+}
+
+// out of fds with nothing to shed: the listener sits out a while instead of failing
+// every accept in a loop, the closes meanwhile make room again
+static void pause_listener(Reactor *r){
+    if(timer_armed(&r->listen_timer)){
+        return;
+    }
+    log_text(LOG_WARN, "Out of file descriptors, shard %d stops accepting for %d ms", r->id, LISTEN_PAUSE_MS);
+    unwatch_fd(r, r->listen_fd, LISTEN_TAG);
+    timer_arm(&r->wheel, &r->listen_timer, LISTEN_PAUSE_MS, on_listen_resume);
+}
+
+// out of fds: the spare is traded for the connection at the head of the backlog, which
+// is refused. Returns whether a connection was shed, accept() reports EMFILE before it
+// looks at the backlog so there may have been none. Without a spare to trade the
+// listener is paused
+static bool shed_client(Reactor *r){
+    pthread_mutex_lock(&spare_lock);
+    if(spare_fd < 0){ // given up earlier and not yet back, there may be room for it now
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    bool traded = spare_fd >= 0;
+    int client_fd = -1;
+    if(traded){
+        close(spare_fd);
+        stats_count(STAT_SYSCALLS);
+        client_fd = accept4(r->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(client_fd >= 0){
+            refuse_client(client_fd, 51, "Server Busy");
+        }
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    pthread_mutex_unlock(&spare_lock);
+
+    if(!traded){
+        pause_listener(r);
+    }
+    return client_fd >= 0;
+}
+
+static void on_listen_resume(Timer *t){
+    Reactor *r = container_of(t, Reactor, listen_timer);
+    watch_fd(r, r->listen_fd, LISTEN_TAG);
+}
+
+static void accept_clients(Reactor *r){
+    while(!timer_armed(&r->listen_timer)){
+        stats_count(STAT_SYSCALLS);
+        int client_fd = accept4(r->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(client_fd < 0){
+            if(errno == EMFILE || errno == ENFILE){
+                if(shed_client(r)){
+                    continue;
+                }
+            }else if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                perror("accept");
+            }
+            return;
+        }
+        adopt_client(r, client_fd);
+    }
+}
+
+// whichever deadline the player is under has passed: a connection that never sent
+// OPEN or waited too long is closed, a player out of time forfeits its game
+static void on_player_timer(Timer *t){
+    Player *p = container_of(t, Player, timer);
+    if(p->closed || p->match){
+        return;
+    }
+    stats_count(STAT_TIMEOUTS);
+
+    Game *g = p->game;
+    if(!p->open){
+        log_text(LOG_INFO, "Closing a connection that sent no OPEN within %d ms", config.handshake_timeout);
+        drop_player(p);
+    }else if(!g){
+        log_text(LOG_INFO, "Player %s waited %d ms without an opponent, disconnecting", p->name, config.idle_timeout);
+        drop_player(p);
+    }else if(g->board.next_p == p->p_num){
+        log_text(LOG_INFO, "Player %s ran out of time", p->name);
+        Player *winner = (p == g->p1) ? g->p2 : g->p1;
+        send_over(g, winner->p_num, "Forfeit");
+        stats_count(STAT_FORFEITS);
+        end_game(g);
+    }
+}
+
+// waiters of this shard that nobody has matched within config.bot_wait get the bot,
+// which always plays second. Bot games stay in this thread even with game workers
+static void on_bot_tick(Timer *t){
+    Reactor *r = container_of(t, Reactor, bot_timer);
+    arm_bot_timer(r);
+
+    Player *expired = match_expired(r, config.bot_wait);
+    while(expired){
+        Player *p = expired;
+        expired = p->pending_next;
+        p->pending_next = NULL;
+
+        Player *bot = bot_new();
+        if(!bot){
+            match_defer(&r->pending, p); // back in the queue, the next tick tries again
+            continue;
+        }
+        bot->owner = r;
+        log_text(LOG_INFO, "Player %s matched with the bot", p->name);
+        stats_count(STAT_BOT_GAMES);
+        begin_game(p, bot, NULL);
+        flush_or_drop(p);
+    }
+}
+
+// every admin connection gets one snapshot and is closed, the gauges come from here
+// and the counters from the per-thread blocks
+static void on_stats(Reactor *r){
+    static char snapshot[STATS_SNAPSHOT_MAX];
+    while(1){
+        int fd = accept4(r->stats_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0){
+            return;
+        }
+
+        int games = 0;
+        int spectators = 0;
+        for(int i = 0; i < shard_count; i++){
+            games += __atomic_load_n(&shards[i].games, __ATOMIC_RELAXED);
+            spectators += __atomic_load_n(&shards[i].spectators, __ATOMIC_RELAXED);
+        }
+        int waiting = 0;
+        int queues = match_queue_count();
+        for(int i = 0; i < queues; i++){
+            waiting += match_waiting(i);
+        }
+
+        int len = snprintf(snapshot, sizeof(snapshot), "shards %d\nopen_connections %d\nactive_games %d\nwaiting %d\nactive_names %d\nsuspended_games %d\nspectators %d\n",
+                           shard_count, open_connections(), games, waiting, active_count(), match_suspended(), spectators);
+        len += stats_snapshot(snapshot + len, sizeof(snapshot) - len);
+        // a fresh socket buffer holds the whole snapshot, a reader too slow for that loses it
+        if(send(fd, snapshot, len, MSG_NOSIGNAL) < 0){
+            perror("send");
+        }
+        close(fd);
+    }
+}
+
+// every shard notices a new run_state at the end of the batch this starts
+static void wake_shards(void){
+    uint64_t one = 1;
+    for(int i = 0; i < shard_count; i++){
+        stats_count(STAT_SYSCALLS);
+        if(write(shards[i].wake_fd, &one, sizeof(one)) < 0){
+            perror("write");
+        }
+    }
+}
+
+static void begin_drain(void){
+    if(run_state != RUNNING){
+        return;
+    }
+    log_text(LOG_WARN, "Draining: no new games, exiting once the running ones are over");
+    __atomic_store_n(&run_state, DRAINING, __ATOMIC_RELEASE);
+    wake_shards();
+}
+
+static void stop_upgrade_wait(Reactor *r){
+    unwatch_fd(r, r->upgrade_fd, UPGRADE_TAG);
+    timer_cancel(&r->wheel, &r->upgrade_timer);
+    r->upgrade_fd = -1;
+}
+
+static void on_upgrade_timeout(Timer *t){
+    Reactor *r = container_of(t, Reactor, upgrade_timer);
+    stop_upgrade_wait(r);
+    upgrade_abandon();
+}
+
+// the new process starts up while shard 0 keeps serving, on_upgrade_ready hears from it
+static void begin_upgrade(Reactor *r){
+    if(run_state != RUNNING || r->upgrade_fd >= 0){
+        return;
+    }
+    r->upgrade_fd = upgrade_spawn();
+    if(r->upgrade_fd < 0){
+        return;
+    }
+    watch_fd(r, r->upgrade_fd, UPGRADE_TAG);
+    timer_arm(&r->wheel, &r->upgrade_timer, UPGRADE_READY_MS, on_upgrade_timeout);
+}
+
+static void on_upgrade_ready(Reactor *r){
+    stop_upgrade_wait(r);
+    if(run_state != RUNNING){ // drained meanwhile
+        upgrade_abandon();
+        return;
+    }
+    if(!upgrade_ready()){
+        return;
+    }
+    pthread_barrier_init(&upgrade_barrier, NULL, shard_count);
+    __atomic_store_n(&run_state, UPGRADING, __ATOMIC_RELEASE);
+    wake_shards();
+}
+
+// signals are blocked in every thread and read from a signalfd on shard 0
+static void on_signal(Reactor *r){
+    struct signalfd_siginfo info;
+    while(read(r->signal_fd, &info, sizeof(info)) == sizeof(info)){
+        if(info.ssi_signo == SIGCHLD && prefork_enabled()){
+            prefork_reap();
+        }else if(info.ssi_signo == SIGUSR1){
+            report_allocations(stdout);
+        }else if(info.ssi_signo == SIGQUIT){
+            begin_drain();
+        }else if(info.ssi_signo == SIGUSR2){
+            begin_upgrade(r);
+        }
+    }
+}
+
+// readiness of one of the shard's own fds, the same on either backend
+static void on_shard_fd(Reactor *r, void *tag){
+    if(tag == LISTEN_TAG){
+        accept_clients(r);
+    }else if(tag == WAKE_TAG){
+        drain_inbox(r);
+    }else if(tag == SIGNAL_TAG){
+        on_signal(r);
+    }else if(tag == CHANNEL_TAG){
+        drain_channel(r);
+    }else if(tag == STATS_TAG){
+        on_stats(r);
+    }else if(tag == UPGRADE_TAG){
+        on_upgrade_ready(r);
+    }
+}
+
+// one epoll_wait and every event it returned, -1 if the loop cannot go on
+static int epoll_batch(Reactor *r, int wait_ms){
+    struct epoll_event events[MAX_EVENTS];
+    stats_count(STAT_SYSCALLS);
+    int n = epoll_wait(r->epoll_fd, events, MAX_EVENTS, wait_ms);
+    if(n < 0){
+        if(errno == EINTR) return 0;
+        perror("epoll_wait");
+        return -1;
+    }
+    // before the events, so timers they arm count from now and not from the last batch
+    timer_advance(&r->wheel, stats_now() / 1000000);
+
+    for(int i = 0; i < n; i++){
+        void *tag = events[i].data.ptr;
+        if(is_tag(tag)){
+            on_shard_fd(r, tag);
+            continue;
+        }
+
+        Player *p = tag;
+        if(p->match){ // parked for another shard, it owns p from now on
+            continue;
+        }
+        if(!p->closed && (events[i].events & EPOLLOUT)){
+            flush_or_drop(p);
+        }
+        if(!p->closed && !p->match && (events[i].events & ~EPOLLOUT)){
+            on_readable(p);
+        }
+    }
+    return 0;
+}
+
+// io_uring backend: one SEND per player with bytes queued, they go out with the
+// io_uring_enter that waits for the next batch
+static void submit_sends(Reactor *r){
+    while(r->dirty){
+        Player *p = r->dirty;
+        r->dirty = p->dirty_next;
+        p->dirty_next = NULL;
+        p->dirty = false;
+        if(p->closed || p->match || p->want_write || p->tx.start == p->tx.end){
+            continue;
+        }
+        uring_prep_send(uring_sqe(r->ring), p->fd, p->tx.data + p->tx.start, p->tx.end - p->tx.start,
+                        player_op(p, OP_SEND));
+        r->sends_inflight++;
+    }
+}
+
+// send completions are accounted before any handler runs, so no handler ever sees a
+// SendBuffer that still holds bytes the kernel has already taken. A failed send is
+// left for on_completion, which drops the player
+static void account_sends(Reactor *r){
+    unsigned ready = uring_ready(r->ring);
+    for(unsigned i = 0; i < ready; i++){
+        struct io_uring_cqe *cqe = uring_cqe_at(r->ring, i);
+        if(!cqe->user_data || op_of(cqe->user_data) != OP_SEND){
+            continue;
+        }
+        r->sends_inflight--;
+        Player *p = lookup_player(cqe->user_data & ~OP_MASK);
+        if(p && !p->closed && cqe->res < 0 && cqe->res != -EAGAIN){
+            p->tx.broken = true;
+            continue;
+        }
+        if(p && !p->closed && cqe->res == -EAGAIN){ // socket full, wait for room like EPOLLOUT
+            uring_prep_poll(uring_sqe(r->ring), p->fd, POLLOUT, 0, player_op(p, OP_WRITABLE));
+            p->want_write = true;
+        }else if(p && !p->closed){
+            p->tx.start += cqe->res;
+            if(p->tx.start == p->tx.end){
+                p->tx.start = 0;
+                p->tx.end = 0;
+            }else{
+                flush_or_drop(p); // partial send, the rest goes with the next batch
+            }
+        }
+        cqe->user_data = 0;
+    }
+}
+
+static void on_completion(Reactor *r, const struct io_uring_cqe *cqe){
+    int op = op_of(cqe->user_data);
+    if(op <= (int)(uintptr_t)UPGRADE_TAG){
+        void *tag = (void *)(uintptr_t)op;
+        if(tag == LISTEN_TAG){
+            if(cqe->res >= 0){
+                adopt_client(r, cqe->res);
+            }else if(cqe->res == -EMFILE || cqe->res == -ENFILE){
+                if(!shed_client(r)){ // a renewed accept would fail again at once
+                    pause_listener(r);
+                }
+            }else{
+                errno = -cqe->res;
+                perror("accept");
+            }
+        }else{
+            on_shard_fd(r, tag);
+        }
+        // multishot requests end now and then (and on errors), they are simply renewed
+        int fd = (tag == LISTEN_TAG) ? r->listen_fd : (tag == WAKE_TAG) ? r->wake_fd
+               : (tag == SIGNAL_TAG) ? r->signal_fd : (tag == CHANNEL_TAG) ? r->channel_fd
+               : (tag == STATS_TAG) ? r->stats_fd : r->upgrade_fd;
+        bool paused = (tag == LISTEN_TAG) && timer_armed(&r->listen_timer);
+        if(!(cqe->flags & IORING_CQE_F_MORE) && fd >= 0 && !paused){
+            arm_fd(r, fd, tag);
+        }
+        return;
+    }
+
+    Player *p = lookup_player(cqe->user_data & ~OP_MASK);
+    bool live = p && !p->closed && !p->match;
+    if(op == OP_RECV){
+        char *data = NULL;
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if(cqe->flags & IORING_CQE_F_BUFFER){
+            data = uring_buffer(r->ring, bid);
+        }
+        if(live){
+            if(!(cqe->flags & IORING_CQE_F_MORE)){
+                p->recv_armed = false;
+            }
+            if(cqe->res > 0 && data){
+                on_received(p, data, cqe->res);
+            }else if(cqe->res != -ENOBUFS){ // EOF or error, out of buffers just means try again
+                on_disconnect(p);
+            }
+            if(!p->closed && !p->match && !p->recv_armed){
+                arm_recv(p);
+            }
+        }
+        if(data){
+            uring_recycle(r->ring, bid);
+        }
+    }else if(op == OP_SEND && live){
+        on_disconnect(p); // the send failed, account_sends marked it broken
+    }else if(op == OP_WRITABLE && live){
+        p->want_write = false;
+        flush_or_drop(p);
+    }
+}
+
+// one io_uring_enter: submits this batch's sends and re-armed requests, then waits
+// for completions and handles every one of them
+static int uring_batch(Reactor *r, int wait_ms){
+    stats_count(STAT_SYSCALLS);
+    if(uring_enter(r->ring, wait_ms) < 0 && errno != ETIME && errno != EINTR){
+        perror("io_uring_enter");
+        return -1;
+    }
+    account_sends(r);
+    while(r->sends_inflight > 0){ // MSG_DONTWAIT sends complete inline, this is a safety net
+        stats_count(STAT_SYSCALLS);
+        uring_enter(r->ring, TIMER_TICK_MS);
+        account_sends(r);
+    }
+    timer_advance(&r->wheel, stats_now() / 1000000);
+
+    while(uring_ready(r->ring) > 0){
+        struct io_uring_cqe cqe = *uring_cqe_at(r->ring, 0);
+        uring_consume(r->ring, 1); // before handling, so unwatch_fd never sees it
+        if(cqe.user_data){
+            on_completion(r, &cqe);
+        }
+    }
+    return 0;
+}
+
+// spectators with frames queued this batch go after the players' sends, so however
+// many there are they cannot hold up a move
+static void flush_spectators(Reactor *r){
+    if(r->ring && r->watch_dirty){
+        stats_count(STAT_SYSCALLS);
+        uring_enter(r->ring, 0); // account_sends picks the completions up next batch
+    }
+    while(r->watch_dirty){
+        Player *p = r->watch_dirty;
+        r->watch_dirty = p->dirty_next;
+        p->dirty_next = NULL;
+        p->dirty = false;
+        flush_or_drop(p);
+    }
+}
+
+// stops the listener for good, what sits in its backlog is reset by the kernel on close
+static void close_listener(Reactor *r){
+    if(!timer_armed(&r->listen_timer)){
+        unwatch_fd(r, r->listen_fd, LISTEN_TAG);
+    }
+    timer_cancel(&r->wheel, &r->listen_timer);
+    timer_cancel(&r->wheel, &r->bot_timer);
+    close(r->listen_fd);
+    r->listen_fd = -1;
+}
+
+// drain, every batch until the shard's last game is over: nothing new is accepted and
+// whoever is still waiting for an opponent is turned away
+static void drain_shard(Reactor *r){
+    if(r->listen_fd >= 0){
+        close_listener(r);
+    }
+    Player *waiters = match_expired(r, 0);
+    while(waiters){
+        Player *p = waiters;
+        waiters = p->pending_next;
+        p->pending_next = NULL;
+        handle_fail(p, 51, "Server Busy");
+        drop_player(p);
+    }
+    free_closed_players(r);
+}
+
+// what a shard owns besides its inbox, each game once through its first seat. Players
+// on their way to another shard's inbox, and waiters with an opponent there, go with it
+static void pass_on_player(Player *p, void *arg){
+    Reactor *r = arg;
+    if(p->owner != r || p->closed || p->bot || p->match || p->handoff_pending){
+        return;
+    }
+
+    Game *g = p->game;
+    if(g){
+        if(p == g->p1){
+            unwatch_fd(r, p->fd, p);
+            if(!g->p2->bot){
+                unwatch_fd(r, g->p2->fd, g->p2);
+            }
+            upgrade_send_game(g, r->id);
+        }
+        return;
+    }
+    unwatch_fd(r, p->fd, p); // on io_uring, what was received lands in rx
+    if(p->spectator){
+        if(p->watching){
+            upgrade_send_spectator(p, p->watching->p1->name, r->id);
+        }
+    }else{
+        upgrade_send_player(p->open ? UP_WAITER : UP_CONNECTION, p, p->open, r->id);
+    }
+}
+
+// the old process's half of an upgrade, run by every shard at the end of a batch: stop,
+// wait until the others have too so no handoff is in flight, pass on everything this
+// shard owns and leave the loop. The sockets stay open until the process exits, so the
+// clients see no close
+static void hand_off_shard(Reactor *r){
+    if(r->listen_fd >= 0 && !timer_armed(&r->listen_timer)){
+        unwatch_fd(r, r->listen_fd, LISTEN_TAG);
+    }
+    while(r->ring && r->sends_inflight > 0){ // tx must hold exactly what has not gone out
+        stats_count(STAT_SYSCALLS);
+        uring_enter(r->ring, TIMER_TICK_MS);
+        account_sends(r);
+    }
+    pthread_barrier_wait(&upgrade_barrier);
+
+    if(r->listen_fd >= 0){
+        upgrade_send_listener(r->listen_fd, r->id);
+    }
+    if(r->id == 0){
+        for(SuspendedGame *s = match_take_suspended(); s; s = s->next){
+            upgrade_send_suspended(s);
+        }
+    }
+    for(Player *p = r->inbox; p; p = p->next){ // delivered by the others' last batch
+        Player *waiter = lookup_player(p->match);
+        if(p->spectator){
+            upgrade_send_spectator(p, waiter ? waiter->name : "", r->id);
+            continue;
+        }
+        if(waiter && !waiter->closed){ // unpaired again, the new process pairs the two afresh
+            unwatch_fd(r, waiter->fd, waiter);
+            upgrade_send_player(UP_WAITER, waiter, true, r->id);
+        }
+        upgrade_send_player(UP_WAITER, p, false, r->id);
+    }
+    each_player(pass_on_player, r);
+
+    pthread_barrier_wait(&upgrade_barrier);
+    if(r->id == 0){
+        upgrade_finish();
+    }
+}
+
+static void adopt_player(Reactor *r, Player *p){
+    p->owner = r;
+    if(p->fd >= 0){
+        adopt_connection();
+        watch_fd(r, p->fd, p);
+    }
+}
+
+// the new process's half of an upgrade, before the shard's first batch. Waiters that had
+// their WAIT are queued again on every shard before any of those still being paired is,
+// or two players could end up waiting side by side. Every timer starts afresh
+static void adopt_inherited(Reactor *r){
+    UpgradeItem *items = r->inherited;
+    r->inherited = NULL;
+    for(UpgradeItem *item = items; item; item = item->next){
+        Game *g = item->game;
+        Player *p = g ? g->p1 : item->player;
+        if(item->type == UP_SPECTATOR || (item->type == UP_WAITER && !item->waited)){
+            continue;
+        }
+        adopt_player(r, p);
+        if(g){
+            adopt_player(r, g->p2);
+            r->games++;
+            start_clock(g);
+        }else if(item->type == UP_WAITER){
+            arm_player(p, config.idle_timeout);
+            match_requeue(p);
+        }else{
+            arm_player(p, config.handshake_timeout);
+        }
+    }
+    pthread_barrier_wait(&inherit_barrier);
+
+    while(items){
+        UpgradeItem *item = items;
+        items = item->next;
+        Player *p = item->game ? item->game->p1 : item->player;
+        if(item->type == UP_SPECTATOR){
+            adopt_player(r, p);
+            p->spectator = true;
+            int pid;
+            attach_spectator(p, lookup_player(registry_find(p->name, &pid)));
+        }else if(item->type == UP_WAITER && !item->waited){
+            adopt_player(r, p);
+            arm_player(p, config.idle_timeout);
+            match_defer(&r->pending, p);
+        }else{
+            // frames that arrived before the switch, replies that had not gone out yet
+            Player *p2 = item->game ? item->game->p2 : NULL;
+            handle_frames(p);
+            if(p2 && !p2->bot){
+                handle_frames(p2);
+            }
+        }
+        counted_free(item);
+    }
+
+    uint64_t one = 1; // the first batch pairs and sends at once instead of at the first event
+    if(write(r->wake_fd, &one, sizeof(one)) < 0){
+        perror("write");
+    }
+}
+
+static void *shard_main(void *arg){
+    Reactor *r = arg;
+    stats_attach();
+    log_attach();
+    journal_attach(r->id);
+    if(inheriting){
+        adopt_inherited(r);
+    }
+
+    while(1){
+        int wait_ms = timer_next_ms(&r->wheel);
+        if((r->ring ? uring_batch(r, wait_ms) : epoll_batch(r, wait_ms)) < 0){
+            break;
+        }
+        pair_pending(r);
+        if(r->ring){
+            submit_sends(r); // before the handoffs, a player delivered elsewhere is not ours to touch
+        }
+        flush_spectators(r);
+        deliver_handoffs(r);
+        free_closed_players(r);
+        journal_commit(); // the batch's records become visible together
+
+        int state = __atomic_load_n(&run_state, __ATOMIC_ACQUIRE);
+        if(state == DRAINING){
+            drain_shard(r);
+        }else if(state == UPGRADING){
+            hand_off_shard(r);
+            break;
+        }
+        if(r->listen_fd < 0 && r->channel_fd < 0 && r->games == 0){
+            break; // orphaned game worker, or drained shard, with nothing left to play
+        }
+    }
+
+    if(r->epoll_fd >= 0){
+        close(r->epoll_fd);
+    }
+    return NULL;
+}
+
+// settled once before any shard is set up: a kernel without what the io_uring backend
+// needs gets the epoll one, for every shard
+static void pick_backend(void){
+    if(config.io_backend != IO_URING){
+        return;
+    }
+    Uring probe;
+    if(uring_init(&probe, 2, 2, 64) < 0){
+        perror("io_uring unavailable, using epoll");
+        config.io_backend = IO_EPOLL;
+        return;
+    }
+    uring_free(&probe);
+}
+
+static void init_shard(Reactor *r, int id, int listen_fd){
+    memset(r, 0, sizeof(Reactor));
+    r->id = id;
+    r->listen_fd = listen_fd;
+    r->channel_fd = -1;
+    r->signal_fd = -1;
+    r->stats_fd = -1;
+    r->upgrade_fd = -1;
+    pthread_mutex_init(&r->inbox_lock, NULL);
+
+    // pick_backend has made sure the kernel can, so failing here is a resource limit
+    // (RLIMIT_MEMLOCK, memory). Every shard runs the same backend, never a mix
+    if(config.io_backend == IO_URING){
+        r->ring = counted_malloc(sizeof(Uring));
+        if(!r->ring || uring_init(r->ring, URING_ENTRIES, URING_BUFFERS, RECV_BUF_SIZE) < 0){
+            perror("io_uring setup (try -E epoll)");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    r->epoll_fd = r->ring ? -1 : epoll_create1(EPOLL_CLOEXEC);
+    r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if((!r->ring && r->epoll_fd < 0) || r->wake_fd < 0){
+        perror("epoll_create1/eventfd");
+        exit(EXIT_FAILURE);
+    }
+
+    timer_wheel_init(&r->wheel, stats_now() / 1000000);
+    if(listen_fd >= 0){
+        watch_fd(r, listen_fd, LISTEN_TAG);
+        if(config.bot_wait > 0){
+            arm_bot_timer(r);
+        }
+    }
+    watch_fd(r, r->wake_fd, WAKE_TAG);
+}
+
+void reactor_run(int *listen_fds, int count, int signal_fd, int stats_fd, UpgradeItem *inherited){
+    shards = counted_calloc(count, sizeof(Reactor));
+    if(!shards){
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    shard_count = count;
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if(spare_fd < 0){
+        perror("open spare fd");
+        exit(EXIT_FAILURE);
+    }
+
+    // every shard must exist before any of them can hand a player over
+    pick_backend();
+    for(int i = 0; i < count; i++){
+        init_shard(&shards[i], i, listen_fds[i]);
+    }
+    if(signal_fd >= 0){
+        shards[0].signal_fd = signal_fd;
+        watch_fd(&shards[0], signal_fd, SIGNAL_TAG);
+    }
+    if(stats_fd >= 0){
+        shards[0].stats_fd = stats_fd;
+        watch_fd(&shards[0], stats_fd, STATS_TAG);
+    }
+    // a game's spectators lived on its shard and stay with it
+    if(inherited){
+        inheriting = true;
+        pthread_barrier_init(&inherit_barrier, NULL, count);
+    }
+    while(inherited){
+        UpgradeItem *item = inherited;
+        inherited = item->next;
+        Reactor *r = &shards[item->shard % count];
+        item->next = r->inherited;
+        r->inherited = item;
+    }
+
+    for(int i = 1; i < count; i++){
+        if(pthread_create(&shards[i].thread, NULL, shard_main, &shards[i]) != 0){
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    shards[0].thread = pthread_self();
+    shard_main(&shards[0]);
+    for(int i = 1; i < count; i++){
+        pthread_join(shards[i].thread, NULL);
+    }
+}
+
+void reactor_run_worker(int channel_fd){
+    // a single shard with no listener, inherited state from the parent is not used
+    static Reactor worker;
+    shards = &worker;
+    shard_count = 1;
+    pick_backend();
+    init_shard(&worker, 0, -1);
+
+    fcntl(channel_fd, F_SETFL, fcntl(channel_fd, F_GETFL) | O_NONBLOCK);
+    worker.channel_fd = channel_fd;
+    watch_fd(&worker, channel_fd, CHANNEL_TAG);
+    shard_main(&worker);
+}
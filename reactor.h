@@ -0,0 +1,51 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+#include "timer.h"
+#include "uring.h"
+
+struct Player;
+struct UpgradeItem;
+
+// one event loop per worker thread, each with its own SO_REUSEPORT listener and the
+// games of the players it owns. The match queues and the active-name list are shared
+typedef struct Reactor {
+    int id;
+    int epoll_fd;
+    int listen_fd;
+    int wake_fd; // eventfd, signalled when another shard hands a player over
+    int channel_fd; // game worker only: matched pairs arrive here from the acceptor
+    int signal_fd; // shard 0 only: SIGCHLD, SIGUSR1, SIGQUIT (drain) and SIGUSR2 (upgrade)
+    int stats_fd; // shard 0 only: admin Unix socket answering with a stats snapshot
+    int upgrade_fd; // shard 0 only: socket to a new process that has not said it is ready yet
+    int games; // games running on this shard
+    int spectators; // spectators watching those games
+    pthread_t thread;
+    pthread_mutex_t inbox_lock;
+    struct Player *inbox; // players handed over to be matched with a waiter owned here
+    struct Player *pending; // players that sent OPEN during this batch, paired once it is done
+    struct Player *outbox; // players leaving for another shard once this batch is done
+    struct Player *closed_players; // freed once the current batch of events is done
+    TimerWheel wheel; // deadlines of the players owned here, drives the epoll_wait timeout
+    Timer bot_timer; // periodic, hands long waiters to the bot when that is on
+    Timer listen_timer; // armed while the listener sits out fd exhaustion
+    Timer upgrade_timer; // armed while upgrade_fd waits, the upgrade is abandoned when it fires
+    Uring *ring; // io_uring backend, NULL when the shard runs on epoll
+    struct Player *dirty; // io_uring backend: players with bytes to send once the batch is done
+    int sends_inflight; // submitted sends whose completion has not been accounted yet
+    struct Player *watch_dirty; // spectators with shared frames queued, sent after the players'
+    struct UpgradeItem *inherited; // taken over from the process this one replaced, adopted first thing
+} Reactor;
+
+// runs one shard per listening socket, shard 0 on the calling thread and also reading
+// signal_fd and serving stats_fd (-1 if off). inherited is what the process this one
+// replaced passed on, NULL on a normal start. Returns once every shard has stopped:
+// drained after SIGQUIT, or handed over to a new process after SIGUSR2
+void reactor_run(int *listen_fds, int count, int signal_fd, int stats_fd, struct UpgradeItem *inherited);
+
+// body of a pre-forked game worker: plays the pairs sent over channel_fd, returns
+// once the acceptor is gone and the last game has ended
+void reactor_run_worker(int channel_fd);
+
+#endif
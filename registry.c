@@ -0,0 +1,250 @@
+#define _GNU_SOURCE
+
+#include "registry.h"
+#include "handlers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define REGISTRY_INITIAL_CAP 64 // power of two
+
+// names are stored inline so a probe never has to chase a Player pointer, which also
+// lets the table live in memory shared by several processes
+typedef struct {
+    uint64_t hash; // 0 marks an empty slot
+    int32_t owner; // pid of the process whose game holds the name
+    uint64_t player; // Handle of the owner's Player, meaningful inside that process only
+    char name[73];
+} ActiveSlot;
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t cap; // power of two
+    size_t count;
+    bool shared; // lives in a MAP_SHARED mapping with a fixed capacity
+    ActiveSlot *slots;
+} Registry;
+
+static Registry local_registry = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static Registry *reg = &local_registry;
+
+static void lock_registry(void){
+    if(pthread_mutex_lock(&reg->lock) == EOWNERDEAD){
+        // a game worker died holding the lock, every update leaves the table consistent
+        // between probes so it is safe to keep using
+        pthread_mutex_consistent(&reg->lock);
+    }
+}
+
+static void unlock_registry(void){
+    pthread_mutex_unlock(&reg->lock);
+}
+
+// FNV-1a, never returns 0 since that marks empty slots
+static uint64_t hash_name(const char *name){
+    uint64_t h = 14695981039346656037ULL;
+    for(const unsigned char *c = (const unsigned char *)name; *c; c++){
+        h ^= *c;
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+// linear probing: returns the slot holding name, or the empty slot where it would go
+static size_t find_slot(const char *name, uint64_t h){
+    size_t mask = reg->cap - 1;
+    size_t i = h & mask;
+    while(reg->slots[i].hash && (reg->slots[i].hash != h || strcmp(reg->slots[i].name, name) != 0)){
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// keep the load factor under one half, rehashing is amortized over the inserts
+static bool grow(void){
+    if(reg->shared){
+        return false; // other processes hold the mapping, it cannot move
+    }
+
+    size_t new_cap = reg->cap ? reg->cap * 2 : REGISTRY_INITIAL_CAP;
+    ActiveSlot *new_slots = counted_calloc(new_cap, sizeof(ActiveSlot));
+    if(!new_slots){
+        perror("calloc");
+        return false;
+    }
+
+    ActiveSlot *old_slots = reg->slots;
+    size_t old_cap = reg->cap;
+    reg->slots = new_slots;
+    reg->cap = new_cap;
+
+    for(size_t i = 0; i < old_cap; i++){
+        if(old_slots[i].hash){
+            reg->slots[find_slot(old_slots[i].name, old_slots[i].hash)] = old_slots[i];
+        }
+    }
+    counted_free(old_slots);
+    return true;
+}
+
+// backward-shift deletion keeps probe chains intact without tombstones
+static void delete_slot(size_t i){
+    size_t mask = reg->cap - 1;
+    size_t j = i;
+    while(1){
+        j = (j + 1) & mask;
+        if(!reg->slots[j].hash){
+            break;
+        }
+        size_t home = reg->slots[j].hash & mask;
+        // move j back into the hole unless its home lies cyclically in (i, j]
+        bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if(!stays){
+            reg->slots[i] = reg->slots[j];
+            i = j;
+        }
+    }
+    reg->slots[i].hash = 0;
+    reg->count--;
+}
+
+void registry_init_shared(size_t capacity){
+    size_t cap = REGISTRY_INITIAL_CAP;
+    while(cap < capacity * 2){
+        cap *= 2;
+    }
+
+    // pages are only touched as slots fill, so a generous capacity costs little
+    size_t bytes = sizeof(Registry) + cap * sizeof(ActiveSlot);
+    void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(mem == MAP_FAILED){
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    Registry *shared = mem;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    shared->cap = cap;
+    shared->count = 0;
+    shared->shared = true;
+    shared->slots = (ActiveSlot *)(shared + 1);
+    reg = shared;
+}
+
+bool is_active(const char *name){
+    uint64_t h = hash_name(name);
+    lock_registry();
+    bool found = reg->cap > 0 && reg->slots[find_slot(name, h)].hash != 0;
+    unlock_registry();
+    return found;
+}
+
+// check and insert under one lock so two shards cannot both claim a name
+bool add_active(Player *p){
+    uint64_t h = hash_name(p->name);
+    lock_registry();
+
+    if((reg->count + 1) * 2 > reg->cap && !grow()){
+        unlock_registry();
+        return false;
+    }
+
+    size_t i = find_slot(p->name, h);
+    if(reg->slots[i].hash){
+        unlock_registry();
+        return false;
+    }
+
+    reg->slots[i].hash = h;
+    reg->slots[i].owner = getpid();
+    reg->slots[i].player = p->self;
+    strcpy(reg->slots[i].name, p->name);
+    reg->count++;
+    unlock_registry();
+    return true;
+}
+
+void remove_active(Player *p){
+    uint64_t h = hash_name(p->name);
+    lock_registry();
+    if(reg->cap > 0){
+        size_t i = find_slot(p->name, h);
+        if(reg->slots[i].hash){
+            delete_slot(i);
+        }
+    }
+    unlock_registry();
+}
+
+uint64_t registry_find(const char *name, int *owner){
+    uint64_t h = hash_name(name);
+    uint64_t player = 0;
+    *owner = 0;
+    lock_registry();
+    if(reg->cap > 0){
+        ActiveSlot *slot = &reg->slots[find_slot(name, h)];
+        if(slot->hash){
+            *owner = slot->owner;
+            player = (slot->owner == getpid()) ? slot->player : 0;
+        }
+    }
+    unlock_registry();
+    return player;
+}
+
+int active_count(void){
+    lock_registry();
+    int n = (int)reg->count;
+    unlock_registry();
+    return n;
+}
+
+void registry_transfer(const char *name, int pid){
+    uint64_t h = hash_name(name);
+    lock_registry();
+    if(reg->cap > 0){
+        size_t i = find_slot(name, h);
+        if(reg->slots[i].hash){
+            reg->slots[i].owner = pid;
+        }
+    }
+    unlock_registry();
+}
+
+// may run before or after the acceptor's registry_transfer for the same name, both
+// leave the worker as the owner
+void registry_adopt(Player *p){
+    uint64_t h = hash_name(p->name);
+    lock_registry();
+    if(reg->cap > 0){
+        size_t i = find_slot(p->name, h);
+        if(reg->slots[i].hash){
+            reg->slots[i].owner = getpid();
+            reg->slots[i].player = p->self;
+        }
+    }
+    unlock_registry();
+}
+
+void registry_purge_owner(int pid){
+    lock_registry();
+    for(size_t i = 0; i < reg->cap; ){
+        if(reg->slots[i].hash && reg->slots[i].owner == pid){
+            delete_slot(i); // may shift a later entry into i, so look at i again
+        }else{
+            i++;
+        }
+    }
+    unlock_registry();
+}
@@ -0,0 +1,29 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct Player;
+
+// names of every player that has opened (waiting or in a game), shared by all shards.
+// Open-addressing hash set so each call is O(1) regardless of how many are active
+bool is_active(const char *name);
+bool add_active(struct Player *p); // false if the name is already taken
+void remove_active(struct Player *p);
+int active_count(void);
+// Handle of the player holding name, 0 if nobody does or its game is in another
+// process. owner gets the pid holding the name, 0 if nobody does
+uint64_t registry_find(const char *name, int *owner);
+
+// moves the table into a fixed-capacity MAP_SHARED mapping before game workers are
+// forked, so the duplicate check sees names held by games in every process
+void registry_init_shared(size_t capacity);
+// each name records the pid whose game holds it, so a crashed worker's names can be freed
+void registry_transfer(const char *name, int pid);
+// game worker: the name is held by p, which this process now plays
+void registry_adopt(struct Player *p);
+void registry_purge_owner(int pid);
+
+#endif
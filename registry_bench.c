@@ -0,0 +1,69 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "handlers.h"
+#include "registry.h"
+
+#define OPS 200000
+
+// measures the name-registry cost of one OPEN (duplicate check + insert) and of
+// releasing a name at game end, with the registry already holding n names
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void set_name(Player *p, const char *prefix, int i) {
+    snprintf(p->name, sizeof(p->name), "%s%d", prefix, i);
+}
+
+int main() {
+    static Player p; // only the name is used
+    int sizes[] = {10, 100, 1000, 10000, 100000, 1000000};
+    int filled = 0;
+
+    printf("%10s %14s %14s %14s\n", "active", "open ns/op", "lookup ns/op", "remove ns/op");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (; filled < sizes[s]; filled++) {
+            set_name(&p, "resident-", filled);
+            add_active(&p);
+        }
+
+        // untimed round so table growth is not charged to the steady state
+        for (int i = 0; i < OPS; i++) {
+            set_name(&p, "opener-", i);
+            add_active(&p);
+        }
+        for (int i = 0; i < OPS; i++) {
+            set_name(&p, "opener-", i);
+            remove_active(&p);
+        }
+
+        double t0 = now_ns();
+        for (int i = 0; i < OPS; i++) {
+            set_name(&p, "opener-", i);
+            if (!is_active(p.name)) add_active(&p);
+        }
+        double t1 = now_ns();
+        for (int i = 0; i < OPS; i++) {
+            set_name(&p, "resident-", (i * 7919) % filled);
+            if (!is_active(p.name)) { printf("lost a name\n"); return 1; }
+        }
+        double t2 = now_ns();
+        for (int i = 0; i < OPS; i++) {
+            set_name(&p, "opener-", i);
+            remove_active(&p);
+        }
+        double t3 = now_ns();
+
+        if (active_count() != filled) { printf("count mismatch\n"); return 1; }
+        printf("%10d %14.1f %14.1f %14.1f\n", filled,
+               (t1 - t0) / OPS, (t2 - t1) / OPS, (t3 - t2) / OPS);
+    }
+    return 0;
+}
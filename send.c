@@ -1,92 +1,400 @@
 #include "send.h"
 #include "handlers.h"
+#include "config.h"
+#include "stats.h"
+#include "journal.h"
+#include "reactor.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <errno.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
-int format_message(int fd, const char *msg){
-    int msg_len = strlen(msg);
-    if(msg_len > 104){ // max length is 104
+static void compact(SendBuffer *sb){
+    if(sb->start > 0){
+        memmove(sb->data, sb->data + sb->start, sb->end - sb->start);
+        sb->end -= sb->start;
+        sb->start = 0;
+    }
+}
+
+// make sure len more bytes fit behind end: reclaim sent space, grow up to the
+// high-water mark, and as a last resort try pushing the queue out right now
+static int reserve_bytes(Player *p, int len){
+    SendBuffer *sb = &p->tx;
+    if(sb->broken){
         return -1;
     }
 
-    char header[16];
-    snprintf(header, sizeof(header), "0|%02d|", msg_len);
+    compact(sb);
+    if(sb->end + len <= sb->cap){
+        return 0;
+    }
+
+    if(sb->end + len > config.out_hwm){
+        if(flush_player(p) < 0){
+            return -1;
+        }
+        compact(sb);
+        if(sb->end + len > config.out_hwm){
+            sb->broken = true; // client is not reading, stop buffering for it
+            return -1;
+        }
+    }
+
+    int new_cap = (sb->cap == 0) ? SEND_BUF_INITIAL : sb->cap;
+    while(new_cap < sb->end + len){
+        new_cap *= 2;
+    }
+    if(new_cap > config.out_hwm){
+        new_cap = config.out_hwm;
+    }
+    if(new_cap <= sb->cap){
+        return 0; // flushing made enough room
+    }
+
+    char *data = counted_realloc(sb->data, new_cap);
+    if(!data){
+        sb->broken = true;
+        return -1;
+    }
+    sb->data = data;
+    sb->cap = new_cap;
+    return 0;
+}
+
+static int reserve_frame(Player *p){
+    return reserve_bytes(p, MAX_FRAME_LENGTH + 1); // +1 for vsnprintf's NUL
+}
 
-    int total_len = strlen(header) + msg_len;
-    char *buf = malloc(total_len + 1);
-    if(!buf){
+// prints the body after the space reserved for "0|NN|" and fills in the header once
+// the length is known, frame needs MAX_FRAME_LENGTH + 1 bytes. Returns the frame length
+static int encode_frame(char *frame, const char *fmt, va_list ap){
+    int msg_len = vsnprintf(frame + HEADER_LENGTH, MAX_MSG_LENGTH + 1, fmt, ap);
+    if(msg_len < 0 || msg_len > MAX_MSG_LENGTH){ // max length is 99
         return -1;
     }
 
-    strcpy(buf, header); // copy header to buffer
-    strcat(buf, msg); // concatenate msg to buffer
+    frame[0] = '0';
+    frame[1] = '|';
+    frame[2] = '0' + msg_len / 10;
+    frame[3] = '0' + msg_len % 10;
+    frame[4] = '|';
+    return HEADER_LENGTH + msg_len;
+}
 
-    // write to file descriptor
-    ssize_t bytes = write(fd, buf, total_len);
-    free(buf);
+// encodes a frame straight into the player's queue
+static int append_frame(Player *p, const char *fmt, ...){
+    if(reserve_frame(p) < 0){
+        return -1;
+    }
 
-    if(bytes == (ssize_t)total_len){
-        return 0;
-    }else{
+    va_list ap;
+    va_start(ap, fmt);
+    int len = encode_frame(p->tx.data + p->tx.end, fmt, ap);
+    va_end(ap);
+
+    if(len < 0){
         return -1;
     }
+    p->tx.end += len;
+    return 0;
 }
 
-void format_board(char *buf, int buf_size, int piles[5]){
-    int ptr = 0;
-    for(int i = 0; i < 5; i++){
-        ptr += snprintf(buf+ptr, buf_size-ptr, "%d", piles[i]);
-        if(i < 4){
-            ptr += snprintf(buf+ptr, buf_size-ptr, " ");
+int queue_bytes(Player *p, const char *frame, int len){
+    if(reserve_bytes(p, len) < 0){
+        return -1;
+    }
+    memcpy(p->tx.data + p->tx.end, frame, len);
+    p->tx.end += len;
+    return 0;
+}
+
+static int decimal_digits(int value){
+    int digits = 1;
+    while(value >= 10){
+        value /= 10;
+        digits++;
+    }
+    return digits;
+}
+
+static int board_length(const Game *g){
+    int len = g->board.pile_count - 1; // separating spaces
+    for(int i = 0; i < g->board.pile_count; i++){
+        len += decimal_digits(g->board.piles[i]);
+    }
+    return len;
+}
+
+// "1 3 5 7 9", the caller has made room for board_length bytes
+static char *write_board(char *out, const Game *g){
+    for(int i = 0; i < g->board.pile_count; i++){
+        if(i > 0){
+            *out++ = ' ';
+        }
+        int value = g->board.piles[i];
+        int digits = decimal_digits(value);
+        for(int d = digits - 1; d >= 0; d--){
+            out[d] = '0' + value % 10;
+            value /= 10;
         }
+        out += digits;
     }
-    buf[buf_size - 1] = '\0';
+    return out;
 }
 
-int send_wait(int fd){
-    return format_message(fd, "WAIT|");
+// protocol version 1: header and a fixed-width body, body_len bytes of it are filled
+// in by the caller. Returns where the body goes, NULL if the queue is full
+static char *append_binary(Player *p, int type, int body_len){
+    if(reserve_bytes(p, BIN_HEADER_LENGTH + body_len) < 0){
+        return NULL;
+    }
+    char *out = p->tx.data + p->tx.end;
+    out[0] = BIN_VERSION;
+    out[1] = (char)type;
+    bin_put16(out + 2, body_len);
+    p->tx.end += BIN_HEADER_LENGTH + body_len;
+    return out + BIN_HEADER_LENGTH;
 }
 
-int send_name(int fd, int p_num, const char *opp_name){
-    char msg[200];
-    // no extra trailing numbers
-    snprintf(msg, sizeof(msg), "NAME|%d|%s|", p_num, opp_name ? opp_name : "");
-    return format_message(fd, msg);
+// PLAY and OVER in either version: the text one is head, board, tail, the binary one
+// carries its two leading bytes and the piles
+typedef struct {
+    const char *head;
+    const char *tail;
+    int type;
+    int a;
+    int b;
+} BoardFrame;
+
+// PLAY and OVER carry the whole board, which on a large variant is far longer than a
+// two-digit length allows. Those go out as wide frames ("2|20481|PLAY|...")
+static int board_body_length(const Game *g, const BoardFrame *f, bool binary){
+    if(binary){
+        return 4 + 2 * g->board.pile_count;
+    }
+    return strlen(f->head) + board_length(g) + strlen(f->tail);
 }
 
-int send_play(Game *g){
-    if(!g || !g->p1 || !g->p2){
+static int board_frame_length(int body_len, bool binary){
+    if(binary){
+        return BIN_HEADER_LENGTH + body_len;
+    }
+    return ((body_len <= MAX_MSG_LENGTH) ? HEADER_LENGTH : WIDE_HEADER_LENGTH) + body_len;
+}
+
+int max_board_frame_length(void){
+    // every pile still at its starting size, and the longest OVER around it
+    int body_len = strlen("OVER|2|") + (MAX_PILES - 1) + strlen("|Forfeit|");
+    for(int i = 0; i < MAX_PILES; i++){
+        body_len += decimal_digits(2 * i + 1);
+    }
+    return board_frame_length(body_len, false); // text, binary piles take fewer bytes
+}
+
+// the board goes straight into out, which has room for board_frame_length bytes
+static void write_board_frame(char *out, int body_len, const Game *g, const BoardFrame *f, bool binary){
+    if(binary){
+        out[0] = BIN_VERSION;
+        out[1] = (char)f->type;
+        bin_put16(out + 2, body_len);
+        out += BIN_HEADER_LENGTH;
+        out[0] = (char)f->a;
+        out[1] = (char)f->b;
+        bin_put16(out + 2, g->board.pile_count);
+        for(int i = 0; i < g->board.pile_count; i++){
+            bin_put16(out + 4 + 2 * i, g->board.piles[i]);
+        }
+        return;
+    }
+
+    char header[16];
+    int header_len = (body_len <= MAX_MSG_LENGTH)
+        ? snprintf(header, sizeof(header), "0|%02d|", body_len)
+        : snprintf(header, sizeof(header), "%c|%05d|", WIDE_VERSION, body_len);
+    int head_len = strlen(f->head);
+    memcpy(out, header, header_len);
+    out += header_len;
+    memcpy(out, f->head, head_len);
+    out = write_board(out + head_len, g);
+    memcpy(out, f->tail, strlen(f->tail));
+}
+
+// returns the frame length
+static int append_board(Player *p, const Game *g, const BoardFrame *f){
+    int body_len = board_body_length(g, f, p->binary);
+    int len = board_frame_length(body_len, p->binary);
+    if(reserve_bytes(p, len) < 0){
         return -1;
     }
+    write_board_frame(p->tx.data + p->tx.end, body_len, g, f, p->binary);
+    p->tx.end += len;
+    return len;
+}
+
+static void release_frame(SharedFrame *f){
+    if(f && --f->refs == 0){
+        counted_free(f);
+    }
+}
 
-    char board[50]; // enough for "1 3 5 7 9"
-    snprintf(board, sizeof(board), "%d %d %d %d %d",
-             g->piles[0], g->piles[1], g->piles[2], g->piles[3], g->piles[4]);
+static SharedFrame *share_frame(const Game *g, const BoardFrame *f, bool binary){
+    int body_len = board_body_length(g, f, binary);
+    int len = board_frame_length(body_len, binary);
+    SharedFrame *shared = counted_malloc(sizeof(SharedFrame) + len);
+    if(!shared){
+        return NULL;
+    }
+    shared->refs = 1; // the encoder's, dropped once every spectator has its own
+    shared->len = len;
+    write_board_frame(shared->data, body_len, g, f, binary);
+    return shared;
+}
 
-    char msg[100];
-    snprintf(msg, sizeof(msg), "PLAY|%d|%s|", g->next_p, board);
+// a full queue skips its oldest frame that has not started going out: the newer ones
+// carry the whole board, and a spectator is never worth delaying the game for
+static void push_frame(Player *w, SharedFrame *f){
+    WatchQueue *q = w->watch_queue;
+    if(q->count == WATCH_QUEUE_FRAMES){
+        int skip = (q->offset > 0) ? 1 : 0;
+        int i = (q->head + skip) % WATCH_QUEUE_FRAMES;
+        release_frame(q->frames[i]);
+        q->frames[i] = q->frames[q->head]; // a partly sent frame moves up into the gap
+        q->head = (q->head + 1) % WATCH_QUEUE_FRAMES;
+        q->count--;
+        stats_count(STAT_WATCH_SKIPPED);
+        if(++q->stalled > WATCH_STALL_LIMIT){
+            w->tx.broken = true;
+        }
+    }
+    f->refs++;
+    q->frames[(q->head + q->count) % WATCH_QUEUE_FRAMES] = f;
+    q->count++;
 
-    int r1 = format_message(g->p1->fd, msg);
-    int r2 = format_message(g->p2->fd, msg);
+    if(!w->dirty){
+        w->dirty = true;
+        w->dirty_next = w->owner->watch_dirty;
+        w->owner->watch_dirty = w;
+    }
+}
 
-    return (r1 == 0 && r2 == 0) ? 0 : -1;
+// the frame is encoded once for each protocol version its spectators speak, however
+// many of them there are
+static void share_board(Game *g, const BoardFrame *f){
+    SharedFrame *frames[2] = { NULL, NULL }; // text, binary
+    for(Player *w = g->watchers; w; w = w->watch_next){
+        int v = w->binary;
+        if(!frames[v] && !(frames[v] = share_frame(g, f, w->binary))){
+            continue; // out of memory, the spectator misses this one
+        }
+        push_frame(w, frames[v]);
+    }
+    release_frame(frames[0]);
+    release_frame(frames[1]);
+}
+
+bool watch_game(Player *p, Game *g){
+    p->watch_queue = counted_calloc(1, sizeof(WatchQueue));
+    if(!p->watch_queue){
+        return false;
+    }
+    p->watching = g;
+    p->watch_prev = NULL;
+    p->watch_next = g->watchers;
+    if(g->watchers){
+        g->watchers->watch_prev = p;
+    }
+    g->watchers = p;
+    send_play_single(p, g);
+    return true;
+}
+
+void unwatch_game(Player *p){
+    Game *g = p->watching;
+    if(!g){
+        return;
+    }
+    if(p->watch_prev){
+        p->watch_prev->watch_next = p->watch_next;
+    }else{
+        g->watchers = p->watch_next;
+    }
+    if(p->watch_next){
+        p->watch_next->watch_prev = p->watch_prev;
+    }
+    p->watching = NULL;
+    p->watch_prev = NULL;
+    p->watch_next = NULL;
+
+    WatchQueue *q = p->watch_queue;
+    for(int i = 0; i < q->count; i++){
+        release_frame(q->frames[(q->head + i) % WATCH_QUEUE_FRAMES]);
+    }
+    counted_free(q);
+    p->watch_queue = NULL;
+}
+
+// encoded once into p1's queue and copied from there for p2 if both speak the same version
+static int append_board_both(Game *g, const BoardFrame *f){
+    int len = append_board(g->p1, g, f);
+    if(len < 0){
+        append_board(g->p2, g, f);
+        return -1;
+    }
+    if(g->p1->binary != g->p2->binary){
+        return (append_board(g->p2, g, f) < 0) ? -1 : 0;
+    }
+    return queue_bytes(g->p2, g->p1->tx.data + g->p1->tx.end - len, len);
+}
+
+int send_wait(Player *p){
+    if(p->binary){
+        return append_binary(p, BIN_WAIT, 0) ? 0 : -1;
+    }
+    return append_frame(p, "WAIT|");
+}
+
+int send_name(Player *p, int p_num, const char *opp_name){
+    if(p->binary){
+        char *out = append_binary(p, BIN_NAME, 1 + BIN_NAME_FIELD);
+        if(!out){
+            return -1;
+        }
+        out[0] = (char)p_num;
+        memset(out + 1, 0, BIN_NAME_FIELD);
+        strncpy(out + 1, opp_name ? opp_name : "", BIN_NAME_FIELD - 1);
+        return 0;
+    }
+    // no extra trailing numbers
+    return append_frame(p, "NAME|%d|%s|", p_num, opp_name ? opp_name : "");
+}
+
+int send_play(Game *g){
+    if(!g || !g->p1 || !g->p2){
+        return -1;
+    }
+
+    char head[16];
+    snprintf(head, sizeof(head), "PLAY|%d|", g->board.next_p);
+    BoardFrame f = { head, "|", BIN_PLAY, g->board.next_p, 0 };
+    int r = append_board_both(g, &f);
+    share_board(g, &f);
+    return r;
 }
 
 int send_play_single(Player *p, Game *g){
     if(!p || !g){
         return -1;
     }
-    
-    char board[50];
-    snprintf(board, sizeof(board), "%d %d %d %d %d",
-             g->piles[0], g->piles[1], g->piles[2], g->piles[3], g->piles[4]);
 
-    char msg[100];
-    snprintf(msg, sizeof(msg), "PLAY|%d|%s|", g->next_p, board);
-
-    return format_message(p->fd, msg);
+    char head[16];
+    snprintf(head, sizeof(head), "PLAY|%d|", g->board.next_p);
+    BoardFrame f = { head, "|", BIN_PLAY, g->board.next_p, 0 };
+    return (append_board(p, g, &f) < 0) ? -1 : 0;
 }
 
 int send_over(Game *g, int winner, const char *reason){
@@ -94,21 +402,137 @@ int send_over(Game *g, int winner, const char *reason){
         return -1;
     }
 
-    char board[50]; 
-    snprintf(board, sizeof(board), "%d %d %d %d %d",
-             g->piles[0], g->piles[1], g->piles[2], g->piles[3], g->piles[4]);
+    char head[16];
+    char tail[MAX_MSG_LENGTH];
+    bool forfeit = reason && reason[0];
+    journal_over(g, winner, forfeit ? JOVER_FORFEIT : JOVER_WIN);
+    snprintf(head, sizeof(head), "OVER|%d|", winner);
+    snprintf(tail, sizeof(tail), "|%s|", reason ? reason : "");
+    BoardFrame f = { head, tail, BIN_OVER, winner, forfeit };
+    int r = append_board_both(g, &f);
+    share_board(g, &f);
+    return r;
+}
 
-    char msg[200];
-    snprintf(msg, sizeof(msg), "OVER|%d|%s|%s|", winner, board, reason ? reason : "");
+int send_fail(Player *p, int code, const char *msg_text){
+    if(p->binary){
+        char *out = append_binary(p, BIN_FAIL, 2);
+        if(!out){
+            return -1;
+        }
+        bin_put16(out, code);
+        return 0;
+    }
+    return append_frame(p, "FAIL|%02d %s|", code, msg_text ? msg_text : "");
+}
 
-    int r1 = format_message(g->p1->fd, msg);
-    int r2 = format_message(g->p2->fd, msg);
+// spectators: what is left in tx, then the shared frames, all in one sendmsg. A full
+// socket is not waited for, the rest goes out along with the next frame
+static int flush_watcher(Player *p){
+    SendBuffer *sb = &p->tx;
+    WatchQueue *q = p->watch_queue;
+    struct iovec iov[WATCH_QUEUE_FRAMES + 1];
+    int n = 0;
+    if(sb->start < sb->end){
+        iov[n].iov_base = sb->data + sb->start;
+        iov[n++].iov_len = sb->end - sb->start;
+    }
+    for(int i = 0; i < q->count; i++){
+        SharedFrame *f = q->frames[(q->head + i) % WATCH_QUEUE_FRAMES];
+        int sent = (i == 0) ? q->offset : 0;
+        iov[n].iov_base = f->data + sent;
+        iov[n++].iov_len = f->len - sent;
+    }
 
-    return (r1 == 0 && r2 == 0) ? 0 : -1;
+    ssize_t bytes = 0;
+    if(n > 0 && !sb->broken){
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        do{
+            bytes = sendmsg(p->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+            stats_count(STAT_SYSCALLS);
+        }while(bytes < 0 && errno == EINTR);
+        if(bytes < 0){
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                sb->broken = true;
+            }
+            bytes = 0;
+        }
+    }
+    if(bytes > 0){
+        q->stalled = 0;
+    }
+
+    int from_tx = (bytes < sb->end - sb->start) ? (int)bytes : sb->end - sb->start;
+    sb->start += from_tx;
+    bytes -= from_tx;
+    if(sb->start == sb->end){
+        sb->start = 0;
+        sb->end = 0;
+    }
+    while(bytes > 0){
+        SharedFrame *f = q->frames[q->head];
+        int left = f->len - q->offset;
+        if(bytes < left){
+            q->offset += bytes;
+            break;
+        }
+        bytes -= left;
+        q->offset = 0;
+        release_frame(f);
+        q->head = (q->head + 1) % WATCH_QUEUE_FRAMES;
+        q->count--;
+    }
+
+    if(sb->broken){
+        return -1;
+    }
+    return (sb->start < sb->end || q->count > 0) ? 1 : 0;
+}
+
+int flush_player(Player *p){
+    if(!p){
+        return 0;
+    }
+    if(p->watch_queue){
+        return flush_watcher(p);
+    }
+
+    SendBuffer *sb = &p->tx;
+    if(p->bot){ // nobody reads what is sent to the bot
+        sb->start = 0;
+        sb->end = 0;
+        return 0;
+    }
+    while(sb->start < sb->end){
+        ssize_t bytes = send(p->fd, sb->data + sb->start, sb->end - sb->start, MSG_NOSIGNAL);
+        stats_count(STAT_SYSCALLS);
+        if(bytes < 0){
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+            sb->broken = true;
+            return -1;
+        }
+        sb->start += bytes; // partial writes keep the rest queued
+    }
+
+    if(sb->start == sb->end){
+        sb->start = 0;
+        sb->end = 0;
+    }
+
+    if(sb->broken){
+        return -1;
+    }
+    return (sb->start < sb->end) ? 1 : 0;
 }
 
-int send_fail(int fd, int code, const char *msg_text){
-    char buf[200];
-    snprintf(buf, sizeof(buf), "FAIL|%02d %s|", code, msg_text ? msg_text : "");
-    return format_message(fd, buf);
+void free_send_buffer(SendBuffer *sb){
+    counted_free(sb->data);
+    sb->data = NULL;
+    sb->start = 0;
+    sb->end = 0;
+    sb->cap = 0;
 }
@@ -1,16 +1,72 @@
 #ifndef SEND_H
 #define SEND_H
 
+#include <stdbool.h>
+
+#define SEND_BUF_INITIAL 256 // grows on demand up to config.out_hwm
+
 struct Game;
 typedef struct Game Game;
 struct Player;
 typedef struct Player Player;
 
-int send_wait(int fd);
-int send_name(int fd, int p_num, const char *opp_name);
+// bounded output queue, bytes in [start, end) are encoded but not yet accepted by the kernel
+typedef struct {
+    char *data;
+    int start;
+    int end;
+    int cap;
+    bool broken; // queue hit the high-water mark or the socket failed, client must go
+} SendBuffer;
+
+#define WATCH_QUEUE_FRAMES 16 // frames a spectator may fall behind before older ones are skipped
+#define WATCH_STALL_LIMIT 64 // frames skipped without the socket taking a byte, then it is dropped
+
+// one encoded PLAY or OVER shared by every spectator of a game. Spectators live on the
+// game's shard, so the count is only touched by that thread
+typedef struct SharedFrame {
+    int refs;
+    int len;
+    char data[];
+} SharedFrame;
+
+// frames a spectator has not received yet, offset bytes of the oldest are already sent
+typedef struct WatchQueue {
+    SharedFrame *frames[WATCH_QUEUE_FRAMES];
+    int head;
+    int count;
+    int offset;
+    int stalled; // frames skipped since the socket last took anything
+} WatchQueue;
+
+// the send_* functions only encode into the player's SendBuffer, nothing reaches the
+// socket until flush_player sends everything queued in one syscall. PLAY and OVER on
+// a board too large for 99 bytes use a wider length field, "0|NNNN|". A player whose
+// OPEN was binary gets every frame in protocol version 1 instead (see message.h)
+int send_wait(Player *p);
+int send_name(Player *p, int p_num, const char *opp_name);
 int send_play(Game *g);
 int send_play_single(Player *p, Game *g);
 int send_over(Game *g, int winner, const char *reason);
-int send_fail(int fd, int code, const char *msg);
+int send_fail(Player *p, int code, const char *msg);
+
+// longest PLAY or OVER any board can produce, the output high-water mark must fit one
+int max_board_frame_length(void);
+
+// spectators: send_play and send_over also queue their frame, encoded once per protocol
+// version, on every spectator of the game. Nothing is sent to them until the reactor
+// flushes its list of spectators with frames (Reactor.watch_dirty) after the players'
+// own sends. A spectator too slow for its queue skips the oldest frames, each PLAY
+// carries the whole board anyway, and is dropped once it stops reading altogether.
+// watch_game subscribes p starting with the current board, false if out of memory
+bool watch_game(Player *p, Game *g);
+void unwatch_game(Player *p);
+
+// returns 0 once the queue is empty, 1 if bytes remain because the socket is full
+// (wait for writability and call again, a spectator is never waited for) and -1 if
+// the client must be dropped
+int flush_player(Player *p);
+int queue_bytes(Player *p, const char *frame, int len); // already encoded frames
+void free_send_buffer(SendBuffer *sb);
 
 #endif
@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+
+// nimd_sim: plays strategy-vs-strategy games on the headless engine, no sockets, no
+// server. Each thread owns a board and its own random state and reuses both for every
+// game, nothing is shared until the final report. For benchmarking rule and variant
+// changes, and the strategies themselves
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "engine.h"
+
+static struct {
+    long games;
+    int threads;
+    int piles;
+    int level[2]; // strategy of player 1 and player 2
+} opts = { 10000000, 1, STANDARD_PILES, { STRATEGY_LEVELS - 2, STRATEGY_LEVELS - 2 } };
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    long games;
+    uint64_t rng;
+    long moves;
+    long stones;
+    long wins[3]; // by seat
+    long illegal; // moves the engine refused, a strategy bug if ever non-zero
+} SimThread;
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// counters stay in locals until the end, the SimThreads sit next to each other
+static void *sim_main(void *arg){
+    SimThread *t = arg;
+    Board board;
+    memset(&board, 0, sizeof(board));
+    if(!board_init(&board, opts.piles)){
+        perror("board_init");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t rng = t->rng;
+    long moves = 0;
+    long stones = 0;
+    long illegal = 0;
+    long wins[3] = { 0, 0, 0 };
+    for(long g = 0; g < t->games; g++){
+        board_reset(&board);
+        while(!board_over(&board)){
+            int p_num = board.next_p;
+            Move m = strategy_move(&board, opts.level[p_num - 1], &rng);
+            if(board_apply(&board, p_num, m) != MOVE_OK){
+                illegal++;
+                break;
+            }
+            moves++;
+            stones += m.quantity;
+        }
+        wins[board_winner(&board)]++;
+    }
+    board_free(&board);
+
+    t->moves = moves;
+    t->stones = stones;
+    t->illegal = illegal;
+    memcpy(t->wins, wins, sizeof(wins));
+    return NULL;
+}
+
+static void usage(const char *prog){
+    fprintf(stderr, "Usage: %s [-g games] [-T threads] [-b piles] [-1 level] [-2 level]\n"
+            "  levels 0 (random) to %d (perfect), piles 1 to %d\n", prog, STRATEGY_LEVELS - 1, MAX_PILES);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]){
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opts.threads = (cpus > 0) ? (int)cpus : 1;
+
+    int opt;
+    while((opt = getopt(argc, argv, "g:T:b:1:2:")) != -1){
+        switch(opt){
+        case 'g': opts.games = atol(optarg); break;
+        case 'T': opts.threads = atoi(optarg); break;
+        case 'b': opts.piles = atoi(optarg); break;
+        case '1': opts.level[0] = atoi(optarg); break;
+        case '2': opts.level[1] = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if(optind != argc || opts.games <= 0 || opts.threads <= 0 || opts.piles < 1 || opts.piles > MAX_PILES ||
+       opts.level[0] < 0 || opts.level[0] >= STRATEGY_LEVELS || opts.level[1] < 0 || opts.level[1] >= STRATEGY_LEVELS){
+        usage(argv[0]);
+    }
+    strategy_init();
+
+    SimThread *threads = calloc(opts.threads, sizeof(SimThread));
+    if(!threads){
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t start = now_ns();
+    for(int i = 0; i < opts.threads; i++){
+        SimThread *t = &threads[i];
+        t->id = i;
+        t->games = opts.games / opts.threads + (i < opts.games % opts.threads);
+        t->rng = (start ^ 0x9e3779b97f4a7c15ULL * (i + 1)) | 1;
+        if(pthread_create(&t->thread, NULL, sim_main, t) != 0){
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    SimThread total;
+    memset(&total, 0, sizeof(total));
+    for(int i = 0; i < opts.threads; i++){
+        pthread_join(threads[i].thread, NULL);
+        total.games += threads[i].games;
+        total.moves += threads[i].moves;
+        total.stones += threads[i].stones;
+        total.illegal += threads[i].illegal;
+        for(int w = 0; w < 3; w++){
+            total.wins[w] += threads[i].wins[w];
+        }
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    printf("board %d piles, level %d vs %d, %d thread(s)\n", opts.piles, opts.level[0], opts.level[1], opts.threads);
+    printf("games %ld in %.3f s, %.0f games/s, %.0f moves/s\n", total.games, seconds,
+           total.games / seconds, total.moves / seconds);
+    printf("moves_per_game %.2f\n", (double)total.moves / total.games);
+    printf("stones_per_move %.2f\n", total.moves ? (double)total.stones / total.moves : 0.0);
+    printf("first_player_wins %.2f%%\n", 100.0 * total.wins[1] / total.games);
+    printf("second_player_wins %.2f%%\n", 100.0 * total.wins[2] / total.games);
+    if(total.illegal){
+        printf("illegal_moves %ld\n", total.illegal);
+    }
+    free(threads);
+    return total.illegal ? 1 : 0;
+}
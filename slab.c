@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+
+#include "slab.h"
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t heap_allocs = 0;
+static uint64_t heap_frees = 0;
+
+void *counted_malloc(size_t size){
+    __atomic_fetch_add(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+void *counted_calloc(size_t n, size_t size){
+    __atomic_fetch_add(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return calloc(n, size);
+}
+
+void *counted_realloc(void *ptr, size_t size){
+    __atomic_fetch_add(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return realloc(ptr, size);
+}
+
+void counted_free(void *ptr){
+    if(ptr){
+        __atomic_fetch_add(&heap_frees, 1, __ATOMIC_RELAXED);
+    }
+    free(ptr);
+}
+
+HeapStats heap_stats(void){
+    HeapStats st;
+    st.heap_allocs = __atomic_load_n(&heap_allocs, __ATOMIC_RELAXED);
+    st.heap_frees = __atomic_load_n(&heap_frees, __ATOMIC_RELAXED);
+    return st;
+}
+
+static char *slot_ptr(Slab *s, uint32_t index){
+    SlabChunk *c = s->chunks[index / SLAB_CHUNK_OBJS];
+    return (char *)(c + 1) + (size_t)(index % SLAB_CHUNK_OBJS) * s->stride;
+}
+
+static uint32_t *slot_gen(Slab *s, uint32_t index){
+    return &s->chunks[index / SLAB_CHUNK_OBJS]->gen[index % SLAB_CHUNK_OBJS];
+}
+
+static uint32_t *slot_next(Slab *s, uint32_t index){
+    return &s->chunks[index / SLAB_CHUNK_OBJS]->next_free[index % SLAB_CHUNK_OBJS];
+}
+
+// adds one chunk and threads its slots onto the free list, called with the lock held
+static int grow(Slab *s){
+    if(s->chunk_count >= SLAB_MAX_CHUNKS){
+        return -1;
+    }
+    if(s->stride == 0){
+        s->stride = (s->obj_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    }
+
+    size_t bytes = sizeof(SlabChunk) + SLAB_CHUNK_OBJS * s->stride;
+    SlabChunk *c = aligned_alloc(CACHE_LINE, (bytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+    if(!c){
+        return -1;
+    }
+    __atomic_fetch_add(&heap_allocs, 1, __ATOMIC_RELAXED);
+    memset(c, 0, sizeof(SlabChunk));
+
+    uint32_t base = s->chunk_count * SLAB_CHUNK_OBJS;
+    s->chunks[s->chunk_count] = c;
+    __atomic_store_n(&s->chunk_count, s->chunk_count + 1, __ATOMIC_RELEASE); // publish after the pointer
+    for(uint32_t i = SLAB_CHUNK_OBJS; i-- > 0; ){
+        c->next_free[i] = s->free_head;
+        s->free_head = base + i;
+    }
+    return 0;
+}
+
+void *slab_alloc(Slab *s, Handle *out){
+    pthread_mutex_lock(&s->lock);
+    if(s->free_head == UINT32_MAX && grow(s) < 0){
+        pthread_mutex_unlock(&s->lock);
+        return NULL;
+    }
+
+    uint32_t index = s->free_head;
+    s->free_head = *slot_next(s, index);
+    uint32_t gen = *slot_gen(s, index) + 1; // odd: allocated
+    __atomic_store_n(slot_gen(s, index), gen, __ATOMIC_RELEASE);
+    s->allocs++;
+    s->live++;
+    pthread_mutex_unlock(&s->lock);
+
+    char *obj = slot_ptr(s, index);
+    memset(obj, 0, s->obj_size);
+    *out = ((Handle)gen << 32) | (index + 1);
+    return obj;
+}
+
+// splits a handle, false if it cannot name a slot of this pool
+static int decode(Slab *s, Handle h, uint32_t *index, uint32_t *gen){
+    if(h == NULL_HANDLE){
+        return 0;
+    }
+    *index = (uint32_t)(h & 0xffffffffu) - 1;
+    *gen = (uint32_t)(h >> 32);
+    return *index < __atomic_load_n(&s->chunk_count, __ATOMIC_ACQUIRE) * SLAB_CHUNK_OBJS;
+}
+
+void *slab_get(Slab *s, Handle h){
+    uint32_t index, gen;
+    if(!decode(s, h, &index, &gen)){
+        return NULL;
+    }
+    if(__atomic_load_n(slot_gen(s, index), __ATOMIC_ACQUIRE) != gen){
+        __atomic_fetch_add(&s->stale, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    return slot_ptr(s, index);
+}
+
+void slab_free(Slab *s, Handle h){
+    uint32_t index, gen;
+    if(!decode(s, h, &index, &gen)){
+        return;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if(*slot_gen(s, index) != gen){ // double free or stale handle, the slot is not ours
+        s->stale++;
+        pthread_mutex_unlock(&s->lock);
+        fprintf(stderr, "slab %s: free of stale handle %#llx\n", s->name, (unsigned long long)h);
+        return;
+    }
+
+    __atomic_store_n(slot_gen(s, index), gen + 1, __ATOMIC_RELEASE); // even: free
+    *slot_next(s, index) = s->free_head;
+    s->free_head = index;
+    s->frees++;
+    s->live--;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void slab_each(Slab *s, void (*fn)(void *obj, void *ctx), void *ctx){
+    uint32_t slots = __atomic_load_n(&s->chunk_count, __ATOMIC_ACQUIRE) * SLAB_CHUNK_OBJS;
+    for(uint32_t i = 0; i < slots; i++){
+        if(__atomic_load_n(slot_gen(s, i), __ATOMIC_ACQUIRE) & 1){
+            fn(slot_ptr(s, i), ctx);
+        }
+    }
+}
+
+void slab_report(Slab *s, FILE *out){
+    pthread_mutex_lock(&s->lock);
+    fprintf(out, "slab %-6s live=%llu allocs=%llu frees=%llu stale=%llu chunks=%u stride=%zu\n",
+            s->name, (unsigned long long)s->live, (unsigned long long)s->allocs,
+            (unsigned long long)s->frees, (unsigned long long)s->stale,
+            s->chunk_count, s->stride);
+    pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,68 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#define SLAB_CHUNK_OBJS 256   // objects per chunk, one malloc per chunk
+#define SLAB_MAX_CHUNKS 16384 // fixed table so lookups never race a realloc
+#define CACHE_LINE 64
+
+// generation << 32 | (slot index + 1). 0 is never a valid handle. The generation is
+// odd while the slot is allocated and bumped on every alloc and free, so a handle to
+// an object that has been freed (or freed and reused) no longer resolves
+typedef uint64_t Handle;
+#define NULL_HANDLE ((Handle)0)
+
+typedef struct {
+    uint32_t gen[SLAB_CHUNK_OBJS];
+    uint32_t next_free[SLAB_CHUNK_OBJS];
+    // objects follow, each padded to whole cache lines
+} SlabChunk;
+
+// fixed-size object pool with a free list, shared by every shard behind one lock
+typedef struct {
+    const char *name;
+    size_t obj_size;
+    size_t stride; // obj_size rounded up to a whole number of cache lines
+    SlabChunk *chunks[SLAB_MAX_CHUNKS];
+    uint32_t chunk_count;
+    uint32_t free_head; // UINT32_MAX when every slot is in use
+    pthread_mutex_t lock;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t live;
+    uint64_t stale; // frees and lookups that hit a dead handle
+} Slab;
+
+#define SLAB_INIT(type) { .name = #type, .obj_size = sizeof(type), \
+    .free_head = UINT32_MAX, .lock = PTHREAD_MUTEX_INITIALIZER }
+
+// zeroed object, NULL when the pool is exhausted; *out receives its handle
+void *slab_alloc(Slab *s, Handle *out);
+void slab_free(Slab *s, Handle h);
+// the object if h still refers to the same allocation, NULL otherwise
+void *slab_get(Slab *s, Handle h);
+
+// calls fn for every allocated object. Takes no lock, so only while nothing allocates
+// or frees from the pool
+void slab_each(Slab *s, void (*fn)(void *obj, void *ctx), void *ctx);
+
+// every heap allocation the server makes goes through these so steady-state play can
+// be checked for zero mallocs per move
+void *counted_malloc(size_t size);
+void *counted_calloc(size_t n, size_t size);
+void *counted_realloc(void *ptr, size_t size);
+void counted_free(void *ptr);
+
+typedef struct {
+    uint64_t heap_allocs; // malloc/calloc/realloc calls, including slab chunks
+    uint64_t heap_frees;
+} HeapStats;
+
+HeapStats heap_stats(void);
+void slab_report(Slab *s, FILE *out);
+
+#endif
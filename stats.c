@@ -0,0 +1,150 @@
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define MAX_STAT_THREADS 256
+
+// log-linear buckets over ns: 8 per power of two, so a percentile is within 12.5%
+#define HIST_SUB 8
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+typedef struct {
+    uint64_t counters[STAT_COUNTERS];
+    uint64_t fails[FAIL_CODES];
+    Histogram hist[HIST_KINDS];
+} __attribute__((aligned(64))) Stats;
+
+static const char *counter_names[STAT_COUNTERS] = {
+    "connections", "games_started", "games_finished", "forfeits", "timeouts", "bot_games", "games_resumed", "spectator_frames_skipped", "connections_refused", "rate_limited", "moves", "frames", "io_syscalls",
+};
+
+static const char *hist_names[HIST_KINDS] = {
+    "accept_to_open", "queue_wait", "move_dispatch", "frame_parse", "write",
+};
+
+static Stats blocks[MAX_STAT_THREADS];
+static int block_count = 1; // block 0 is the spare
+static pthread_mutex_t attach_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread Stats *mine = &blocks[0];
+
+// single writer per block: a relaxed store of the incremented value is enough for the
+// reader to never see a torn count
+#define BUMP(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+void stats_attach(void){
+    pthread_mutex_lock(&attach_lock);
+    if(block_count < MAX_STAT_THREADS){
+        mine = &blocks[block_count++];
+    }
+    pthread_mutex_unlock(&attach_lock);
+}
+
+uint64_t stats_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_count(int counter){
+    BUMP(mine->counters[counter], 1);
+}
+
+void stats_fail(int code){
+    if(code >= 0 && code < FAIL_CODES){
+        BUMP(mine->fails[code], 1);
+    }
+}
+
+static int bucket_of(uint64_t v){
+    if(v < HIST_SUB){
+        return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - 3; // HIST_SUB == 1 << 3
+    int i = (shift + 1) * HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1));
+    return (i < HIST_BUCKETS) ? i : HIST_BUCKETS - 1;
+}
+
+static uint64_t bucket_value(int i){
+    if(i < HIST_SUB){
+        return i;
+    }
+    return (uint64_t)(HIST_SUB + i % HIST_SUB) << (i / HIST_SUB - 1);
+}
+
+void stats_record(int hist, uint64_t ns){
+    Histogram *h = &mine->hist[hist];
+    BUMP(h->counts[bucket_of(ns)], 1);
+    BUMP(h->total, 1);
+    if(ns > h->max){
+        __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+    }
+}
+
+static uint64_t percentile(const Histogram *h, double pct){
+    if(h->total == 0){
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(h->total * pct / 100.0);
+    uint64_t seen = 0;
+    for(int i = 0; i < HIST_BUCKETS; i++){
+        seen += h->counts[i];
+        if(seen > rank){
+            return bucket_value(i);
+        }
+    }
+    return h->max;
+}
+
+int stats_snapshot(char *buf, int cap){
+    static Stats sum; // only shard 0 takes snapshots
+    memset(&sum, 0, sizeof(sum));
+
+    int threads = __atomic_load_n(&block_count, __ATOMIC_ACQUIRE);
+    for(int t = 0; t < threads; t++){
+        Stats *b = &blocks[t];
+        for(int c = 0; c < STAT_COUNTERS; c++){
+            sum.counters[c] += LOAD(b->counters[c]);
+        }
+        for(int f = 0; f < FAIL_CODES; f++){
+            sum.fails[f] += LOAD(b->fails[f]);
+        }
+        for(int k = 0; k < HIST_KINDS; k++){
+            for(int i = 0; i < HIST_BUCKETS; i++){
+                sum.hist[k].counts[i] += LOAD(b->hist[k].counts[i]);
+            }
+            sum.hist[k].total += LOAD(b->hist[k].total);
+            uint64_t max = LOAD(b->hist[k].max);
+            if(max > sum.hist[k].max){
+                sum.hist[k].max = max;
+            }
+        }
+    }
+
+    int len = 0;
+    for(int c = 0; c < STAT_COUNTERS && len < cap; c++){
+        len += snprintf(buf + len, cap - len, "%s %llu\n", counter_names[c],
+                        (unsigned long long)sum.counters[c]);
+    }
+    for(int f = 0; f < FAIL_CODES && len < cap; f++){
+        if(sum.fails[f]){
+            len += snprintf(buf + len, cap - len, "fail_%02d %llu\n", f, (unsigned long long)sum.fails[f]);
+        }
+    }
+    for(int k = 0; k < HIST_KINDS && len < cap; k++){
+        Histogram *h = &sum.hist[k];
+        len += snprintf(buf + len, cap - len, "%s_us count=%llu p50=%.1f p99=%.1f p999=%.1f max=%.1f\n",
+                        hist_names[k], (unsigned long long)h->total, percentile(h, 50) / 1e3,
+                        percentile(h, 99) / 1e3, percentile(h, 99.9) / 1e3, h->max / 1e3);
+    }
+    return (len < cap) ? len : cap;
+}
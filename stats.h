@@ -0,0 +1,49 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+// counters and latency histograms, one block per thread so recording never takes a
+// lock or shares a cache line. Only the owning thread writes a block; the snapshot
+// reads every block with relaxed loads and sums them
+enum {
+    STAT_CONNECTIONS,
+    STAT_GAMES_STARTED,
+    STAT_GAMES_FINISHED,
+    STAT_FORFEITS,
+    STAT_TIMEOUTS,
+    STAT_BOT_GAMES,
+    STAT_GAMES_RESUMED, // recovered from the journal after a crash
+    STAT_WATCH_SKIPPED, // frames a slow spectator never got
+    STAT_REFUSED, // connections turned away at accept: capacity, address rate or out of fds
+    STAT_RATE_LIMITED, // clients dropped for sending frames too fast
+    STAT_MOVES,
+    STAT_FRAMES,
+    STAT_SYSCALLS, // I/O syscalls on the connection path, to compare the backends
+    STAT_COUNTERS
+};
+
+enum {
+    HIST_ACCEPT_OPEN, // accept() until the OPEN has been handled
+    HIST_QUEUE_WAIT, // joining a match queue until being paired
+    HIST_MOVE_DISPATCH, // handling a parsed MOVE, PLAY/OVER encoded
+    HIST_PARSE, // next_message for one frame
+    HIST_WRITE, // one flush_player with bytes queued
+    HIST_KINDS
+};
+
+#define FAIL_CODES 100
+
+// a thread that never calls stats_attach records into a shared spare block, fine for
+// the single threaded tools linking the handlers
+void stats_attach(void);
+
+uint64_t stats_now(void); // monotonic ns
+void stats_count(int counter);
+void stats_fail(int code);
+void stats_record(int hist, uint64_t ns);
+
+// text snapshot summed over every thread, returns its length
+int stats_snapshot(char *buf, int cap);
+
+#endif
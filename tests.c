@@ -32,8 +32,10 @@ void send_raw(int fd, const char *s) {
     write(fd, s, strlen(s));
 }
 
+// reads "0|NN|" frames and the wide "2|NNNNN|" ones large boards come in, out must
+// hold the body
 int get_msg(int fd, char *out) {
-    char header[5]; 
+    char header[8]; 
     int bytes_read = 0;
 
     while (bytes_read < 2) {
@@ -42,17 +44,20 @@ int get_msg(int fd, char *out) {
         bytes_read += n;
     }
 
-    if (header[0] != '0' || header[1] != '|') return -1;
+    if ((header[0] != '0' && header[0] != '2') || header[1] != '|') return -1;
+    int digits = (header[0] == '2') ? 5 : 2;
 
-    while (bytes_read < 4) {
-        int n = read(fd, header + bytes_read, 4 - bytes_read);
+    while (bytes_read < 2 + digits) {
+        int n = read(fd, header + bytes_read, 2 + digits - bytes_read);
         if (n <= 0) return n;
         bytes_read += n;
     }
 
-    if (!isdigit(header[2]) || !isdigit(header[3])) return -1;
-
-    int msg_len = (header[2]-'0')*10 + (header[3]-'0');
+    int msg_len = 0;
+    for (int i = 2; i < 2 + digits; i++) {
+        if (!isdigit(header[i])) return -1;
+        msg_len = msg_len * 10 + (header[i] - '0');
+    }
 
     char bar;
     if (read(fd, &bar, 1) <= 0) return -1;
@@ -321,6 +326,356 @@ void test_extra_credit() {
     small_delay();
 }
 
+void test_slow_handshake() {
+    printf("\n-- Test: SLOW HANDSHAKE --\n");
+    int slow = connect_client();
+    send_raw(slow, "0|1"); // rest of the OPEN arrives later
+
+    int fd1 = connect_client();
+    int fd2 = connect_client();
+
+    send_raw(fd1, "0|09|OPEN|Kim|");
+    expect_type(fd1, "WAIT");
+
+    send_raw(fd2, "0|09|OPEN|Lee|");
+    expect_type(fd1, "NAME");
+    expect_type(fd2, "NAME");
+    expect_type(fd1, "PLAY");
+    expect_type(fd2, "PLAY");
+
+    send_raw(slow, "4|OPEN|Slowpoke|");
+    expect_type(slow, "WAIT");
+
+    close(slow);
+    close(fd1);
+    close(fd2);
+    small_delay();
+}
+
+void test_pipelined_moves() {
+    printf("\n-- Test: PIPELINED MOVES --\n");
+    int fd1 = connect_client();
+    int fd2 = connect_client();
+
+    send_raw(fd1, "0|09|OPEN|Max|");
+    expect_type(fd1, "WAIT");
+
+    send_raw(fd2, "0|10|OPEN|Nora|");
+    expect_type(fd1, "NAME");
+    expect_type(fd2, "NAME");
+    expect_type(fd1, "PLAY");
+    expect_type(fd2, "PLAY");
+
+    // overflowing quantity, bad pile and a valid move all in one write
+    send_raw(fd1, "0|19|MOVE|1|99999999999|0|10|MOVE|10|1|0|09|MOVE|5|9|");
+    expect_type(fd1, "FAIL");
+    expect_type(fd1, "PLAY");
+    expect_type(fd1, "FAIL");
+    expect_type(fd1, "PLAY");
+    expect_type(fd1, "PLAY");
+    expect_type(fd2, "PLAY");
+
+    close(fd1);
+    expect_type(fd2, "OVER");
+    close(fd2);
+    small_delay();
+}
+
+void test_named_queues() {
+    printf("\n-- Test: NAMED QUEUES --\n");
+    int bad = connect_client();
+    send_raw(bad, "0|13|OPEN|Sam|a!b|");
+    expect_type(bad, "FAIL");
+    close(bad);
+
+    int eu1 = connect_client();
+    int any1 = connect_client();
+    int eu2 = connect_client();
+    int any2 = connect_client();
+
+    send_raw(eu1, "0|12|OPEN|Ola|eu|");
+    expect_type(eu1, "WAIT");
+    send_raw(any1, "0|09|OPEN|Pim|");
+    expect_type(any1, "WAIT"); // different queue, Ola is not a match
+
+    send_raw(eu2, "0|13|OPEN|Quin|eu|");
+    expect_type(eu1, "NAME");
+    expect_type(eu2, "NAME");
+    expect_type(eu1, "PLAY");
+    expect_type(eu2, "PLAY");
+
+    send_raw(any2, "0|09|OPEN|Rey|");
+    expect_type(any1, "NAME");
+    expect_type(any2, "NAME");
+
+    close(eu1);
+    close(eu2);
+    close(any1);
+    close(any2);
+    small_delay();
+
+    // a queue gives its slot back once nobody is in it, so more made up tags than
+    // there are slots one after the other all still get a queue
+    for (int i = 0; i < 80; i++) {
+        char body[64], frame[BUF], reply[BUF];
+        int fd = connect_client();
+        int len = snprintf(body, sizeof(body), "OPEN|Tag%d|t%d|", i, i);
+        snprintf(frame, BUF, "0|%02d|%s", len, body);
+        send_raw(fd, frame);
+        if (get_msg(fd, reply) <= 0 || strcmp(reply, "WAIT|") != 0) {
+            printf("Expected WAIT for queue t%d\n", i);
+            exit(1);
+        }
+        close(fd);
+        usleep(5 * 1000);
+    }
+    printf("80 queues in a row all got WAIT\n");
+    small_delay();
+}
+
+void test_board_variant() {
+    printf("\n-- Test: BOARD VARIANT --\n");
+    int fd1 = connect_client();
+    int fd2 = connect_client();
+
+    send_raw(fd1, "0|12|OPEN|Uma|B2|");
+    expect_type(fd1, "WAIT");
+
+    send_raw(fd2, "0|12|OPEN|Vic|B2|");
+    expect_type(fd1, "NAME");
+    expect_type(fd2, "NAME");
+    expect_type(fd1, "PLAY|1|1 3|");
+    expect_type(fd2, "PLAY|1|1 3|");
+
+    send_raw(fd1, "0|09|MOVE|3|1|"); // only two piles on this board
+    expect_type(fd1, "FAIL");
+    expect_type(fd1, "PLAY");
+
+    send_raw(fd1, "0|09|MOVE|2|3|"); expect_type(fd1, "PLAY|2|1 0|"); expect_type(fd2, "PLAY");
+    send_raw(fd2, "0|09|MOVE|1|1|"); expect_type(fd1, "OVER|2|0 0|"); expect_type(fd2, "OVER");
+
+    close(fd1);
+    close(fd2);
+    small_delay();
+}
+
+// the largest board there is: its PLAY and OVER outgrow "0|NN|" and come as wide frames
+void test_large_board() {
+    printf("\n-- Test: LARGE BOARD --\n");
+    static char buf[32 * 1024];
+    int fd1 = connect_client();
+    int fd2 = connect_client();
+
+    send_raw(fd1, "0|15|OPEN|Wes|B4096|");
+    expect_type(fd1, "WAIT");
+    send_raw(fd2, "0|15|OPEN|Xia|B4096|");
+    expect_type(fd1, "NAME");
+    expect_type(fd2, "NAME");
+
+    int n = get_msg(fd1, buf);
+    int piles = 0;
+    int last = 0;
+    if (n > 99 && strncmp(buf, "PLAY|1|", 7) == 0) {
+        for (char *s = buf + 7; *s && *s != '|'; piles++) {
+            last = strtol(s, &s, 10);
+            if (*s == ' ') s++;
+        }
+    }
+    if (piles != 4096 || last != 8191) {
+        printf("Expected a wide PLAY with 4096 piles up to 8191, got %d bytes, %d piles ending in %d\n", n, piles, last);
+        exit(1);
+    }
+    printf("Got a %d byte PLAY with %d piles\n", n, piles);
+
+    close(fd1); // the forfeit OVER is the longest frame a board can produce
+    n = get_msg(fd2, buf); // PLAY
+    n = get_msg(fd2, buf);
+    if (n <= 0 || strncmp(buf, "OVER|2|1 3 5 ", 13) != 0 || strcmp(buf + n - 9, "|Forfeit|") != 0) {
+        printf("Expected a wide OVER ending in Forfeit, got %d bytes\n", n);
+        exit(1);
+    }
+    printf("Got a %d byte OVER\n", n);
+
+    close(fd2);
+    small_delay();
+}
+
+// protocol version 1 frames: '1', type code, big-endian body length, fixed-width body
+void send_binary(int fd, int type, const char *body, int len) {
+    char frame[128];
+    frame[0] = '1';
+    frame[1] = type;
+    frame[2] = len >> 8;
+    frame[3] = len & 0xff;
+    memcpy(frame + 4, body, len);
+    write(fd, frame, 4 + len);
+}
+
+// reads one binary frame, returns its type code and leaves the body in out
+int get_binary(int fd, unsigned char *out, int *len) {
+    unsigned char header[4];
+    int got = 0;
+    while (got < 4) {
+        int n = read(fd, header + got, 4 - got);
+        if (n <= 0) return -1;
+        got += n;
+    }
+    if (header[0] != '1') return -1;
+    *len = (header[2] << 8) | header[3];
+    got = 0;
+    while (got < *len) {
+        int n = read(fd, out + got, *len - got);
+        if (n <= 0) return -1;
+        got += n;
+    }
+    return header[1];
+}
+
+void expect_binary(int fd, int type, const char *what, const unsigned char *body, int len) {
+    unsigned char buf[BUF];
+    int got_len;
+    int got = get_binary(fd, buf, &got_len);
+    if (got != type || (body && (got_len != len || memcmp(buf, body, len) != 0))) {
+        printf("Expected binary %s but got type %d, %d bytes\n", what, got, got_len);
+        exit(1);
+    }
+    printf("Got binary %s\n", what);
+}
+
+void test_binary_protocol() {
+    printf("\n-- Test: BINARY PROTOCOL --\n");
+    int bin = connect_client();
+    int txt = connect_client();
+
+    char open[90];
+    memset(open, 0, sizeof(open));
+    strcpy(open, "Bina");
+    send_binary(bin, 1, open, sizeof(open));
+    expect_binary(bin, 2, "WAIT", NULL, 0);
+
+    send_raw(txt, "0|09|OPEN|Tex|");
+    expect_binary(bin, 3, "NAME", NULL, 0);
+    const unsigned char start[] = { 1, 0, 0, 5, 0, 1, 0, 3, 0, 5, 0, 7, 0, 9 };
+    expect_binary(bin, 4, "PLAY 1 3 5 7 9", start, sizeof(start));
+    expect_type(txt, "NAME|2|Bina|");
+    expect_type(txt, "PLAY|1|1 3 5 7 9|");
+
+    const char bad_move[] = { 0, 0, 0, 6, 0, 0, 0, 1 }; // pile 6 of 5
+    send_binary(bin, 5, bad_move, sizeof(bad_move));
+    const unsigned char pile_index[] = { 0, 32 };
+    expect_binary(bin, 7, "FAIL 32", pile_index, sizeof(pile_index));
+    expect_binary(bin, 4, "PLAY", NULL, 0);
+
+    const char move[] = { 0, 0, 0, 5, 0, 0, 0, 9 };
+    send_binary(bin, 5, move, sizeof(move));
+    expect_type(txt, "PLAY|2|1 3 5 7 0|");
+    const unsigned char after[] = { 2, 0, 0, 5, 0, 1, 0, 3, 0, 5, 0, 7, 0, 0 };
+    expect_binary(bin, 4, "PLAY 1 3 5 7 0", after, sizeof(after));
+
+    close(txt); // forfeit, the binary client is told it won
+    const unsigned char over[] = { 1, 1, 0, 5, 0, 1, 0, 3, 0, 5, 0, 7, 0, 0 };
+    expect_binary(bin, 6, "OVER forfeit", over, sizeof(over));
+
+    close(bin);
+    small_delay();
+}
+
+void test_spectators() {
+    printf("\n-- Test: SPECTATORS --\n");
+    int nobody = connect_client();
+    send_raw(nobody, "0|13|WATCH|Nobody|");
+    expect_type(nobody, "FAIL|25 Not Found|");
+    close(nobody);
+
+    int fd1 = connect_client();
+    int fd2 = connect_client();
+    send_raw(fd1, "0|12|OPEN|Wes|B2|");
+    expect_type(fd1, "WAIT");
+    send_raw(fd2, "0|12|OPEN|Zed|B2|");
+    expect_type(fd1, "NAME");
+    expect_type(fd2, "NAME");
+    expect_type(fd1, "PLAY|1|1 3|");
+    expect_type(fd2, "PLAY|1|1 3|");
+
+    int txt = connect_client();
+    int bin = connect_client();
+    send_raw(txt, "0|10|WATCH|Zed|");
+    expect_type(txt, "PLAY|1|1 3|");
+    char watch[73];
+    memset(watch, 0, sizeof(watch));
+    strcpy(watch, "Wes");
+    send_binary(bin, 8, watch, sizeof(watch));
+    const unsigned char start[] = { 1, 0, 0, 2, 0, 1, 0, 3 };
+    expect_binary(bin, 4, "PLAY 1 3", start, sizeof(start));
+
+    send_raw(fd1, "0|09|MOVE|2|3|");
+    expect_type(fd2, "PLAY|2|1 0|");
+    expect_type(txt, "PLAY|2|1 0|");
+    const unsigned char after[] = { 2, 0, 0, 2, 0, 1, 0, 0 };
+    expect_binary(bin, 4, "PLAY 1 0", after, sizeof(after));
+
+    send_raw(fd2, "0|09|MOVE|1|1|");
+    expect_type(txt, "OVER|2|0 0||");
+    const unsigned char over[] = { 2, 0, 0, 2, 0, 0, 0, 0 };
+    expect_binary(bin, 6, "OVER", over, sizeof(over));
+    char buf[BUF];
+    if (get_msg(txt, buf) != 0) {
+        printf("Expected the spectator to be closed after OVER\n");
+        exit(1);
+    }
+    printf("Spectator closed after OVER\n");
+
+    close(txt);
+    close(bin);
+    close(fd1);
+    close(fd2);
+    small_delay();
+}
+
+void test_rate_limit() {
+    printf("\n-- Test: RATE LIMIT --\n");
+    int fd = connect_client();
+    send_raw(fd, "0|17|OPEN|Flood|flood|");
+    expect_type(fd, "WAIT");
+
+    // far more MOVEs than the default burst of 100 frames, in one write
+    char flood[150 * 14 + 1];
+    flood[0] = '\0';
+    for (int i = 0; i < 150; i++) {
+        strcat(flood, "0|09|MOVE|1|1|");
+    }
+    send_raw(fd, flood);
+
+    char buf[BUF];
+    char last[BUF] = "";
+    int fails = 0;
+    while (get_msg(fd, buf) > 0) {
+        strcpy(last, buf);
+        fails++;
+    }
+    if (strcmp(last, "FAIL|52 Rate Limited|") != 0 || fails >= 150) {
+        printf("Expected FAIL 52 Rate Limited and a close, got %d frames ending in: %s\n", fails, last);
+        exit(1);
+    }
+    printf("Got %d FAILs, the last: %s\n", fails, last);
+    close(fd);
+
+    // a well-behaved pair right after still plays
+    int fd1 = connect_client();
+    int fd2 = connect_client();
+    send_raw(fd1, "0|13|OPEN|Calm|B1|");
+    expect_type(fd1, "WAIT");
+    send_raw(fd2, "0|14|OPEN|Quiet|B1|");
+    expect_type(fd1, "NAME");
+    expect_type(fd2, "NAME");
+    expect_type(fd1, "PLAY");
+    send_raw(fd1, "0|09|MOVE|1|1|");
+    expect_type(fd1, "OVER|1|");
+    close(fd1);
+    close(fd2);
+    small_delay();
+}
+
 int main() {
     printf("NIMD TEST\n");
     test_bad_format();
@@ -332,6 +687,14 @@ int main() {
     test_disconnect_during_game();
     test_concurrent_and_duplicate();
     test_extra_credit();
+    test_slow_handshake();
+    test_pipelined_moves();
+    test_named_queues();
+    test_board_variant();
+    test_binary_protocol();
+    test_spectators();
+    test_rate_limit();
+    test_large_board();
 
     printf("\nTESTING COMPLETE\n");
     return 0;
@@ -0,0 +1,152 @@
+#include "timer.h"
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+
+static void list_init(Timer *head){
+    head->prev = head;
+    head->next = head;
+}
+
+static bool list_empty(const Timer *head){
+    return head->next == head;
+}
+
+static void list_push(Timer *head, Timer *t){
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void list_unlink(Timer *t){
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = NULL;
+    t->next = NULL;
+}
+
+void timer_wheel_init(TimerWheel *w, uint64_t now_ms){
+    for(int l = 0; l < WHEEL_LEVELS; l++){
+        for(int s = 0; s < WHEEL_SLOTS; s++){
+            list_init(&w->slots[l][s]);
+        }
+    }
+    w->now = now_ms / TIMER_TICK_MS;
+    w->armed = 0;
+}
+
+// the level is picked by how far away the expiry is, the slot by the expiry's own
+// bits at that level, so a cascade lands it exactly one level lower
+static void place(TimerWheel *w, Timer *t){
+    uint64_t delta = (t->expires > w->now) ? t->expires - w->now : 1;
+    int level = 0;
+    while(level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))){
+        level++;
+    }
+
+    uint64_t expires = t->expires;
+    if(level == WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * WHEEL_LEVELS))){
+        // past the last level's span: park it as far out as the wheel reaches, it is
+        // placed again when that slot cascades
+        expires = w->now + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    int slot = (int)((expires >> (WHEEL_BITS * level)) & SLOT_MASK);
+    list_push(&w->slots[level][slot], t);
+}
+
+bool timer_armed(const Timer *t){
+    return t->next != NULL;
+}
+
+void timer_arm(TimerWheel *w, Timer *t, uint64_t delay_ms, void (*fire)(Timer *t)){
+    if(timer_armed(t)){
+        list_unlink(t);
+    }else{
+        w->armed++;
+    }
+    // now is the tick already under way, counting from the next one means a timer is
+    // never early
+    uint64_t ticks = (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    t->expires = w->now + ticks + 1;
+    t->fire = fire;
+    place(w, t);
+}
+
+void timer_cancel(TimerWheel *w, Timer *t){
+    if(timer_armed(t)){
+        list_unlink(t);
+        w->armed--;
+    }
+}
+
+int timer_next_ms(const TimerWheel *w){
+    if(w->armed == 0){
+        return -1;
+    }
+    // anything due within level 0's span sits there; otherwise the next cascade
+    // (when level 0 wraps) is the earliest the wheel can have work
+    for(int i = 1; i <= WHEEL_SLOTS; i++){
+        uint64_t tick = w->now + i;
+        if(!list_empty(&w->slots[0][tick & SLOT_MASK]) || (tick & SLOT_MASK) == 0){
+            return i * TIMER_TICK_MS;
+        }
+    }
+    return WHEEL_SLOTS * TIMER_TICK_MS;
+}
+
+// moves every timer of one upper slot down, they all expire within the level below
+static void cascade(TimerWheel *w, int level){
+    Timer *head = &w->slots[level][(w->now >> (WHEEL_BITS * level)) & SLOT_MASK];
+    Timer moving;
+    list_init(&moving);
+    if(list_empty(head)){
+        return;
+    }
+    moving.next = head->next;
+    moving.prev = head->prev;
+    moving.next->prev = &moving;
+    moving.prev->next = &moving;
+    list_init(head);
+
+    while(!list_empty(&moving)){
+        Timer *t = moving.next;
+        list_unlink(t);
+        place(w, t);
+    }
+}
+
+void timer_advance(TimerWheel *w, uint64_t now_ms){
+    uint64_t target = now_ms / TIMER_TICK_MS;
+    if(w->armed == 0){
+        w->now = (target > w->now) ? target : w->now;
+        return;
+    }
+
+    while(w->now < target){
+        w->now++;
+        for(int level = 1; level < WHEEL_LEVELS; level++){
+            if((w->now & ((1ULL << (WHEEL_BITS * level)) - 1)) != 0){
+                break;
+            }
+            cascade(w, level);
+        }
+
+        Timer *head = &w->slots[0][w->now & SLOT_MASK];
+        if(list_empty(head)){
+            continue;
+        }
+        // detach the slot first, a callback may cancel or re-arm any timer in it
+        Timer due;
+        due.next = head->next;
+        due.prev = head->prev;
+        due.next->prev = &due;
+        due.prev->next = &due;
+        list_init(head);
+        while(!list_empty(&due)){
+            Timer *t = due.next;
+            list_unlink(t);
+            w->armed--;
+            t->fire(t);
+        }
+    }
+}
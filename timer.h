@@ -0,0 +1,45 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// hierarchical timing wheel, one per shard and only touched by its thread. Level 0
+// has one slot per tick, each level above covers 64 times the span of the one below
+// (0.64s, 41s, 44min, 47h), timers further out wait in the last level. Arming and
+// cancelling are O(1) list operations, a timer is moved down at most once per level
+#define TIMER_TICK_MS 10
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+
+// embedded in the object it belongs to, fire() recovers the owner with container_of
+typedef struct Timer {
+    struct Timer *prev;
+    struct Timer *next; // NULL while not armed
+    uint64_t expires; // tick
+    void (*fire)(struct Timer *t);
+} Timer;
+
+typedef struct {
+    Timer slots[WHEEL_LEVELS][WHEEL_SLOTS]; // sentinels of circular lists
+    uint64_t now; // last tick processed
+    int armed;
+} TimerWheel;
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+void timer_wheel_init(TimerWheel *w, uint64_t now_ms);
+
+// (re)arms t to fire delay_ms from now; never early, a tick or two late at most
+void timer_arm(TimerWheel *w, Timer *t, uint64_t delay_ms, void (*fire)(Timer *t));
+void timer_cancel(TimerWheel *w, Timer *t);
+bool timer_armed(const Timer *t);
+
+// ms until the wheel next needs advancing, -1 if nothing is armed
+int timer_next_ms(const TimerWheel *w);
+// fires everything due by now_ms; callbacks may arm and cancel freely
+void timer_advance(TimerWheel *w, uint64_t now_ms);
+
+#endif
@@ -0,0 +1,561 @@
+#define _GNU_SOURCE
+
+#include "upgrade.h"
+#include "handlers.h"
+#include "match.h"
+#include "journal.h"
+#include "bot.h"
+#include "config.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define UPGRADE_ENV "NIMD_UPGRADE_FD"
+#define UPGRADE_FD 3 // where the new process finds its socket to the old one
+#define UPGRADE_TX_MAX 4096 // unsent bytes per message, UP_TX messages carry the rest
+
+// everything besides the fd needed to rebuild a Player, the timers start afresh
+typedef struct {
+    char name[73];
+    char queue[MATCH_TAG_LEN + 1]; // tag of the match queue its OPEN named
+    int board;
+    bool binary;
+    bool open;
+    uint64_t accepted_at; // stats_now() values, CLOCK_MONOTONIC is the same for both processes
+    uint64_t wait_start;
+    int rx_len;
+    int tx_len;
+    char rx[RECV_BUF_SIZE]; // received and not handled yet
+    char tx[UPGRADE_TX_MAX]; // queued and not sent yet, the start of it if there is more
+} UpgradePlayer;
+
+typedef struct {
+    int type;
+    int shard;
+    int count; // fds attached
+    int seat; // UP_TX: 0 for the player (or p1) of the message before, 1 for its p2
+    bool waited;
+    bool bot; // UP_GAME and UP_SUSPENDED: the second seat is the bot's
+    uint64_t id; // journal id of the game
+    uint64_t active; // UP_SUSPENDED: time of its last move
+    int next_p;
+    int pile_count;
+    UpgradePlayer players[2];
+    int piles[MAX_PILES]; // only pile_count of them go over the socket
+} UpgradeMsg;
+
+extern char **environ;
+
+static char **saved_argv = NULL;
+static int channel = -1;
+static int starting_fd = -1; // the new process's socket until it is ready
+static pid_t starting_pid = -1;
+static bool inherited = false;
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void upgrade_init(char *argv[]){
+    saved_argv = argv;
+    const char *fd = getenv(UPGRADE_ENV);
+    if(!fd){
+        return;
+    }
+    unsetenv(UPGRADE_ENV); // not for this process's own children
+    channel = atoi(fd);
+    if(channel < 0 || fcntl(channel, F_SETFD, FD_CLOEXEC) < 0){
+        fprintf(stderr, "%s=%s is not a socket to the previous process\n", UPGRADE_ENV, fd);
+        exit(EXIT_FAILURE);
+    }
+    inherited = true;
+}
+
+bool upgrade_inherited(void){
+    return inherited;
+}
+
+// where execvp would find argv[0], looked up before the fork since the search
+// allocates. The caller frees it
+static char *find_binary(const char *name){
+    if(strchr(name, '/')){
+        return strdup(name);
+    }
+    const char *path = getenv("PATH");
+    for(const char *dir = path ? path : "/usr/bin:/bin"; ; ){
+        const char *end = strchrnul(dir, ':');
+        char *candidate;
+        if(asprintf(&candidate, "%.*s/%s", (int)(end - dir), (end == dir) ? "." : dir, name) < 0){
+            return NULL;
+        }
+        struct stat st;
+        if(stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0){
+            return candidate;
+        }
+        free(candidate);
+        if(*end == '\0'){
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+// this process's environment plus UPGRADE_ENV, built before the fork so the child
+// only has to call execve. The caller frees the array, not the strings
+static char **upgrade_environment(void){
+    static char fd_entry[32];
+    snprintf(fd_entry, sizeof(fd_entry), "%s=%d", UPGRADE_ENV, UPGRADE_FD);
+    int count = 0;
+    while(environ[count]){
+        count++;
+    }
+    char **env = malloc((count + 2) * sizeof(char *));
+    if(!env){
+        return NULL;
+    }
+    int n = 0;
+    for(int i = 0; i < count; i++){
+        if(strncmp(environ[i], UPGRADE_ENV "=", strlen(UPGRADE_ENV) + 1) != 0){
+            env[n++] = environ[i];
+        }
+    }
+    env[n++] = fd_entry;
+    env[n] = NULL;
+    return env;
+}
+
+int upgrade_spawn(void){
+    if(starting_fd >= 0){
+        return -1;
+    }
+    char *binary = find_binary(saved_argv[0]);
+    char **env = upgrade_environment();
+    int sv[2];
+    if(!binary || !env || socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0){
+        log_text(LOG_WARN, "Cannot start %s, upgrade abandoned", saved_argv[0]);
+        free(binary);
+        free(env);
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0){
+        // only stdio and the socket survive the exec, which dup2 clears close-on-exec on.
+        // Nothing here allocates or takes a lock, another thread may have held one
+        if(sv[1] == UPGRADE_FD ? fcntl(UPGRADE_FD, F_SETFD, 0) < 0 : dup2(sv[1], UPGRADE_FD) < 0){
+            _exit(127);
+        }
+        close_range(UPGRADE_FD + 1, ~0U, 0);
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        execve(binary, saved_argv, env);
+        _exit(127);
+    }
+    free(binary);
+    free(env);
+    close(sv[1]);
+    if(pid < 0){
+        perror("fork");
+        close(sv[0]);
+        return -1;
+    }
+    starting_fd = sv[0];
+    starting_pid = pid;
+    return starting_fd;
+}
+
+// the new binary says when it has its config, journal and workers, a broken one
+// (or one that cannot be executed) leaves this process serving as before
+bool upgrade_ready(void){
+    char ready;
+    if(recv(starting_fd, &ready, 1, MSG_DONTWAIT) != 1){
+        upgrade_abandon();
+        return false;
+    }
+    log_text(LOG_WARN, "Handing every connection over to new process %d", (int)starting_pid);
+    channel = starting_fd;
+    starting_fd = -1;
+    starting_pid = -1;
+    return true;
+}
+
+void upgrade_abandon(void){
+    log_text(LOG_WARN, "New process %d did not start, upgrade abandoned", (int)starting_pid);
+    kill(starting_pid, SIGKILL);
+    waitpid(starting_pid, NULL, 0); // unless the SIGCHLD handling has reaped it already
+    close(starting_fd);
+    starting_fd = -1;
+    starting_pid = -1;
+}
+
+// the piles are the only variable part, the message is cut short after pile_count.
+// Called with send_lock held, which also guards the one message every shard packs into
+static bool send_msg(UpgradeMsg *msg, const int *fds){
+    struct iovec iov = { .iov_base = msg, .iov_len = offsetof(UpgradeMsg, piles) + msg->pile_count * sizeof(int) };
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if(msg->count > 0){
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(msg->count * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(msg->count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, msg->count * sizeof(int));
+    }
+
+    ssize_t sent = sendmsg(channel, &mh, MSG_NOSIGNAL);
+    if(sent != (ssize_t)iov.iov_len){
+        perror("upgrade sendmsg");
+        return false;
+    }
+    return true;
+}
+
+static bool pack_player(UpgradePlayer *up, Player *p){
+    flush_player(p);
+    int pending = p->tx.end - p->tx.start;
+    if(pending > UPGRADE_TX_MAX){
+        pending = UPGRADE_TX_MAX; // send_tx_rest sends the others
+    }
+
+    strcpy(up->name, p->name);
+    if(p->open){
+        strcpy(up->queue, match_queue_tag(p->queue));
+    }
+    up->board = p->board;
+    up->binary = p->binary;
+    up->open = p->open;
+    up->accepted_at = p->accepted_at;
+    up->wait_start = p->wait_start;
+    up->tx_len = pending;
+    memcpy(up->tx, p->tx.data + p->tx.start, pending);
+    up->rx_len = p->rx.end - p->rx.start;
+    memcpy(up->rx, p->rx.data + p->rx.start, up->rx_len);
+    return true;
+}
+
+// takes send_lock, the matching unlock comes once the message is sent
+static UpgradeMsg *new_msg(int type, int shard){
+    static UpgradeMsg msg; // too big for a shard's stack
+    pthread_mutex_lock(&send_lock);
+    memset(&msg, 0, offsetof(UpgradeMsg, piles));
+    msg.type = type;
+    msg.shard = shard;
+    return &msg;
+}
+
+// the unsent bytes of seat past what its message carried, in UP_TX messages right
+// behind it. Reuses msg, which has gone out by now
+static bool send_tx_rest(UpgradeMsg *msg, Player *p, int seat){
+    if(!p){
+        return true;
+    }
+    for(int offset = p->tx.start + UPGRADE_TX_MAX; offset < p->tx.end; offset += UPGRADE_TX_MAX){
+        int len = p->tx.end - offset;
+        if(len > UPGRADE_TX_MAX){
+            len = UPGRADE_TX_MAX;
+        }
+        memset(msg, 0, offsetof(UpgradeMsg, piles));
+        msg->type = UP_TX;
+        msg->seat = seat;
+        msg->players[0].tx_len = len;
+        memcpy(msg->players[0].tx, p->tx.data + offset, len);
+        if(!send_msg(msg, NULL)){
+            return false;
+        }
+    }
+    return true;
+}
+
+// p1 and p2 are the players packed into msg, if any, for the output that did not fit
+static bool send_and_unlock(UpgradeMsg *msg, const int *fds, bool packed, Player *p1, Player *p2){
+    bool sent = packed && send_msg(msg, fds) && send_tx_rest(msg, p1, 0) && send_tx_rest(msg, p2, 1);
+    pthread_mutex_unlock(&send_lock);
+    return sent;
+}
+
+bool upgrade_send_listener(int fd, int shard){
+    UpgradeMsg *msg = new_msg(UP_LISTENER, shard);
+    msg->count = 1;
+    return send_and_unlock(msg, &fd, true, NULL, NULL);
+}
+
+bool upgrade_send_player(int type, Player *p, bool waited, int shard){
+    UpgradeMsg *msg = new_msg(type, shard);
+    msg->count = 1;
+    msg->waited = waited;
+    return send_and_unlock(msg, &p->fd, pack_player(&msg->players[0], p), p, NULL);
+}
+
+bool upgrade_send_spectator(Player *p, const char *watched, int shard){
+    UpgradeMsg *msg = new_msg(UP_SPECTATOR, shard);
+    msg->count = 1;
+    bool packed = pack_player(&msg->players[0], p);
+    snprintf(msg->players[0].name, sizeof(msg->players[0].name), "%s", watched);
+    return send_and_unlock(msg, &p->fd, packed, p, NULL);
+}
+
+bool upgrade_send_game(Game *g, int shard){
+    UpgradeMsg *msg = new_msg(UP_GAME, shard);
+    bool packed = pack_player(&msg->players[0], g->p1) && pack_player(&msg->players[1], g->p2);
+    msg->bot = g->p2->bot;
+    msg->count = msg->bot ? 1 : 2;
+    msg->id = g->journal_id;
+    msg->next_p = g->board.next_p;
+    msg->pile_count = g->board.pile_count;
+    memcpy(msg->piles, g->board.piles, g->board.pile_count * sizeof(int));
+    int fds[2] = { g->p1->fd, g->p2->fd };
+    return send_and_unlock(msg, fds, packed, g->p1, msg->bot ? NULL : g->p2);
+}
+
+bool upgrade_send_suspended(const SuspendedGame *s){
+    UpgradeMsg *msg = new_msg(UP_SUSPENDED, 0);
+    strcpy(msg->players[0].name, s->names[0]);
+    strcpy(msg->players[1].name, s->names[1]);
+    msg->bot = s->bot;
+    msg->id = s->id;
+    msg->active = s->active;
+    msg->next_p = s->next_p;
+    msg->pile_count = s->pile_count;
+    memcpy(msg->piles, s->piles, s->pile_count * sizeof(int));
+    return send_and_unlock(msg, NULL, true, NULL, NULL);
+}
+
+void upgrade_finish(void){
+    send_and_unlock(new_msg(UP_END, 0), NULL, true, NULL, NULL);
+    close(channel);
+    channel = -1;
+}
+
+static Player *unpack_player(const UpgradePlayer *up, int fd){
+    Player *p = new_player();
+    if(!p){
+        return NULL;
+    }
+
+    p->fd = fd;
+    strcpy(p->name, up->name);
+    p->open = up->open;
+    p->queue = up->open ? match_queue_id(up->queue) : 0;
+    if(p->queue < 0){ // every queue taken by the time this one came across
+        p->queue = 0;
+    }
+    p->board = up->board;
+    p->binary = up->binary;
+    p->accepted_at = up->accepted_at;
+    p->wait_start = up->wait_start;
+    memcpy(p->rx.data, up->rx, up->rx_len);
+    p->rx.end = up->rx_len;
+    if(up->tx_len > 0){
+        queue_bytes(p, up->tx, up->tx_len);
+    }
+    return p;
+}
+
+static Game *unpack_game(const UpgradeMsg *msg, const int *fds){
+    Player *p1 = unpack_player(&msg->players[0], fds[0]);
+    Player *p2 = msg->bot ? bot_new() : unpack_player(&msg->players[1], fds[1]);
+    Game *g = (p1 && p2) ? new_game() : NULL;
+    if(!g || msg->pile_count != p1->board || !create_game(g, p1, p2)){
+        if(g){
+            delete_game(g);
+        }
+        if(p1){
+            delete_player(p1);
+        }
+        if(p2){
+            delete_player(p2);
+        }
+        return NULL;
+    }
+    if(msg->bot && config.bot_wait <= 0){
+        bot_init(); // started with the bot off, its game still needs the tablebase
+    }
+
+    board_restore(&g->board, msg->piles, msg->next_p);
+    g->journal_id = msg->id;
+    p1->p_num = 1;
+    p2->p_num = 2;
+    p1->game = g;
+    p2->game = g;
+    return g;
+}
+
+static SuspendedGame *unpack_suspended(const UpgradeMsg *msg){
+    SuspendedGame *s = counted_calloc(1, sizeof(SuspendedGame));
+    int *piles = counted_malloc(msg->pile_count * sizeof(int));
+    if(!s || !piles){
+        counted_free(s);
+        counted_free(piles);
+        return NULL;
+    }
+    s->id = msg->id;
+    s->active = msg->active;
+    strcpy(s->names[0], msg->players[0].name);
+    strcpy(s->names[1], msg->players[1].name);
+    s->pile_count = msg->pile_count;
+    s->next_p = msg->next_p;
+    s->piles = piles;
+    memcpy(piles, msg->piles, msg->pile_count * sizeof(int));
+    s->bot = msg->bot;
+    return s;
+}
+
+// one message and its fds, false once the old process is done or gone
+static bool receive_msg(UpgradeMsg *msg, int fds[2], bool *valid){
+    struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    ssize_t n = recvmsg(channel, &mh, MSG_CMSG_CLOEXEC);
+    if(n < 0 && errno == EINTR){
+        *valid = false;
+        return true;
+    }
+    if(n <= 0){
+        fprintf(stderr, "previous process went away before handing everything over\n");
+        return false;
+    }
+
+    int got = 0;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+        got = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), got * sizeof(int));
+    }
+    *valid = n >= (ssize_t)offsetof(UpgradeMsg, piles) && msg->pile_count >= 0 && msg->pile_count <= MAX_PILES &&
+             n == (ssize_t)(offsetof(UpgradeMsg, piles) + msg->pile_count * sizeof(int)) &&
+             got == msg->count && got <= 2;
+    for(int i = 0; i < 2 && *valid; i++){
+        const UpgradePlayer *up = &msg->players[i];
+        *valid = up->rx_len >= 0 && up->rx_len <= RECV_BUF_SIZE && up->tx_len >= 0 && up->tx_len <= UPGRADE_TX_MAX;
+    }
+    if(!*valid){
+        fprintf(stderr, "malformed upgrade message from the previous process\n");
+        for(int i = 0; i < got && i < 2; i++){
+            close(fds[i]);
+        }
+    }
+    return !*valid || msg->type != UP_END;
+}
+
+int upgrade_receive(int *listen_fds, int max, UpgradeItem **items){
+    static UpgradeMsg msg;
+    int listeners = 0;
+    int connections = 0;
+    int games = 0;
+    SuspendedGame *suspended = NULL;
+    *items = NULL;
+
+    if(send(channel, "R", 1, MSG_NOSIGNAL) != 1){
+        perror("upgrade ready");
+        exit(EXIT_FAILURE);
+    }
+
+    int fds[2];
+    bool valid;
+    UpgradeItem *last = NULL; // what UP_TX messages add to
+    while(receive_msg(&msg, fds, &valid)){
+        if(!valid){
+            last = NULL;
+            continue;
+        }
+        if(msg.type == UP_TX){
+            Player *p = NULL;
+            if(last){
+                p = !last->game ? last->player : (msg.seat == 0) ? last->game->p1 : last->game->p2;
+            }
+            if(p){
+                queue_bytes(p, msg.players[0].tx, msg.players[0].tx_len);
+            }
+            continue;
+        }
+        last = NULL;
+        if(msg.type == UP_LISTENER){
+            if(listeners < max){
+                listen_fds[listeners++] = fds[0];
+            }else{
+                close(fds[0]); // the previous run had more shards, what is queued on it is lost
+            }
+            continue;
+        }
+        if(msg.type == UP_SUSPENDED){
+            SuspendedGame *s = unpack_suspended(&msg);
+            if(s){
+                s->next = suspended;
+                suspended = s;
+            }
+            continue;
+        }
+
+        UpgradeItem *item = counted_calloc(1, sizeof(UpgradeItem));
+        if(item && msg.type == UP_GAME){
+            item->game = unpack_game(&msg, fds);
+        }else if(item){
+            item->player = unpack_player(&msg.players[0], fds[0]);
+        }
+        if(!item || (!item->game && !item->player)){
+            fprintf(stderr, "out of memory taking over from the previous process\n");
+            for(int i = 0; i < msg.count; i++){
+                close(fds[i]);
+            }
+            counted_free(item);
+            continue;
+        }
+        item->type = msg.type;
+        item->shard = msg.shard;
+        item->waited = msg.waited;
+        item->next = *items;
+        *items = item;
+        last = item;
+        connections += msg.count;
+        games += (msg.type == UP_GAME);
+    }
+    close(channel);
+    channel = -1;
+
+    // names are taken again before anyone new can OPEN, and a waiter back for a
+    // suspended game finds its seat as its OPEN did the first time
+    match_suspend(suspended);
+    for(UpgradeItem *item = *items; item; item = item->next){
+        Player *p = item->game ? item->game->p1 : item->player;
+        if(item->game){
+            add_active(p);
+            if(!item->game->p2->bot){
+                add_active(item->game->p2);
+            }
+        }else if(p->open){
+            add_active(p);
+            p->resume = match_claim_suspended(p->name);
+        }
+    }
+    printf("nimd took over %d connection(s) and %d game(s) from the previous process\n", connections, games);
+    return listeners;
+}
@@ -0,0 +1,59 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct Player;
+struct Game;
+struct SuspendedGame;
+
+// zero-downtime restart: on SIGUSR2 the running server starts its binary again with a
+// SOCK_SEQPACKET socket to it and, once the new process asks for it, streams every
+// listener, connection, waiter, game and spectator across, sockets by SCM_RIGHTS.
+// Then it exits. The clients keep their connections and never see the switch
+// UP_TX messages follow a player's own one when its unsent output needs more room
+enum { UP_LISTENER = 1, UP_CONNECTION, UP_WAITER, UP_GAME, UP_SPECTATOR, UP_SUSPENDED, UP_END, UP_TX };
+
+// one piece of state taken over, rebuilt into Players and Games no shard owns yet
+typedef struct UpgradeItem {
+    int type; // UP_CONNECTION, UP_WAITER, UP_GAME or UP_SPECTATOR
+    int shard; // shard of the old process it lived on, a game's spectators share its shard
+    struct Player *player; // all but UP_GAME, a spectator's name is the player it watches
+    struct Game *game; // UP_GAME, both seats set up, p2 may be the bot
+    bool waited; // UP_WAITER: was sent WAIT, otherwise it was still being paired
+    struct UpgradeItem *next;
+} UpgradeItem;
+
+// remembers the command line to start the new binary with, and finds out whether this
+// process is itself the new one: NIMD_UPGRADE_FD then names its socket to the old one
+void upgrade_init(char *argv[]);
+bool upgrade_inherited(void);
+
+// old side: forks and execs argv[0] without waiting for it. Returns the socket that
+// turns readable once the new process is up (or gone), -1 if it could not be started.
+// The caller keeps serving meanwhile and then calls upgrade_ready, or upgrade_abandon
+// if UPGRADE_READY_MS pass first. Only one upgrade is pending at a time
+#define UPGRADE_READY_MS 5000 // the new binary has this long to start up
+int upgrade_spawn(void);
+// true if the new process is asking for the state, which the send functions then pass
+// on. False if it died starting up, it is then given up on like upgrade_abandon does
+bool upgrade_ready(void);
+void upgrade_abandon(void);
+
+// old side, callable from any thread: each passes one item on, false if it could not.
+// The caller keeps its copies of the fds, they close when it exits
+bool upgrade_send_listener(int fd, int shard);
+bool upgrade_send_player(int type, struct Player *p, bool waited, int shard);
+bool upgrade_send_spectator(struct Player *p, const char *watched, int shard);
+bool upgrade_send_game(struct Game *g, int shard);
+bool upgrade_send_suspended(const struct SuspendedGame *s);
+void upgrade_finish(void); // everything is across: UP_END, then the socket is closed
+
+// new side, before any shard runs: reads everything up to UP_END. Listeners fill
+// listen_fds (past max they are closed), suspended games go to match_suspend, open
+// players into the name registry and the rest is left in *items. Returns the number of
+// listeners
+int upgrade_receive(int *listen_fds, int max, UpgradeItem **items);
+
+#endif
@@ -0,0 +1,217 @@
+#define _GNU_SOURCE
+
+#include "uring.h"
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define BUFFER_GROUP 0
+
+static int sys_setup(unsigned entries, struct io_uring_params *p){
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz){
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args){
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int setup_buffers(Uring *u, unsigned count, unsigned size){
+    size_t ring_bytes = count * sizeof(struct io_uring_buf);
+    u->buffer_count = count;
+    u->buffer_size = size;
+    u->buf_ring = mmap(NULL, ring_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->buffers = mmap(NULL, (size_t)count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(u->buf_ring == MAP_FAILED || u->buffers == MAP_FAILED){
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = BUFFER_GROUP;
+    if(sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+        return -1;
+    }
+    for(unsigned bid = 0; bid < count; bid++){
+        uring_recycle(u, bid);
+    }
+    return 0;
+}
+
+int uring_init(Uring *u, unsigned entries, unsigned buffer_count, unsigned buffer_size){
+    memset(u, 0, sizeof(Uring));
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4; // multishot requests post many completions per submission
+    u->fd = sys_setup(entries, &p);
+    if(u->fd < 0){
+        return -1;
+    }
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)){
+        close(u->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_bytes = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_bytes = (sq_bytes > cq_bytes) ? sq_bytes : cq_bytes;
+    u->sqe_bytes = p.sq_entries * sizeof(struct io_uring_sqe);
+    char *ring = mmap(NULL, u->ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->ring_mem = ring;
+    u->sqes = mmap(NULL, u->sqe_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if(ring == MAP_FAILED || u->sqes == MAP_FAILED){
+        uring_free(u);
+        return -1;
+    }
+
+    u->sq_head = (unsigned *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    u->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(ring + p.sq_off.array);
+    u->cq_head = (unsigned *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    if(setup_buffers(u, buffer_count, buffer_size) < 0){
+        uring_free(u);
+        return -1;
+    }
+    return 0;
+}
+
+// also undoes a uring_init that failed halfway, whatever it did not get to is NULL
+void uring_free(Uring *u){
+    int saved_errno = errno;
+    if(u->ring_mem && u->ring_mem != MAP_FAILED){
+        munmap(u->ring_mem, u->ring_bytes);
+    }
+    if(u->sqes && u->sqes != MAP_FAILED){
+        munmap(u->sqes, u->sqe_bytes);
+    }
+    if(u->buf_ring && u->buf_ring != MAP_FAILED){
+        munmap(u->buf_ring, u->buffer_count * sizeof(struct io_uring_buf));
+    }
+    if(u->buffers && u->buffers != MAP_FAILED){
+        munmap(u->buffers, (size_t)u->buffer_count * u->buffer_size);
+    }
+    close(u->fd);
+    memset(u, 0, sizeof(Uring));
+    u->fd = -1;
+    errno = saved_errno; // the caller reports why init failed
+}
+
+struct io_uring_sqe *uring_sqe(Uring *u){
+    unsigned tail = *u->sq_tail;
+    if(tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > u->sq_mask){
+        uring_enter(u, 0);
+        tail = *u->sq_tail;
+    }
+
+    unsigned index = tail & u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->sq_pending++;
+    return sqe;
+}
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data){
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data){
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, unsigned len, uint64_t user_data){
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    // never parked inside the kernel: the completion is posted before io_uring_enter
+    // returns, so the buffer is free again by the time anything else can touch it
+    sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, unsigned events, int multishot, uint64_t user_data){
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = user_data;
+}
+
+int uring_enter(Uring *u, int wait_ms){
+    unsigned submit = u->sq_pending;
+    u->sq_pending = 0;
+    if(wait_ms == 0){
+        return (submit > 0) ? sys_enter(u->fd, submit, 0, 0, NULL, 0) : 0;
+    }
+
+    struct __kernel_timespec ts = { .tv_sec = wait_ms / 1000, .tv_nsec = (wait_ms % 1000) * 1000000L };
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (wait_ms > 0) ? (uint64_t)(uintptr_t)&ts : 0;
+    int r = sys_enter(u->fd, submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    return (r < 0) ? -1 : 0;
+}
+
+unsigned uring_ready(const Uring *u){
+    return __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) - *u->cq_head;
+}
+
+struct io_uring_cqe *uring_cqe_at(Uring *u, unsigned index){
+    return &u->cqes[(*u->cq_head + index) & u->cq_mask];
+}
+
+void uring_consume(Uring *u, unsigned count){
+    __atomic_store_n(u->cq_head, *u->cq_head + count, __ATOMIC_RELEASE);
+}
+
+char *uring_buffer(Uring *u, unsigned bid){
+    return u->buffers + (size_t)bid * u->buffer_size;
+}
+
+void uring_recycle(Uring *u, unsigned bid){
+    unsigned short tail = u->buf_ring->tail;
+    struct io_uring_buf *buf = &u->buf_ring->bufs[tail & (u->buffer_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(u, bid);
+    buf->len = u->buffer_size;
+    buf->bid = bid;
+    __atomic_store_n(&u->buf_ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+int uring_cancel_fd(Uring *u, int fd){
+    struct io_uring_sync_cancel_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.fd = fd;
+    reg.flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    reg.timeout.tv_sec = -1;
+    reg.timeout.tv_nsec = -1;
+    int r = sys_register(u->fd, IORING_REGISTER_SYNC_CANCEL, &reg, 1);
+    return (r < 0 && errno != ENOENT) ? -1 : 0;
+}
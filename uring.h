@@ -0,0 +1,60 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// just enough io_uring for the reactor, on the raw syscalls so there is no liburing
+// dependency. One ring per shard, only its thread touches it. Received data lands in
+// a ring of provided buffers (group 0) that the kernel picks from
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_pending; // prepared since the last submit
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;
+    unsigned buffer_count; // power of two
+    unsigned buffer_size;
+    char *ring_mem; // the mappings uring_free undoes
+    size_t ring_bytes;
+    size_t sqe_bytes;
+} Uring;
+
+// -1 with errno set if the kernel lacks what the reactor needs (multishot recv and
+// provided buffer rings, 6.0 or later)
+int uring_init(Uring *u, unsigned entries, unsigned buffer_count, unsigned buffer_size);
+void uring_free(Uring *u);
+
+// a zeroed SQE, the queue is submitted first if it is full
+struct io_uring_sqe *uring_sqe(Uring *u);
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, unsigned len, uint64_t user_data);
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, unsigned events, int multishot, uint64_t user_data);
+
+// submits everything prepared and waits up to wait_ms (-1 forever, 0 not at all) for
+// a completion. 0 or -1 with errno, ETIME and EINTR just mean nothing arrived
+int uring_enter(Uring *u, int wait_ms);
+
+// completions not yet consumed, index 0 is the oldest. Entries may be rewritten in
+// place (user_data 0 marks one as already handled) until they are consumed
+unsigned uring_ready(const Uring *u);
+struct io_uring_cqe *uring_cqe_at(Uring *u, unsigned index);
+void uring_consume(Uring *u, unsigned count);
+
+char *uring_buffer(Uring *u, unsigned bid);
+void uring_recycle(Uring *u, unsigned bid); // hands a provided buffer back to the kernel
+
+// cancels every request on fd and waits until their completions are posted
+int uring_cancel_fd(Uring *u, int fd);
+
+#endif